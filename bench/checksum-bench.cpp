@@ -0,0 +1,135 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Microbenchmark: checksumming an uncompressed IDAT payload
+//
+//   three-pass : crc32_16bytes() + update_adler32_scalar() + copy to output buffer
+//   fused      : update_crc32_adler32()                    + copy to output buffer
+//
+// Also compares the CRC32 on its own: slicing-by-16 vs crc32_fast() (which
+// uses carry-less multiplication if this CPU supports it), and the ADLER32
+// on its own: scalar vs update_adler32() (SSSE3/AVX2 if supported)
+//
+// The copy stands in for std::ofstream::write() copying into its buffer.
+// Each 'IDAT' is a 65535 byte stripe, i.e. the largest stored DEFLATE block.
+//
+// Build and run from the package root (not part of the R package build):
+//
+//   g++ -O2 -Isrc -o checksum-bench bench/checksum-bench.cpp src/crc32.cpp
+//       src/crc32-pclmul.cpp src/adler32.cpp src/adler32-ssse3.cpp
+//       src/adler32-avx2.cpp src/cpu-features.cpp src/checksum.cpp
+//   ./checksum-bench
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "crc32.h"
+#include "adler32.h"
+#include "checksum.h"
+
+static const size_t STRIPE = 65535;
+static const int    NITER  = 4000;
+
+static double now_ns() {
+  return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static unsigned long long now_cycles() {
+#ifdef HAVE_RDTSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+int main() {
+  std::vector<unsigned char> stripe(STRIPE), out(STRIPE);
+  for (size_t i = 0; i < STRIPE; i++) {
+    stripe[i] = (unsigned char)(i * 7 + (i >> 8));
+  }
+
+  uint32_t crc_a = 0, adler_a = 1;
+  uint32_t crc_b = 0, adler_b = 1;
+
+  // three-pass
+  double t0 = now_ns();
+  unsigned long long c0 = now_cycles();
+  for (int iter = 0; iter < NITER; iter++) {
+    crc_a   = crc32_16bytes(&stripe[0], STRIPE, crc_a);
+    adler_a = update_adler32_scalar(adler_a, &stripe[0], STRIPE);
+    memcpy(&out[0], &stripe[0], STRIPE);
+  }
+  unsigned long long c1 = now_cycles();
+  double t1 = now_ns();
+
+  // fused
+  for (int iter = 0; iter < NITER; iter++) {
+    update_crc32_adler32(&stripe[0], STRIPE, crc_b, adler_b);
+    memcpy(&out[0], &stripe[0], STRIPE);
+  }
+  unsigned long long c2 = now_cycles();
+  double t2 = now_ns();
+
+  if (crc_a != crc_b || adler_a != adler_b) {
+    printf("Checksum mismatch! %08x/%08x vs %08x/%08x\n", crc_a, adler_a, crc_b, adler_b);
+    return 1;
+  }
+
+  // CRC32 only
+  uint32_t crc_c = 0, crc_d = 0;
+  for (int iter = 0; iter < NITER; iter++) {
+    crc_c = crc32_16bytes(&stripe[0], STRIPE, crc_c);
+  }
+  unsigned long long c3 = now_cycles();
+  double t3 = now_ns();
+  for (int iter = 0; iter < NITER; iter++) {
+    crc_d = crc32_fast(&stripe[0], STRIPE, crc_d);
+  }
+  unsigned long long c4 = now_cycles();
+  double t4 = now_ns();
+
+  if (crc_c != crc_d) {
+    printf("CRC32 mismatch! %08x vs %08x\n", crc_c, crc_d);
+    return 1;
+  }
+
+  // ADLER32 only
+  uint32_t adler_c = 1, adler_d = 1;
+  for (int iter = 0; iter < NITER; iter++) {
+    adler_c = update_adler32_scalar(adler_c, &stripe[0], STRIPE);
+  }
+  unsigned long long c5 = now_cycles();
+  double t5 = now_ns();
+  for (int iter = 0; iter < NITER; iter++) {
+    adler_d = update_adler32(adler_d, &stripe[0], STRIPE);
+  }
+  unsigned long long c6 = now_cycles();
+  double t6 = now_ns();
+
+  if (adler_c != adler_d) {
+    printf("ADLER32 mismatch! %08x vs %08x\n", adler_c, adler_d);
+    return 1;
+  }
+
+  double bytes = (double)STRIPE * NITER;
+  printf("%-12s %10s %12s\n", "", "MB/s", "bytes/cycle");
+  printf("%-12s %10.0f %12.3f\n", "three-pass", bytes / (t1 - t0) * 1e3, c1 > c0 ? bytes / (c1 - c0) : 0);
+  printf("%-12s %10.0f %12.3f\n", "fused"     , bytes / (t2 - t1) * 1e3, c2 > c1 ? bytes / (c2 - c1) : 0);
+  printf("\n");
+  printf("%-12s %10.0f %12.3f\n", "crc32 table", bytes / (t3 - t2) * 1e3, c3 > c2 ? bytes / (c3 - c2) : 0);
+  printf("%-12s %10.0f %12.3f   (%s)\n", "crc32 fast" , bytes / (t4 - t3) * 1e3, c4 > c3 ? bytes / (c4 - c3) : 0,
+         crc32_fast_is_clmul() ? "carry-less multiply" : "slicing-by-16");
+  printf("\n");
+  printf("%-12s %10.0f %12.3f\n", "adler scalar", bytes / (t5 - t4) * 1e3, c5 > c4 ? bytes / (c5 - c4) : 0);
+  printf("%-12s %10.0f %12.3f   (%s)\n", "adler fast" , bytes / (t6 - t5) * 1e3, c6 > c5 ? bytes / (c6 - c5) : 0,
+         adler32_is_simd() ? "SIMD" : "scalar");
+  return 0;
+}
@@ -0,0 +1,123 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Microbenchmark: quantising contiguous doubles to 8-bit samples
+//
+//   loop  : the plain '(unsigned char)(v * scale + offset)' loop which each
+//           writer used to have
+//   scalar: quantise8_scalar()
+//   sse2  : quantise8_sse2()   (16 per loop)
+//   avx2  : quantise8_avx2()   (32 per loop, only if the CPU has AVX2)
+//   stream: quantise8_stream(), i.e. the best of the above with
+//           non-temporal stores
+//
+// Each kernel (other than 'loop') is checked against SampleScale::one()
+// using the same scale as 'invert = TRUE', on data which also has NaN, Inf
+// and values outside [0, 1].  'loop' is only timed: it wraps these values
+// around rather than clamping them.
+//
+// Build and run from the package root (not part of the R package build):
+//
+//   g++ -O2 -Isrc -o quantise-bench bench/quantise-bench.cpp
+//       src/quantise.cpp src/quantise-avx2.cpp src/cpu-features.cpp
+//   ./quantise-bench
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdio.h>
+#include <stddef.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+
+#include "quantise.h"
+#include "cpu-features.h"
+
+static double now_ms() {
+  return (double)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count() / 1000.0;
+}
+
+
+static void by_loop(unsigned char *out, const double *v, size_t n,
+                    const SampleScale &scale, bool) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = (unsigned char)(v[i] * scale.scale_factor + scale.round_offset);
+  }
+}
+
+
+static void by_one(unsigned char *out, const double *v, size_t n,
+                   const SampleScale &scale) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = scale.one(v[i]);
+  }
+}
+
+
+static void by_stream(unsigned char *out, const double *v, size_t n,
+                      const SampleScale &scale, bool) {
+  quantise8_stream(out, v, n, scale);
+}
+
+
+typedef void (*kernel)(unsigned char *, const double *, size_t, const SampleScale &, bool);
+
+
+int main() {
+  struct { const char *name; size_t n; int reps; } sizes[] = {
+    {"small  (100 x 100)  ",      100 *  100, 5000},
+    {"medium (1000 x 1000)",     1000 * 1000,   50},
+    {"large  (3000 x 4000)",     3000 * 4000,    5},
+  };
+
+  struct { const char *name; kernel f; bool ok; bool check; } kernels[] = {
+    {"loop"  , by_loop         , true, false},
+    {"scalar", quantise8_scalar, true, true},
+    {"sse2"  , quantise8_sse2  , true, true},
+#ifdef FOIST_X86_DISPATCH
+    {"avx2"  , quantise8_avx2  , cpu_features().avx2, true},
+#else
+    {"avx2"  , quantise8_scalar, false, true},
+#endif
+    {"stream", by_stream       , true, true},
+  };
+
+  const SampleScale scale(255, 0.5, false, 255, 0);
+  const SampleScale inverted(-255, -1.5, true, 255, 0);
+  const size_t nkernels = sizeof(kernels) / sizeof(kernels[0]);
+
+  printf("%-22s", "");
+  for (size_t j = 0; j < nkernels; j++) printf(" %10s", kernels[j].name);
+  printf("\n");
+
+  for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    const size_t n = sizes[k].n;
+    std::vector<double> v(n), w(n);
+    for (size_t i = 0; i < n; i++) {
+      v[i] = (double)(i % 997) / 996.0;
+      w[i] = i % 13 == 0 ? NAN : i % 17 == 0 ? -INFINITY : (double)(i % 1009) / 500.0 - 0.5;
+    }
+    std::vector<unsigned char> ref(n), a(n), b(n);
+    by_one(&ref[0], &w[0], n, inverted);
+
+    printf("%-22s", sizes[k].name);
+    for (size_t j = 0; j < nkernels; j++) {
+      if (!kernels[j].ok) {
+        printf(" %10s", "-");
+        continue;
+      }
+      double t0 = now_ms();
+      for (int r = 0; r < sizes[k].reps; r++) kernels[j].f(&a[0], &v[0], n, scale, false);
+      double t = (now_ms() - t0) / sizes[k].reps;
+
+      bool same = true;
+      if (kernels[j].check) {
+        kernels[j].f(&b[0], &w[0], n, inverted, false);
+        same = b == ref;
+      }
+      printf(" %8.3fms%s", t, same ? "" : "!");
+    }
+    printf("\n");
+  }
+
+  printf("\n'!' marks a kernel whose output differs from SampleScale::one()\n");
+  return 0;
+}
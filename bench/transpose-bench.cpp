@@ -0,0 +1,109 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Microbenchmark: converting an R matrix to row-major 8-bit samples
+//
+//   row   : one output row at a time, reading along the R row (a stride of
+//           'nrow' doubles between pixels).  This is how convert_to_row_major
+//           was done before quantise8_rows()
+//   band  : QUANTISE_BAND_ROWS output rows at a time with quantise8_rows(),
+//           reading down the R columns and transposing 16 x 16 tiles
+//   column: reading straight down the R columns with no reordering, i.e.
+//           convert_to_row_major = FALSE.  The lower bound.
+//
+// Grey is one plane written with a step of 1; RGB is three planes
+// interleaved into each output row with a step of 3.
+//
+// Build and run from the package root (not part of the R package build):
+//
+//   g++ -O2 -Isrc -o transpose-bench bench/transpose-bench.cpp src/quantise.cpp
+//       src/quantise-avx2.cpp src/cpu-features.cpp
+//   ./transpose-bench
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdio.h>
+#include <stddef.h>
+#include <chrono>
+#include <vector>
+
+#include "quantise.h"
+
+static double now_ms() {
+  return (double)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count() / 1000.0;
+}
+
+
+static void by_row(unsigned char *out, const double *v, size_t nrow, size_t ncol,
+                   size_t depth) {
+  const size_t plane = nrow * ncol;
+  for (size_t row = 0; row < nrow; row++) {
+    for (size_t col = 0; col < ncol; col++) {
+      for (size_t p = 0; p < depth; p++) {
+        *out++ = (unsigned char)(v[row + col * nrow + p * plane] * 255 + 0.5);
+      }
+    }
+  }
+}
+
+
+static void by_band(unsigned char *out, const double *v, size_t nrow, size_t ncol,
+                    size_t depth) {
+  const SampleScale scale(255, 0.5, false, 255, 0);
+  const size_t    plane    = nrow * ncol;
+  const ptrdiff_t rowbytes = (ptrdiff_t)(ncol * depth);
+  for (size_t row = 0; row < nrow; row += QUANTISE_BAND_ROWS) {
+    size_t n = nrow - row < QUANTISE_BAND_ROWS ? nrow - row : QUANTISE_BAND_ROWS;
+    for (size_t p = 0; p < depth; p++) {
+      quantise8_rows(out + row * rowbytes + p, rowbytes, depth, v + row + p * plane,
+                     nrow, n, ncol, scale);
+    }
+  }
+}
+
+
+static void by_column(unsigned char *out, const double *v, size_t nrow, size_t ncol,
+                      size_t depth) {
+  const size_t plane = nrow * ncol;
+  for (size_t i = 0; i < plane; i++) {
+    for (size_t p = 0; p < depth; p++) {
+      *out++ = (unsigned char)(v[i + p * plane] * 255 + 0.5);
+    }
+  }
+}
+
+
+int main() {
+  struct { const char *name; size_t nrow, ncol, depth; int reps; } images[] = {
+    {"small  (100 x 100 grey)  ",  100,  100, 1, 2000},
+    {"medium (1000 x 1000 RGB) ", 1000, 1000, 3,   20},
+    {"large  (3000 x 4000 grey)", 3000, 4000, 1,    4},
+    {"large  (3000 x 4000 RGB) ", 3000, 4000, 3,    4},
+  };
+
+  printf("%-27s %10s %10s %10s\n", "", "row", "band", "column");
+
+  for (size_t k = 0; k < sizeof(images) / sizeof(images[0]); k++) {
+    const size_t nrow = images[k].nrow, ncol = images[k].ncol, depth = images[k].depth;
+    std::vector<double> v(nrow * ncol * depth);
+    for (size_t i = 0; i < v.size(); i++) {
+      v[i] = (double)(i % 997) / 996.0;
+    }
+    std::vector<unsigned char> a(v.size()), b(v.size()), c(v.size());
+
+    double t0 = now_ms();
+    for (int r = 0; r < images[k].reps; r++) by_row(&a[0], &v[0], nrow, ncol, depth);
+    double t_row = (now_ms() - t0) / images[k].reps;
+
+    t0 = now_ms();
+    for (int r = 0; r < images[k].reps; r++) by_band(&b[0], &v[0], nrow, ncol, depth);
+    double t_band = (now_ms() - t0) / images[k].reps;
+
+    t0 = now_ms();
+    for (int r = 0; r < images[k].reps; r++) by_column(&c[0], &v[0], nrow, ncol, depth);
+    double t_column = (now_ms() - t0) / images[k].reps;
+
+    printf("%-27s %8.3fms %8.3fms %8.3fms%s\n", images[k].name, t_row, t_band, t_column,
+           a == b ? "" : "  MISMATCH");
+  }
+
+  return 0;
+}
@@ -0,0 +1,194 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Microbenchmark: writing the IDAT chunks of an uncompressed PNG
+//
+//   ofstream : a separate std::ofstream::write() for each field of each
+//              chunk (length, "IDAT", zlib header, DEFLATE header, data,
+//              ADLER32, CRC32)
+//   block    : every field copied into a 1MB block, which is written with
+//              write(2) when full.  This is how a file descriptor was
+//              written before gathered writes (see BlockBuf in src/output.h)
+//   writev   : the framing for IDAT_BATCH chunks built up front, and written
+//              with the data in place with one writev(2)
+//
+// For 'block' and 'writev' the number of system calls and the number of
+// bytes copied in user space are counted exactly.  The data is not
+// checksummed - that is the same for all three, and is covered by
+// checksum-bench.cpp.
+//
+// Build and run from the package root (not part of the R package build):
+//
+//   g++ -O2 -o writev-bench bench/writev-bench.cpp
+//   ./writev-bench [output file, default /dev/null]
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <chrono>
+#include <fstream>
+#include <vector>
+
+static const size_t IDAT_BUDGET = 65535;
+static const size_t IDAT_BATCH  = 16;
+static const size_t BLOCK_SIZE  = 1 << 20;
+
+static double now_ms() {
+  return (double)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count() / 1000.0;
+}
+
+struct Counts {
+  size_t syscalls;
+  size_t copied;
+};
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Headers of one chunk: length, "IDAT", (zlib header), DEFLATE header
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static size_t make_header(unsigned char *hdr, size_t len, bool first, bool final) {
+  unsigned char *p = hdr;
+  size_t data_length = 5 + len + (first ? 2 : 0) + (final ? 4 : 0);
+  *p++ = data_length >> 24; *p++ = data_length >> 16; *p++ = data_length >> 8; *p++ = data_length;
+  *p++ = 'I'; *p++ = 'D'; *p++ = 'A'; *p++ = 'T';
+  if (first) { *p++ = 0x78; *p++ = 0x01; }
+  *p++ = final ? 1 : 0;
+  *p++ = len & 0xFF; *p++ = len >> 8; *p++ = ~len & 0xFF; *p++ = (~len >> 8) & 0xFF;
+  return p - hdr;
+}
+
+
+static void write_ofstream(const char *path, const std::vector<unsigned char> &data) {
+  std::ofstream out(path, std::ios::out | std::ios::binary);
+  const unsigned char adler[4] = {1, 2, 3, 4}, crc[4] = {5, 6, 7, 8};
+  for (size_t pos = 0; pos < data.size(); pos += IDAT_BUDGET) {
+    size_t len   = data.size() - pos < IDAT_BUDGET ? data.size() - pos : IDAT_BUDGET;
+    bool   first = pos == 0, final = pos + len == data.size();
+    unsigned char hdr[19];
+    size_t hlen = make_header(hdr, len, first, final);
+    out.write((const char *)hdr, 4);
+    out.write((const char *)hdr + 4, 4);
+    if (first) out.write((const char *)hdr + 8, 2);
+    out.write((const char *)hdr + hlen - 5, 5);
+    out.write((const char *)&data[pos], len);
+    if (final) out.write((const char *)adler, 4);
+    out.write((const char *)crc, 4);
+  }
+}
+
+
+static Counts write_block(int fd, const std::vector<unsigned char> &data) {
+  Counts c = {0, 0};
+  std::vector<unsigned char> block(BLOCK_SIZE);
+  size_t used = 0;
+
+  // Copy into the block, writing it whenever it fills up
+  auto put = [&](const unsigned char *s, size_t n) {
+    while (n > 0) {
+      size_t k = BLOCK_SIZE - used < n ? BLOCK_SIZE - used : n;
+      memcpy(&block[used], s, k);
+      c.copied += k;
+      used += k; s += k; n -= k;
+      if (used == BLOCK_SIZE) {
+        if (write(fd, &block[0], used) < 0) perror("write");
+        c.syscalls++;
+        used = 0;
+      }
+    }
+  };
+
+  const unsigned char adler[4] = {1, 2, 3, 4}, crc[4] = {5, 6, 7, 8};
+  for (size_t pos = 0; pos < data.size(); pos += IDAT_BUDGET) {
+    size_t len   = data.size() - pos < IDAT_BUDGET ? data.size() - pos : IDAT_BUDGET;
+    bool   first = pos == 0, final = pos + len == data.size();
+    unsigned char hdr[19];
+    put(hdr, make_header(hdr, len, first, final));
+    put(&data[pos], len);
+    if (final) put(adler, 4);
+    put(crc, 4);
+  }
+  if (used > 0) {
+    if (write(fd, &block[0], used) < 0) perror("write");
+    c.syscalls++;
+  }
+  return c;
+}
+
+
+static Counts write_gathered(int fd, const std::vector<unsigned char> &data) {
+  Counts c = {0, 0};
+  std::vector<unsigned char> frames(IDAT_BATCH * 32);
+  std::vector<struct iovec>  iov;
+
+  const unsigned char crc[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+  for (size_t pos = 0; pos < data.size(); ) {
+    iov.clear();
+    for (size_t i = 0; i < IDAT_BATCH && pos < data.size(); i++) {
+      size_t len   = data.size() - pos < IDAT_BUDGET ? data.size() - pos : IDAT_BUDGET;
+      bool   first = pos == 0, final = pos + len == data.size();
+      unsigned char *hdr = &frames[i * 32];
+      struct iovec v[3] = {
+        {hdr, make_header(hdr, len, first, final)},
+        {(void *)&data[pos], len},
+        {(void *)crc, (size_t)(final ? 8 : 4)}
+      };
+      iov.insert(iov.end(), v, v + 3);
+      pos += len;
+    }
+    if (writev(fd, &iov[0], (int)iov.size()) < 0) perror("writev");
+    c.syscalls++;
+  }
+  return c;
+}
+
+
+int main(int argc, char **argv) {
+  const char *path = argc > 1 ? argv[1] : "/dev/null";
+
+  struct { const char *name; size_t bytes; int reps; } images[] = {
+    {"small  (100 x 100 grey)    ", 100 * (100 + 1),      2000},
+    {"medium (1000 x 1000 RGB)   ", 1000 * (3000 + 1),      40},
+    {"large  (4000 x 3000 RGB)   ", 3000 * (12000 + 1),      4},
+  };
+
+  printf("output: %s\n\n", path);
+  printf("%-28s %10s %10s %10s %16s %16s\n", "", "ofstream", "block", "writev",
+         "syscalls b/w", "copied MB b/w");
+
+  for (size_t k = 0; k < sizeof(images) / sizeof(images[0]); k++) {
+    std::vector<unsigned char> data(images[k].bytes);
+    for (size_t i = 0; i < data.size(); i++) {
+      data[i] = (unsigned char)(i * 7 + (i >> 8));
+    }
+
+    double t0 = now_ms();
+    for (int r = 0; r < images[k].reps; r++) write_ofstream(path, data);
+    double t_ofstream = (now_ms() - t0) / images[k].reps;
+
+    Counts cb = {0, 0}, cg = {0, 0};
+
+    t0 = now_ms();
+    for (int r = 0; r < images[k].reps; r++) {
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      cb = write_block(fd, data);
+      close(fd);
+    }
+    double t_block = (now_ms() - t0) / images[k].reps;
+
+    t0 = now_ms();
+    for (int r = 0; r < images[k].reps; r++) {
+      int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      cg = write_gathered(fd, data);
+      close(fd);
+    }
+    double t_gather = (now_ms() - t0) / images[k].reps;
+
+    printf("%-28s %8.3fms %8.3fms %8.3fms %7zu / %-6zu %7.2f / %-6.2f\n", images[k].name,
+           t_ofstream, t_block, t_gather, cb.syscalls, cg.syscalls,
+           cb.copied / 1e6, cg.copied / 1e6);
+  }
+
+  return 0;
+}
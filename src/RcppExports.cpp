@@ -5,62 +5,254 @@
 
 using namespace Rcpp;
 
+// crc32_raw
+double crc32_raw(const RawVector x, const double crc);
+RcppExport SEXP _foist_crc32_raw(SEXP xSEXP, SEXP crcSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const RawVector >::type x(xSEXP);
+    Rcpp::traits::input_parameter< const double >::type crc(crcSEXP);
+    rcpp_result_gen = Rcpp::wrap(crc32_raw(x, crc));
+    return rcpp_result_gen;
+END_RCPP
+}
+// adler32_raw
+double adler32_raw(const RawVector x, const double adler);
+RcppExport SEXP _foist_adler32_raw(SEXP xSEXP, SEXP adlerSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const RawVector >::type x(xSEXP);
+    Rcpp::traits::input_parameter< const double >::type adler(adlerSEXP);
+    rcpp_result_gen = Rcpp::wrap(adler32_raw(x, adler));
+    return rcpp_result_gen;
+END_RCPP
+}
+// crc32_combine_r
+double crc32_combine_r(const double crc1, const double crc2, const double len2);
+RcppExport SEXP _foist_crc32_combine_r(SEXP crc1SEXP, SEXP crc2SEXP, SEXP len2SEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const double >::type crc1(crc1SEXP);
+    Rcpp::traits::input_parameter< const double >::type crc2(crc2SEXP);
+    Rcpp::traits::input_parameter< const double >::type len2(len2SEXP);
+    rcpp_result_gen = Rcpp::wrap(crc32_combine_r(crc1, crc2, len2));
+    return rcpp_result_gen;
+END_RCPP
+}
+// adler32_combine_r
+double adler32_combine_r(const double adler1, const double adler2, const double len2);
+RcppExport SEXP _foist_adler32_combine_r(SEXP adler1SEXP, SEXP adler2SEXP, SEXP len2SEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const double >::type adler1(adler1SEXP);
+    Rcpp::traits::input_parameter< const double >::type adler2(adler2SEXP);
+    Rcpp::traits::input_parameter< const double >::type len2(len2SEXP);
+    rcpp_result_gen = Rcpp::wrap(adler32_combine_r(adler1, adler2, len2));
+    return rcpp_result_gen;
+END_RCPP
+}
+// writer_append_rows
+int writer_append_rows(SEXP writer, SEXP block, const IntegerVector dims);
+RcppExport SEXP _foist_writer_append_rows(SEXP writerSEXP, SEXP blockSEXP, SEXP dimsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type writer(writerSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type block(blockSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector >::type dims(dimsSEXP);
+    rcpp_result_gen = Rcpp::wrap(writer_append_rows(writer, block, dims));
+    return rcpp_result_gen;
+END_RCPP
+}
+// writer_close
+SEXP writer_close(SEXP writer);
+RcppExport SEXP _foist_writer_close(SEXP writerSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type writer(writerSEXP);
+    rcpp_result_gen = Rcpp::wrap(writer_close(writer));
+    return rcpp_result_gen;
+END_RCPP
+}
 // write_gif_core
-void write_gif_core(const NumericVector vec, const IntegerVector dims, const std::string filename, const bool convert_to_row_major, const bool flipy, const bool invert, const double intensity_factor, Rcpp::IntegerMatrix pal);
-RcppExport SEXP _foist_write_gif_core(SEXP vecSEXP, SEXP dimsSEXP, SEXP filenameSEXP, SEXP convert_to_row_majorSEXP, SEXP flipySEXP, SEXP invertSEXP, SEXP intensity_factorSEXP, SEXP palSEXP) {
+SEXP write_gif_core(SEXP vec, const IntegerVector dims, SEXP filename, const bool convert_to_row_major, const bool flipy, const bool invert, const double intensity_factor, Rcpp::IntegerMatrix pal, const int na_value);
+RcppExport SEXP _foist_write_gif_core(SEXP vecSEXP, SEXP dimsSEXP, SEXP filenameSEXP, SEXP convert_to_row_majorSEXP, SEXP flipySEXP, SEXP invertSEXP, SEXP intensity_factorSEXP, SEXP palSEXP, SEXP na_valueSEXP) {
 BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< const NumericVector >::type vec(vecSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type vec(vecSEXP);
     Rcpp::traits::input_parameter< const IntegerVector >::type dims(dimsSEXP);
-    Rcpp::traits::input_parameter< const std::string >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type filename(filenameSEXP);
     Rcpp::traits::input_parameter< const bool >::type convert_to_row_major(convert_to_row_majorSEXP);
     Rcpp::traits::input_parameter< const bool >::type flipy(flipySEXP);
     Rcpp::traits::input_parameter< const bool >::type invert(invertSEXP);
     Rcpp::traits::input_parameter< const double >::type intensity_factor(intensity_factorSEXP);
     Rcpp::traits::input_parameter< Rcpp::IntegerMatrix >::type pal(palSEXP);
-    write_gif_core(vec, dims, filename, convert_to_row_major, flipy, invert, intensity_factor, pal);
-    return R_NilValue;
+    Rcpp::traits::input_parameter< const int >::type na_value(na_valueSEXP);
+    rcpp_result_gen = Rcpp::wrap(write_gif_core(vec, dims, filename, convert_to_row_major, flipy, invert, intensity_factor, pal, na_value));
+    return rcpp_result_gen;
+END_RCPP
+}
+// gif_writer_open
+SEXP gif_writer_open(SEXP filename, const IntegerVector dims, const bool convert_to_row_major, const bool invert, const double intensity_factor, Rcpp::IntegerMatrix pal, const int na_value);
+RcppExport SEXP _foist_gif_writer_open(SEXP filenameSEXP, SEXP dimsSEXP, SEXP convert_to_row_majorSEXP, SEXP invertSEXP, SEXP intensity_factorSEXP, SEXP palSEXP, SEXP na_valueSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector >::type dims(dimsSEXP);
+    Rcpp::traits::input_parameter< const bool >::type convert_to_row_major(convert_to_row_majorSEXP);
+    Rcpp::traits::input_parameter< const bool >::type invert(invertSEXP);
+    Rcpp::traits::input_parameter< const double >::type intensity_factor(intensity_factorSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerMatrix >::type pal(palSEXP);
+    Rcpp::traits::input_parameter< const int >::type na_value(na_valueSEXP);
+    rcpp_result_gen = Rcpp::wrap(gif_writer_open(filename, dims, convert_to_row_major, invert, intensity_factor, pal, na_value));
+    return rcpp_result_gen;
 END_RCPP
 }
 // write_png_core
-void write_png_core(const NumericVector vec, const IntegerVector dims, const std::string filename, const bool convert_to_row_major, const bool flipy, const bool invert, const double intensity_factor, Rcpp::Nullable<Rcpp::IntegerMatrix> pal);
-RcppExport SEXP _foist_write_png_core(SEXP vecSEXP, SEXP dimsSEXP, SEXP filenameSEXP, SEXP convert_to_row_majorSEXP, SEXP flipySEXP, SEXP invertSEXP, SEXP intensity_factorSEXP, SEXP palSEXP) {
+SEXP write_png_core(SEXP vec, const IntegerVector dims, SEXP filename, const bool convert_to_row_major, const bool flipy, const bool invert, const double intensity_factor, Rcpp::Nullable<Rcpp::IntegerMatrix> pal, const int compression, const int filter, const int threads, const int bits, const bool na_transparent, const int na_value);
+RcppExport SEXP _foist_write_png_core(SEXP vecSEXP, SEXP dimsSEXP, SEXP filenameSEXP, SEXP convert_to_row_majorSEXP, SEXP flipySEXP, SEXP invertSEXP, SEXP intensity_factorSEXP, SEXP palSEXP, SEXP compressionSEXP, SEXP filterSEXP, SEXP threadsSEXP, SEXP bitsSEXP, SEXP na_transparentSEXP, SEXP na_valueSEXP) {
 BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< const NumericVector >::type vec(vecSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type vec(vecSEXP);
     Rcpp::traits::input_parameter< const IntegerVector >::type dims(dimsSEXP);
-    Rcpp::traits::input_parameter< const std::string >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type filename(filenameSEXP);
     Rcpp::traits::input_parameter< const bool >::type convert_to_row_major(convert_to_row_majorSEXP);
     Rcpp::traits::input_parameter< const bool >::type flipy(flipySEXP);
     Rcpp::traits::input_parameter< const bool >::type invert(invertSEXP);
     Rcpp::traits::input_parameter< const double >::type intensity_factor(intensity_factorSEXP);
     Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type pal(palSEXP);
-    write_png_core(vec, dims, filename, convert_to_row_major, flipy, invert, intensity_factor, pal);
-    return R_NilValue;
+    Rcpp::traits::input_parameter< const int >::type compression(compressionSEXP);
+    Rcpp::traits::input_parameter< const int >::type filter(filterSEXP);
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< const int >::type bits(bitsSEXP);
+    Rcpp::traits::input_parameter< const bool >::type na_transparent(na_transparentSEXP);
+    Rcpp::traits::input_parameter< const int >::type na_value(na_valueSEXP);
+    rcpp_result_gen = Rcpp::wrap(write_png_core(vec, dims, filename, convert_to_row_major, flipy, invert, intensity_factor, pal, compression, filter, threads, bits, na_transparent, na_value));
+    return rcpp_result_gen;
 END_RCPP
 }
-// write_pnm_core
-void write_pnm_core(const NumericVector vec, const IntegerVector dims, const std::string filename, const bool convert_to_row_major, const bool flipy, const bool invert, const double intensity_factor, Rcpp::Nullable<Rcpp::IntegerMatrix> pal);
-RcppExport SEXP _foist_write_pnm_core(SEXP vecSEXP, SEXP dimsSEXP, SEXP filenameSEXP, SEXP convert_to_row_majorSEXP, SEXP flipySEXP, SEXP invertSEXP, SEXP intensity_factorSEXP, SEXP palSEXP) {
+// write_apng_core
+SEXP write_apng_core(SEXP frames, Rcpp::Nullable<Rcpp::IntegerVector> dims, const int nframes, SEXP filename, const NumericVector delay, const int loops, const bool crop, const bool convert_to_row_major, const bool flipy, const bool invert, const double intensity_factor, Rcpp::Nullable<Rcpp::IntegerMatrix> pal, const int compression, const int filter, const int na_value);
+RcppExport SEXP _foist_write_apng_core(SEXP framesSEXP, SEXP dimsSEXP, SEXP nframesSEXP, SEXP filenameSEXP, SEXP delaySEXP, SEXP loopsSEXP, SEXP cropSEXP, SEXP convert_to_row_majorSEXP, SEXP flipySEXP, SEXP invertSEXP, SEXP intensity_factorSEXP, SEXP palSEXP, SEXP compressionSEXP, SEXP filterSEXP, SEXP na_valueSEXP) {
 BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
-    Rcpp::traits::input_parameter< const NumericVector >::type vec(vecSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type frames(framesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerVector> >::type dims(dimsSEXP);
+    Rcpp::traits::input_parameter< const int >::type nframes(nframesSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< const NumericVector >::type delay(delaySEXP);
+    Rcpp::traits::input_parameter< const int >::type loops(loopsSEXP);
+    Rcpp::traits::input_parameter< const bool >::type crop(cropSEXP);
+    Rcpp::traits::input_parameter< const bool >::type convert_to_row_major(convert_to_row_majorSEXP);
+    Rcpp::traits::input_parameter< const bool >::type flipy(flipySEXP);
+    Rcpp::traits::input_parameter< const bool >::type invert(invertSEXP);
+    Rcpp::traits::input_parameter< const double >::type intensity_factor(intensity_factorSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type pal(palSEXP);
+    Rcpp::traits::input_parameter< const int >::type compression(compressionSEXP);
+    Rcpp::traits::input_parameter< const int >::type filter(filterSEXP);
+    Rcpp::traits::input_parameter< const int >::type na_value(na_valueSEXP);
+    rcpp_result_gen = Rcpp::wrap(write_apng_core(frames, dims, nframes, filename, delay, loops, crop, convert_to_row_major, flipy, invert, intensity_factor, pal, compression, filter, na_value));
+    return rcpp_result_gen;
+END_RCPP
+}
+// png_writer_open
+SEXP png_writer_open(SEXP filename, const IntegerVector dims, const bool convert_to_row_major, const bool invert, const double intensity_factor, Rcpp::Nullable<Rcpp::IntegerMatrix> pal, const int compression, const int filter, const int bits, const int na_value);
+RcppExport SEXP _foist_png_writer_open(SEXP filenameSEXP, SEXP dimsSEXP, SEXP convert_to_row_majorSEXP, SEXP invertSEXP, SEXP intensity_factorSEXP, SEXP palSEXP, SEXP compressionSEXP, SEXP filterSEXP, SEXP bitsSEXP, SEXP na_valueSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type filename(filenameSEXP);
     Rcpp::traits::input_parameter< const IntegerVector >::type dims(dimsSEXP);
+    Rcpp::traits::input_parameter< const bool >::type convert_to_row_major(convert_to_row_majorSEXP);
+    Rcpp::traits::input_parameter< const bool >::type invert(invertSEXP);
+    Rcpp::traits::input_parameter< const double >::type intensity_factor(intensity_factorSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type pal(palSEXP);
+    Rcpp::traits::input_parameter< const int >::type compression(compressionSEXP);
+    Rcpp::traits::input_parameter< const int >::type filter(filterSEXP);
+    Rcpp::traits::input_parameter< const int >::type bits(bitsSEXP);
+    Rcpp::traits::input_parameter< const int >::type na_value(na_valueSEXP);
+    rcpp_result_gen = Rcpp::wrap(png_writer_open(filename, dims, convert_to_row_major, invert, intensity_factor, pal, compression, filter, bits, na_value));
+    return rcpp_result_gen;
+END_RCPP
+}
+// write_png_pattern
+double write_png_pattern(const std::string filename, const int nrow, const int ncol, const int depth, const int threads);
+RcppExport SEXP _foist_write_png_pattern(SEXP filenameSEXP, SEXP nrowSEXP, SEXP ncolSEXP, SEXP depthSEXP, SEXP threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
     Rcpp::traits::input_parameter< const std::string >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< const int >::type nrow(nrowSEXP);
+    Rcpp::traits::input_parameter< const int >::type ncol(ncolSEXP);
+    Rcpp::traits::input_parameter< const int >::type depth(depthSEXP);
+    Rcpp::traits::input_parameter< const int >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(write_png_pattern(filename, nrow, ncol, depth, threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// write_pnm_core
+SEXP write_pnm_core(SEXP vec, const IntegerVector dims, SEXP filename, const bool convert_to_row_major, const bool flipy, const bool invert, const double intensity_factor, Rcpp::Nullable<Rcpp::IntegerMatrix> pal, const int bits, const int na_value);
+RcppExport SEXP _foist_write_pnm_core(SEXP vecSEXP, SEXP dimsSEXP, SEXP filenameSEXP, SEXP convert_to_row_majorSEXP, SEXP flipySEXP, SEXP invertSEXP, SEXP intensity_factorSEXP, SEXP palSEXP, SEXP bitsSEXP, SEXP na_valueSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type vec(vecSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector >::type dims(dimsSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type filename(filenameSEXP);
     Rcpp::traits::input_parameter< const bool >::type convert_to_row_major(convert_to_row_majorSEXP);
     Rcpp::traits::input_parameter< const bool >::type flipy(flipySEXP);
     Rcpp::traits::input_parameter< const bool >::type invert(invertSEXP);
     Rcpp::traits::input_parameter< const double >::type intensity_factor(intensity_factorSEXP);
     Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type pal(palSEXP);
-    write_pnm_core(vec, dims, filename, convert_to_row_major, flipy, invert, intensity_factor, pal);
-    return R_NilValue;
+    Rcpp::traits::input_parameter< const int >::type bits(bitsSEXP);
+    Rcpp::traits::input_parameter< const int >::type na_value(na_valueSEXP);
+    rcpp_result_gen = Rcpp::wrap(write_pnm_core(vec, dims, filename, convert_to_row_major, flipy, invert, intensity_factor, pal, bits, na_value));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pnm_writer_open
+SEXP pnm_writer_open(SEXP filename, const IntegerVector dims, const bool convert_to_row_major, const bool invert, const double intensity_factor, Rcpp::Nullable<Rcpp::IntegerMatrix> pal, const int bits, const int na_value);
+RcppExport SEXP _foist_pnm_writer_open(SEXP filenameSEXP, SEXP dimsSEXP, SEXP convert_to_row_majorSEXP, SEXP invertSEXP, SEXP intensity_factorSEXP, SEXP palSEXP, SEXP bitsSEXP, SEXP na_valueSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type filename(filenameSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector >::type dims(dimsSEXP);
+    Rcpp::traits::input_parameter< const bool >::type convert_to_row_major(convert_to_row_majorSEXP);
+    Rcpp::traits::input_parameter< const bool >::type invert(invertSEXP);
+    Rcpp::traits::input_parameter< const double >::type intensity_factor(intensity_factorSEXP);
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::IntegerMatrix> >::type pal(palSEXP);
+    Rcpp::traits::input_parameter< const int >::type bits(bitsSEXP);
+    Rcpp::traits::input_parameter< const int >::type na_value(na_valueSEXP);
+    rcpp_result_gen = Rcpp::wrap(pnm_writer_open(filename, dims, convert_to_row_major, invert, intensity_factor, pal, bits, na_value));
+    return rcpp_result_gen;
 END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_foist_write_gif_core", (DL_FUNC) &_foist_write_gif_core, 8},
-    {"_foist_write_png_core", (DL_FUNC) &_foist_write_png_core, 8},
-    {"_foist_write_pnm_core", (DL_FUNC) &_foist_write_pnm_core, 8},
+    {"_foist_crc32_raw", (DL_FUNC) &_foist_crc32_raw, 2},
+    {"_foist_adler32_raw", (DL_FUNC) &_foist_adler32_raw, 2},
+    {"_foist_crc32_combine_r", (DL_FUNC) &_foist_crc32_combine_r, 3},
+    {"_foist_adler32_combine_r", (DL_FUNC) &_foist_adler32_combine_r, 3},
+    {"_foist_writer_append_rows", (DL_FUNC) &_foist_writer_append_rows, 3},
+    {"_foist_writer_close", (DL_FUNC) &_foist_writer_close, 1},
+    {"_foist_write_gif_core", (DL_FUNC) &_foist_write_gif_core, 9},
+    {"_foist_gif_writer_open", (DL_FUNC) &_foist_gif_writer_open, 7},
+    {"_foist_write_png_core", (DL_FUNC) &_foist_write_png_core, 14},
+    {"_foist_write_apng_core", (DL_FUNC) &_foist_write_apng_core, 15},
+    {"_foist_png_writer_open", (DL_FUNC) &_foist_png_writer_open, 10},
+    {"_foist_write_png_pattern", (DL_FUNC) &_foist_write_png_pattern, 5},
+    {"_foist_write_pnm_core", (DL_FUNC) &_foist_write_pnm_core, 10},
+    {"_foist_pnm_writer_open", (DL_FUNC) &_foist_pnm_writer_open, 8},
     {NULL, NULL, 0}
 };
 
@@ -0,0 +1,96 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// ADLER32 using AVX2
+//
+// The same scheme as adler32-ssse3.cpp, but with 256-bit registers and
+// 64 bytes per block:
+//   adler += b[0] + b[1] + ... + b[63]
+//   sum2  += 64 * adler_before + 64*b[0] + 63*b[1] + ... + 1*b[63]
+//
+// Compiled with a per-function 'target' attribute, so only ever call this
+// when cpu_features().avx2 is true.  See update_adler32() in adler32.cpp
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include "adler32.h"
+#include "cpu-features.h"
+
+#ifdef FOIST_X86_DISPATCH
+
+#include <immintrin.h>
+
+#define BASE 65521U  /* largest prime smaller than 65536 */
+#define NMAX 5552    /* NMAX is the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1 */
+
+#define BLOCK_SIZE 64
+
+__attribute__((target("avx2")))
+static inline uint32_t hsum_epi32(__m256i v) {
+  __m128i x = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+  x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t)_mm_cvtsi128_si32(x);
+}
+
+
+__attribute__((target("avx2")))
+uint32_t update_adler32_avx2(uint32_t adler, const unsigned char *buf, size_t len) {
+
+  uint32_t s1 = adler & 0xffff;
+  uint32_t s2 = (adler >> 16) & 0xffff;
+
+  size_t blocks = len / BLOCK_SIZE;
+  len -= blocks * BLOCK_SIZE;
+
+  const __m256i tap1 = _mm256_setr_epi8(64, 63, 62, 61, 60, 59, 58, 57,
+                                        56, 55, 54, 53, 52, 51, 50, 49,
+                                        48, 47, 46, 45, 44, 43, 42, 41,
+                                        40, 39, 38, 37, 36, 35, 34, 33);
+  const __m256i tap2 = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                        24, 23, 22, 21, 20, 19, 18, 17,
+                                        16, 15, 14, 13, 12, 11, 10,  9,
+                                         8,  7,  6,  5,  4,  3,  2,  1);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+
+  while (blocks) {
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // At most NMAX bytes between reductions so that s2 can't overflow
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    size_t n = NMAX / BLOCK_SIZE;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+
+    __m256i v_ps = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, (int)(s1 * n));
+    __m256i v_s2 = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, (int)s2);
+    __m256i v_s1 = _mm256_setzero_si256();
+
+    do {
+      const __m256i bytes1 = _mm256_loadu_si256((const __m256i *)(buf));
+      const __m256i bytes2 = _mm256_loadu_si256((const __m256i *)(buf + 32));
+
+      v_ps = _mm256_add_epi32(v_ps, v_s1);
+
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes1, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes1, tap1), ones));
+
+      v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(bytes2, zero));
+      v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(bytes2, tap2), ones));
+
+      buf += BLOCK_SIZE;
+    } while (--n);
+
+    v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 6));
+
+    s1 += hsum_epi32(v_s1);
+    s2  = hsum_epi32(v_s2);
+
+    s1 %= BASE;
+    s2 %= BASE;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Remaining 0 to 63 bytes
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  return update_adler32_scalar(s1 | (s2 << 16), buf, len);
+}
+
+#endif // FOIST_X86_DISPATCH
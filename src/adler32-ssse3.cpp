@@ -0,0 +1,96 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// ADLER32 using SSSE3
+//
+// Based on the approach in Chromium's zlib 'adler32_simd.c'
+//   Copyright 2017 The Chromium Authors. BSD-style license.
+//
+// Each 32-byte block contributes
+//   adler += b[0] + b[1] + ... + b[31]
+//   sum2  += 32 * adler_before + 32*b[0] + 31*b[1] + ... + 1*b[31]
+// The byte sums use PSADBW and the weighted sums use PMADDUBSW.  The
+// '32 * adler_before' terms are accumulated in 'v_ps' and added once
+// per NMAX block.
+//
+// Compiled with a per-function 'target' attribute, so only ever call this
+// when cpu_features().ssse3 is true.  See update_adler32() in adler32.cpp
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include "adler32.h"
+#include "cpu-features.h"
+
+#ifdef FOIST_X86_DISPATCH
+
+#include <immintrin.h>
+
+#define BASE 65521U  /* largest prime smaller than 65536 */
+#define NMAX 5552    /* NMAX is the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1 */
+
+#define BLOCK_SIZE 32
+
+__attribute__((target("ssse3")))
+static inline uint32_t hsum_epi32(__m128i v) {
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+
+__attribute__((target("ssse3")))
+uint32_t update_adler32_ssse3(uint32_t adler, const unsigned char *buf, size_t len) {
+
+  uint32_t s1 = adler & 0xffff;
+  uint32_t s2 = (adler >> 16) & 0xffff;
+
+  size_t blocks = len / BLOCK_SIZE;
+  len -= blocks * BLOCK_SIZE;
+
+  const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                     24, 23, 22, 21, 20, 19, 18, 17);
+  const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10,  9,
+                                      8,  7,  6,  5,  4,  3,  2,  1);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+
+  while (blocks) {
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // At most NMAX bytes between reductions so that s2 can't overflow
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    size_t n = NMAX / BLOCK_SIZE;
+    if (n > blocks) n = blocks;
+    blocks -= n;
+
+    __m128i v_ps = _mm_set_epi32(0, 0, 0, (int)(s1 * n));
+    __m128i v_s2 = _mm_set_epi32(0, 0, 0, (int)s2);
+    __m128i v_s1 = _mm_setzero_si128();
+
+    do {
+      const __m128i bytes1 = _mm_loadu_si128((const __m128i *)(buf));
+      const __m128i bytes2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+
+      v_ps = _mm_add_epi32(v_ps, v_s1);
+
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes1, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes1, tap1), ones));
+
+      v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(bytes2, zero));
+      v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_maddubs_epi16(bytes2, tap2), ones));
+
+      buf += BLOCK_SIZE;
+    } while (--n);
+
+    v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+    s1 += hsum_epi32(v_s1);
+    s2  = hsum_epi32(v_s2);
+
+    s1 %= BASE;
+    s2 %= BASE;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Remaining 0 to 31 bytes
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  return update_adler32_scalar(s1 | (s2 << 16), buf, len);
+}
+
+#endif // FOIST_X86_DISPATCH
@@ -1,7 +1,6 @@
 
-#include "Rcpp.h"
-
-using namespace Rcpp;
+#include "adler32.h"
+#include "cpu-features.h"
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // adler32.c -- compute the Adler-32 checksum of a data stream
@@ -29,7 +28,7 @@ using namespace Rcpp;
 #define MOD63(a) a %= BASE
 
 
-uint32_t update_adler32(uint32_t adler, const unsigned char *buf, size_t len) {
+uint32_t update_adler32_scalar(uint32_t adler, const unsigned char *buf, size_t len) {
     unsigned long sum2;
     unsigned int n;
 
@@ -67,3 +66,62 @@ uint32_t update_adler32(uint32_t adler, const unsigned char *buf, size_t len) {
     /* return recombined sums */
     return adler | (sum2 << 16);
 }
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// adler32_combine_() from zlib's adler32.c
+//
+// Given adler1 = ADLER32(A), adler2 = ADLER32(B) and len2 = length(B),
+// return ADLER32(A followed by B).  Lets pieces of a stream be checksummed
+// independently (e.g. on different threads) and merged afterwards.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, uint64_t len2) {
+    unsigned long sum1;
+    unsigned long sum2;
+    unsigned rem;
+
+    /* the derivation of this formula is left as an exercise for the reader */
+    rem = (unsigned)(len2 % BASE);
+    sum1 = adler1 & 0xffff;
+    sum2 = rem * sum1;
+    MOD(sum2);
+    sum1 += (adler2 & 0xffff) + BASE - 1;
+    sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + BASE - rem;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum1 >= BASE) sum1 -= BASE;
+    if (sum2 >= ((unsigned long)BASE << 1)) sum2 -= ((unsigned long)BASE << 1);
+    if (sum2 >= BASE) sum2 -= BASE;
+    return sum1 | (sum2 << 16);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Choose the ADLER32 implementation for this CPU.
+// The SIMD kernels live in adler32-ssse3.cpp and adler32-avx2.cpp
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef uint32_t (*adler32_func)(uint32_t adler, const unsigned char *buf, size_t len);
+
+static adler32_func adler32_select() {
+#ifdef FOIST_X86_DISPATCH
+  const CpuFeatures &cpu = cpu_features();
+
+  if (cpu.avx2) {
+    return update_adler32_avx2;
+  }
+  if (cpu.ssse3) {
+    return update_adler32_ssse3;
+  }
+#endif
+  return update_adler32_scalar;
+}
+
+static const adler32_func adler32_impl = adler32_select();
+
+
+uint32_t update_adler32(uint32_t adler, const unsigned char *buf, size_t len) {
+  return adler32_impl(adler, buf, len);
+}
+
+bool adler32_is_simd() {
+  return adler32_impl != update_adler32_scalar;
+}
@@ -1,2 +1,21 @@
 
+#include <stdint.h>
+#include <stddef.h>
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// update_adler32() uses the fastest kernel this CPU supports (AVX2, SSSE3
+// or scalar), chosen once at load time.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 uint32_t update_adler32(uint32_t adler, const unsigned char *buf, size_t len);
+
+// ADLER32 of A followed by B, given the ADLER32 of each and the length of B
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, uint64_t len2);
+
+// Is update_adler32() using one of the SIMD kernels?
+bool adler32_is_simd();
+
+// Individual kernels. The SIMD ones must only be called if cpu_features()
+// says the instructions are available
+uint32_t update_adler32_scalar(uint32_t adler, const unsigned char *buf, size_t len);
+uint32_t update_adler32_ssse3 (uint32_t adler, const unsigned char *buf, size_t len);
+uint32_t update_adler32_avx2  (uint32_t adler, const unsigned char *buf, size_t len);
@@ -0,0 +1,67 @@
+#include "Rcpp.h"
+
+using namespace Rcpp;
+
+#include "crc32.h"
+#include "adler32.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// R access to the checksum functions.  Internal - these exist so the tests
+// can check the streaming and combining checksums against each other.
+//
+// Checksums are passed as doubles, as R has no unsigned 32-bit integer type.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' CRC32 of a raw vector
+//'
+//' @param x raw vector
+//' @param crc CRC32 of any preceding data. Default: 0
+//'
+//' @noRd
+// [[Rcpp::export(.crc32_raw)]]
+double crc32_raw(const RawVector x, const double crc = 0) {
+  return crc32_fast(x.begin(), x.length(), (uint32_t)crc);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' ADLER32 of a raw vector
+//'
+//' @param x raw vector
+//' @param adler ADLER32 of any preceding data. Default: 1
+//'
+//' @noRd
+// [[Rcpp::export(.adler32_raw)]]
+double adler32_raw(const RawVector x, const double adler = 1) {
+  return update_adler32((uint32_t)adler, x.begin(), x.length());
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' Combine the CRC32s of two consecutive pieces of data
+//'
+//' @param crc1,crc2 CRC32 of the first and second pieces
+//' @param len2 length of the second piece in bytes
+//'
+//' @noRd
+// [[Rcpp::export(.crc32_combine)]]
+double crc32_combine_r(const double crc1, const double crc2, const double len2) {
+  if (len2 < 0) stop("crc32_combine(): 'len2' must not be negative");
+  return crc32_combine((uint32_t)crc1, (uint32_t)crc2, (uint64_t)len2);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' Combine the ADLER32s of two consecutive pieces of data
+//'
+//' @param adler1,adler2 ADLER32 of the first and second pieces
+//' @param len2 length of the second piece in bytes
+//'
+//' @noRd
+// [[Rcpp::export(.adler32_combine)]]
+double adler32_combine_r(const double adler1, const double adler2, const double len2) {
+  if (len2 < 0) stop("adler32_combine(): 'len2' must not be negative");
+  return adler32_combine((uint32_t)adler1, (uint32_t)adler2, (uint64_t)len2);
+}
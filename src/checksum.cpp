@@ -0,0 +1,123 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Fused CRC32 + ADLER32
+//
+// The inner loop is the slicing-by-16 step from crc32_16bytes() (crc32.cpp)
+// interleaved with the ADLER32 sums from update_adler32() (adler32.cpp).
+// The two calculations are independent, so the CPU can overlap the
+// CRC table lookups with the ADLER32 additions.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include "checksum.h"
+#include "crc32.h"
+#include "adler32.h"
+
+// Slicing-by-16 lookup tables. Defined at the end of crc32.cpp
+extern const uint32_t Crc32Lookup[16][256];
+
+#define BASE 65521U  /* largest prime smaller than 65536 */
+#define NMAX 5552    /* NMAX is the largest n such that 255n(n+1)/2 + (n+1)(BASE-1) <= 2^32-1 */
+
+
+
+static void update_crc32_adler32_table(const unsigned char *data, size_t length,
+                                       uint32_t &crc32, uint32_t &adler32) {
+
+  uint32_t crc   = ~crc32;
+  uint32_t adler = adler32 & 0xffff;
+  uint32_t sum2  = (adler32 >> 16) & 0xffff;
+
+  const unsigned char *buf = data;
+
+  while (length >= 16) {
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Process up to NMAX bytes (a multiple of 16) before the ADLER32
+    // sums need reducing
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    size_t block = length < NMAX ? length : NMAX;
+    size_t n = block / 16;
+    length -= n * 16;
+
+    do {
+      const uint32_t *current = (const uint32_t *)buf;
+      uint32_t one   = current[0] ^ crc;
+      uint32_t two   = current[1];
+      uint32_t three = current[2];
+      uint32_t four  = current[3];
+      crc  = Crc32Lookup[ 0][(four  >> 24) & 0xFF] ^
+             Crc32Lookup[ 1][(four  >> 16) & 0xFF] ^
+             Crc32Lookup[ 2][(four  >>  8) & 0xFF] ^
+             Crc32Lookup[ 3][ four         & 0xFF] ^
+             Crc32Lookup[ 4][(three >> 24) & 0xFF] ^
+             Crc32Lookup[ 5][(three >> 16) & 0xFF] ^
+             Crc32Lookup[ 6][(three >>  8) & 0xFF] ^
+             Crc32Lookup[ 7][ three        & 0xFF] ^
+             Crc32Lookup[ 8][(two   >> 24) & 0xFF] ^
+             Crc32Lookup[ 9][(two   >> 16) & 0xFF] ^
+             Crc32Lookup[10][(two   >>  8) & 0xFF] ^
+             Crc32Lookup[11][ two          & 0xFF] ^
+             Crc32Lookup[12][(one   >> 24) & 0xFF] ^
+             Crc32Lookup[13][(one   >> 16) & 0xFF] ^
+             Crc32Lookup[14][(one   >>  8) & 0xFF] ^
+             Crc32Lookup[15][ one          & 0xFF];
+
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+      // ADLER32 for 16 bytes without the serial dependency of DO16:
+      //   sum2  += 16 * adler + 16*b[0] + 15*b[1] + ... + 1*b[15]
+      //   adler += b[0] + b[1] + ... + b[15]
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+      uint32_t bsum = 0, wsum = 0;
+      for (int i = 0; i < 16; i++) {
+        bsum += buf[i];
+        wsum += (16 - i) * buf[i];
+      }
+      sum2  += 16 * adler + wsum;
+      adler += bsum;
+      buf   += 16;
+    } while (--n);
+
+    adler %= BASE;
+    sum2  %= BASE;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Remaining 0 to 15 bytes
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (length) {
+    while (length--) {
+      crc = (crc >> 8) ^ Crc32Lookup[0][(crc & 0xFF) ^ *buf];
+      adler += *buf++;
+      sum2  += adler;
+    }
+    adler %= BASE;
+    sum2  %= BASE;
+  }
+
+  crc32   = ~crc;
+  adler32 = adler | (sum2 << 16);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// When crc32_fast() is using carry-less multiplication, or update_adler32()
+// is using SIMD, the two checksums are each much faster on their own than
+// interleaved.  Instead both are run back-to-back over L1-sized pieces of
+// the data, so the second pass still reads from L1.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define L1_CHUNK 8192
+
+void update_crc32_adler32(const unsigned char *data, size_t length,
+                          uint32_t &crc32, uint32_t &adler32) {
+
+  if (!crc32_fast_is_clmul() && !adler32_is_simd()) {
+    update_crc32_adler32_table(data, length, crc32, adler32);
+    return;
+  }
+
+  while (length > 0) {
+    size_t n = length < L1_CHUNK ? length : L1_CHUNK;
+    crc32   = crc32_fast(data, n, crc32);
+    adler32 = update_adler32(adler32, data, n);
+    data   += n;
+    length -= n;
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef FOIST_CHECKSUM_H
+#define FOIST_CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Update a CRC32 and an ADLER32 over the same bytes in a single pass.
+//
+// Stored PNG data needs both checksums over every byte of the raw data
+// (CRC32 for the IDAT chunk, ADLER32 for the zlib stream).  Calculating
+// them together means each 16 bytes is only loaded once.
+//
+// Equivalent to:
+//     crc32   = crc32_16bytes(data, length, crc32);
+//     adler32 = update_adler32(adler32, data, length);
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void update_crc32_adler32(const unsigned char *data, size_t length,
+                          uint32_t &crc32, uint32_t &adler32);
+
+#endif
@@ -0,0 +1,49 @@
+#include "cpu-features.h"
+
+#ifdef FOIST_X86_DISPATCH
+#include <cpuid.h>
+#endif
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// cpuid feature bits
+//   leaf 1, ECX:    bit 1 = PCLMULQDQ, bit 9 = SSSE3, bit 19 = SSE4.1,
+//                   bit 27 = OSXSAVE,  bit 28 = AVX
+//   leaf 7, EBX:    bit 5 = AVX2
+//   leaf 7, ECX:    bit 10 = VPCLMULQDQ
+//   XCR0 bits 1,2:  OS saves XMM and YMM registers
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static CpuFeatures detect_cpu_features() {
+  CpuFeatures f = {false, false, false, false, false};
+
+#ifdef FOIST_X86_DISPATCH
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return f;
+  }
+  f.pclmul = (ecx & (1u <<  1)) != 0;
+  f.ssse3  = (ecx & (1u <<  9)) != 0;
+  f.sse41  = (ecx & (1u << 19)) != 0;
+  bool has_osxsave = (ecx & (1u << 27)) != 0;
+  bool has_avx     = (ecx & (1u << 28)) != 0;
+
+  if (has_osxsave && has_avx && __get_cpuid_max(0, 0) >= 7) {
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) == 6) {
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+      f.avx2    = (ebx & (1u <<  5)) != 0;
+      f.vpclmul = (ecx & (1u << 10)) != 0 && f.avx2;
+    }
+  }
+#endif
+
+  return f;
+}
+
+
+const CpuFeatures &cpu_features() {
+  static const CpuFeatures features = detect_cpu_features();
+  return features;
+}
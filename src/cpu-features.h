@@ -0,0 +1,34 @@
+#ifndef FOIST_CPU_FEATURES_H
+#define FOIST_CPU_FEATURES_H
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Runtime CPU feature detection.
+//
+// SIMD kernels are compiled with per-function 'target' attributes (so the
+// package needs no special compiler flags) and must only be called if the
+// CPU running the code supports the instructions.
+//
+// FOIST_X86_DISPATCH is defined when these kernels can be compiled i.e.
+// x86-64 with gcc or clang.  Otherwise every feature reports as missing.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FOIST_X86_DISPATCH
+#endif
+
+// VPCLMULQDQ target support: gcc >= 8, clang >= 6
+#if defined(FOIST_X86_DISPATCH) && \
+  ((defined(__clang__) && __clang_major__ >= 6) || (!defined(__clang__) && __GNUC__ >= 8))
+#define FOIST_X86_VPCLMUL
+#endif
+
+struct CpuFeatures {
+  bool ssse3;
+  bool sse41;
+  bool pclmul;
+  bool avx2;     // also checks that the OS saves YMM registers
+  bool vpclmul;
+};
+
+const CpuFeatures &cpu_features();
+
+#endif
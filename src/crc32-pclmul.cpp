@@ -0,0 +1,257 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// CRC32 using carry-less multiplication (PCLMULQDQ / VPCLMULQDQ) on x86-64
+//
+// Reference:
+//   V. Gopal et al, "Fast CRC Computation for Generic Polynomials Using
+//   PCLMULQDQ Instruction", Intel, 2009
+//
+// The data is 'folded' 64 (or 128) bytes at a time into 4 running 128-bit
+// (or 256-bit) remainders using carry-less multiplies by constants of the
+// form x^n mod P(x), and the final 128 bits are Barrett reduced to 32 bits.
+// Unlike slicing-by-16 there are no lookup tables competing with the
+// image data for L1 cache.
+//
+// These functions are compiled with per-function 'target' attributes
+// so that no special compiler flags are needed for the package, and are
+// only ever called if cpuid says the CPU supports the instructions.
+// Everywhere else, crc32_fast() is just crc32_16bytes().
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include "crc32.h"
+#include "cpu-features.h"
+
+
+#ifdef FOIST_X86_DISPATCH
+
+#include <immintrin.h>
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Folding constants for the bit-reflected zlib polynomial 0xEDB88320
+//   kN = reflect32(x^N mod P(x)) << 1
+// Folding a 128-bit lane forward by D bits uses (x^(D+32), x^(D-32))
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static const uint64_t k_fold_1024[2] = { 0x1e88ef372, 0x14a7fe880 }; // D = 1024 (4 x 256 bits)
+static const uint64_t k_fold_512 [2] = { 0x154442bd4, 0x1c6e41596 }; // D =  512 (4 x 128 bits)
+static const uint64_t k_fold_128 [2] = { 0x1751997d0, 0x0ccaa009e }; // D =  128
+static const uint64_t k_fold_64  [2] = { 0x163cd6124, 0x000000000 }; // 128 -> 64 bits
+static const uint64_t k_barrett  [2] = { 0x1db710641, 0x1f7011641 }; // P(x)' and mu
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Fold 'x' forward over the next 128 bits and add in 'data'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i fold_128(__m128i x, __m128i k, __m128i data) {
+  __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+  __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+  return _mm_xor_si128(_mm_xor_si128(lo, hi), data);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Reduce a 128-bit remainder to the (inverted) 32-bit CRC
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+__attribute__((target("pclmul,sse4.1")))
+static inline uint32_t reduce_128(__m128i x1) {
+  __m128i x0, x2;
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  // 128 -> 64 bits
+  x0 = _mm_loadu_si128((const __m128i *)k_fold_128);
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+
+  x0 = _mm_loadl_epi64((const __m128i *)k_fold_64);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction 64 -> 32 bits
+  x0 = _mm_loadu_si128((const __m128i *)k_barrett);
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// PCLMULQDQ: 4 x 128-bit lanes
+//   - 'crc' is the inverted CRC i.e. the raw register value
+//   - 'length' must be >= 64 and a multiple of 16
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_core(const uint8_t *buf, size_t length, uint32_t crc) {
+
+  __m128i x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+  __m128i x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+  __m128i x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+  __m128i x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+
+  buf    += 64;
+  length -= 64;
+
+  __m128i k = _mm_loadu_si128((const __m128i *)k_fold_512);
+  while (length >= 64) {
+    x1 = fold_128(x1, k, _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+    x2 = fold_128(x2, k, _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+    x3 = fold_128(x3, k, _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+    x4 = fold_128(x4, k, _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+    buf    += 64;
+    length -= 64;
+  }
+
+  // Fold the 4 lanes into one, then any remaining 16-byte blocks
+  k  = _mm_loadu_si128((const __m128i *)k_fold_128);
+  x1 = fold_128(x1, k, x2);
+  x1 = fold_128(x1, k, x3);
+  x1 = fold_128(x1, k, x4);
+
+  while (length >= 16) {
+    x1 = fold_128(x1, k, _mm_loadu_si128((const __m128i *)buf));
+    buf    += 16;
+    length -= 16;
+  }
+
+  return reduce_128(x1);
+}
+
+
+#ifdef FOIST_X86_VPCLMUL
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// VPCLMULQDQ: 4 x 256-bit lanes (each holding 2 x 128-bit blocks)
+//   - 'crc' is the inverted CRC i.e. the raw register value
+//   - 'length' must be >= 128 and a multiple of 16
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+__attribute__((target("avx2,vpclmulqdq,pclmul,sse4.1")))
+static inline __m256i fold_256(__m256i x, __m256i k, __m256i data) {
+  __m256i lo = _mm256_clmulepi64_epi128(x, k, 0x00);
+  __m256i hi = _mm256_clmulepi64_epi128(x, k, 0x11);
+  return _mm256_xor_si256(_mm256_xor_si256(lo, hi), data);
+}
+
+__attribute__((target("avx2,vpclmulqdq,pclmul,sse4.1")))
+static uint32_t crc32_vpclmul_core(const uint8_t *buf, size_t length, uint32_t crc) {
+
+  __m256i y1 = _mm256_loadu_si256((const __m256i *)(buf + 0x00));
+  __m256i y2 = _mm256_loadu_si256((const __m256i *)(buf + 0x20));
+  __m256i y3 = _mm256_loadu_si256((const __m256i *)(buf + 0x40));
+  __m256i y4 = _mm256_loadu_si256((const __m256i *)(buf + 0x60));
+
+  y1 = _mm256_xor_si256(y1, _mm256_inserti128_si256(_mm256_setzero_si256(), _mm_cvtsi32_si128((int)crc), 0));
+
+  buf    += 128;
+  length -= 128;
+
+  const __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)k_fold_1024));
+  while (length >= 128) {
+    y1 = fold_256(y1, k, _mm256_loadu_si256((const __m256i *)(buf + 0x00)));
+    y2 = fold_256(y2, k, _mm256_loadu_si256((const __m256i *)(buf + 0x20)));
+    y3 = fold_256(y3, k, _mm256_loadu_si256((const __m256i *)(buf + 0x40)));
+    y4 = fold_256(y4, k, _mm256_loadu_si256((const __m256i *)(buf + 0x60)));
+    buf    += 128;
+    length -= 128;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // The 8 x 128-bit blocks are consecutive in the stream. Fold them
+  // into one, then any remaining 16-byte blocks
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const __m128i k128 = _mm_loadu_si128((const __m128i *)k_fold_128);
+  __m128i x1 = _mm256_castsi256_si128(y1);
+  x1 = fold_128(x1, k128, _mm256_extracti128_si256(y1, 1));
+  x1 = fold_128(x1, k128, _mm256_castsi256_si128(y2));
+  x1 = fold_128(x1, k128, _mm256_extracti128_si256(y2, 1));
+  x1 = fold_128(x1, k128, _mm256_castsi256_si128(y3));
+  x1 = fold_128(x1, k128, _mm256_extracti128_si256(y3, 1));
+  x1 = fold_128(x1, k128, _mm256_castsi256_si128(y4));
+  x1 = fold_128(x1, k128, _mm256_extracti128_si256(y4, 1));
+
+  while (length >= 16) {
+    x1 = fold_128(x1, k128, _mm_loadu_si128((const __m128i *)buf));
+    buf    += 16;
+    length -= 16;
+  }
+
+  return reduce_128(x1);
+}
+#endif // FOIST_X86_VPCLMUL
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Wrappers with the same interface as crc32_16bytes().  The SIMD code
+// handles all complete 16-byte blocks, the table code handles the tail.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static uint32_t crc32_pclmul(const void* data, size_t length, uint32_t previousCrc32) {
+  if (length < 64) {
+    return crc32_16bytes(data, length, previousCrc32);
+  }
+  const uint8_t *buf = (const uint8_t *)data;
+  size_t nblock = length & ~(size_t)15;
+  uint32_t crc = ~crc32_pclmul_core(buf, nblock, ~previousCrc32);
+  return crc32_16bytes(buf + nblock, length - nblock, crc);
+}
+
+#ifdef FOIST_X86_VPCLMUL
+static uint32_t crc32_vpclmul(const void* data, size_t length, uint32_t previousCrc32) {
+  if (length < 256) {
+    return crc32_pclmul(data, length, previousCrc32);
+  }
+  const uint8_t *buf = (const uint8_t *)data;
+  size_t nblock = length & ~(size_t)15;
+  uint32_t crc = ~crc32_vpclmul_core(buf, nblock, ~previousCrc32);
+  return crc32_16bytes(buf + nblock, length - nblock, crc);
+}
+#endif
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Choose the CRC32 implementation for this CPU
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+typedef uint32_t (*crc32_func)(const void* data, size_t length, uint32_t previousCrc32);
+
+static crc32_func crc32_select() {
+  const CpuFeatures &cpu = cpu_features();
+
+  if (!cpu.pclmul || !cpu.sse41) {
+    return crc32_16bytes;
+  }
+#ifdef FOIST_X86_VPCLMUL
+  if (cpu.vpclmul) {
+    return crc32_vpclmul;
+  }
+#endif
+  return crc32_pclmul;
+}
+
+static const crc32_func crc32_impl = crc32_select();
+
+bool crc32_fast_is_clmul() {
+  return crc32_impl != crc32_16bytes;
+}
+
+#else  // !FOIST_X86_DISPATCH
+
+static uint32_t (* const crc32_impl)(const void*, size_t, uint32_t) = crc32_16bytes;
+
+bool crc32_fast_is_clmul() {
+  return false;
+}
+
+#endif // FOIST_X86_DISPATCH
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// CRC32 using the fastest method this CPU supports.
+// Selected once, when the package is loaded.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+uint32_t crc32_fast(const void* data, size_t length, uint32_t previousCrc32) {
+  return crc32_impl(data, length, previousCrc32);
+}
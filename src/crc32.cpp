@@ -196,6 +196,88 @@ uint32_t crc32_16bytes(const void* data, size_t length, uint32_t previousCrc32)
 
 
 
+// //////////////////////////////////////////////////////////
+// combine two CRC32s
+//
+// crc32_combine_() from zlib's crc32.c
+// Copyright (C) 1995-2006, 2010, 2011, 2012, 2016 Mark Adler
+//
+// Appending len2 zero bytes to a message is a linear operation on its CRC32
+// over GF(2), so it can be written as a 32x32 bit matrix.  The matrix for
+// one zero bit is squared repeatedly to get the operator for 2, 4, 8, ...
+// zero bytes, and those matching the set bits of len2 are applied to crc1.
+// Costs O(log(len2)) and doesn't need the data.
+
+#define GF2_DIM 32  // dimension of GF(2) vectors (length of CRC)
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+  uint32_t sum = 0;
+  while (vec)
+  {
+    if (vec & 1)
+      sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+  for (int n = 0; n < GF2_DIM; n++)
+    square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+  uint32_t even[GF2_DIM]; // even-power-of-two zeros operator
+  uint32_t odd [GF2_DIM]; // odd-power-of-two zeros operator
+
+  // degenerate case (also disallow negative lengths)
+  if (len2 == 0)
+    return crc1;
+
+  // put operator for one zero bit in odd
+  odd[0] = 0xEDB88320; // CRC32 polynomial
+  uint32_t row = 1;
+  for (int n = 1; n < GF2_DIM; n++)
+  {
+    odd[n] = row;
+    row <<= 1;
+  }
+
+  // put operator for two zero bits in even
+  gf2_matrix_square(even, odd);
+  // put operator for four zero bits in odd
+  gf2_matrix_square(odd, even);
+
+  // apply len2 zeros to crc1 (first square will put the operator for one
+  // zero byte, eight zero bits, in even)
+  do
+  {
+    // apply zeros operator for this bit of len2
+    gf2_matrix_square(even, odd);
+    if (len2 & 1)
+      crc1 = gf2_matrix_times(even, crc1);
+    len2 >>= 1;
+
+    // if no more bits set, then done
+    if (len2 == 0)
+      break;
+
+    // another iteration of the loop with odd and even swapped
+    gf2_matrix_square(odd, even);
+    if (len2 & 1)
+      crc1 = gf2_matrix_times(odd, crc1);
+    len2 >>= 1;
+  } while (len2 != 0);
+
+  return crc1 ^ crc2;
+}
+
+
+
 
 // //////////////////////////////////////////////////////////
 // constants
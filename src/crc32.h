@@ -27,9 +27,16 @@
 // size_t
 #include <stddef.h>
 
-// crc32_fast selects the fastest algorithm depending on flags (CRC32_USE_LOOKUP_...)
+// crc32_fast selects the fastest algorithm at runtime (see crc32-pclmul.cpp):
+// folding with carry-less multiplication (PCLMULQDQ/VPCLMULQDQ) on x86-64 CPUs
+// which support it, otherwise crc32_16bytes
 /// compute CRC32 using the fastest algorithm for large datasets on modern CPUs
 uint32_t crc32_fast(const void* data, size_t length, uint32_t previousCrc32 = 0);
+/// is crc32_fast using carry-less multiplication on this CPU?
+bool crc32_fast_is_clmul();
+
+/// CRC32 of A followed by B, given crc1 = CRC32(A), crc2 = CRC32(B) and len2 = length of B
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
 
 /// compute CRC32 (bitwise algorithm)
 uint32_t crc32_bitwise (const void* data, size_t length, uint32_t previousCrc32 = 0);
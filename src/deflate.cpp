@@ -0,0 +1,727 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A small, fast DEFLATE encoder for image data
+//
+// References:
+//   - https://tools.ietf.org/html/rfc1951
+//   - zlib's trees.c for the length-limited Huffman construction
+//
+// This is not a general purpose compressor.  The match finder is tuned for
+// image rows:  the two most useful distances in PNG data are '1' (a run of
+// identical bytes) and 'one row' (the row above is identical), so these are
+// always checked first, at every compression level.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <string.h>
+#include <algorithm>
+#include <queue>
+
+#include "deflate.h"
+
+#define WSIZE      32768     // DEFLATE window size
+#define WMASK      (WSIZE - 1)
+#define MIN_MATCH  3
+#define MAX_MATCH  258
+#define TOO_FAR    4096      // Matches of length 3 further away than this aren't worth it
+#define HASH_BITS  15
+#define HASH_SIZE  (1 << HASH_BITS)
+#define BLOCK_MAX  65535     // Max input bytes per DEFLATE block (so a stored block always fits)
+
+#define MAX_CHAIN  32        // BALANCED: max hash chain links to follow
+#define NICE_MATCH 128       // BALANCED: stop searching once a match this long is found
+#define LAZY_MATCH 32        // BALANCED: only try lazy matching below this length
+
+#define L_CODES    286
+#define D_CODES    30
+#define BL_CODES   19
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// RFC1951 Section 3.2.5 - length and distance code tables
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static const uint16_t len_base[29] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t len_extra[29] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t dist_base[30] = {
+  1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+  257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+  0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+  7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Order in which code length code lengths are transmitted
+static const uint8_t bl_order[BL_CODES] = {
+  16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Map a match length (3-258) to its length code index (0-28)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static uint8_t len_sym[256];
+
+static bool init_len_sym() {
+  for (int code = 0; code < 28; code++) {
+    for (int i = 0; i < (1 << len_extra[code]); i++) {
+      len_sym[len_base[code] - 3 + i] = (uint8_t)code;
+    }
+  }
+  len_sym[258 - 3] = 28;
+  return true;
+}
+static const bool len_sym_ready = init_len_sym();
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Map a match distance (1-32768) to its distance code (0-29)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline unsigned int dist_sym(unsigned int dist) {
+  unsigned int x = dist - 1;
+  if (x < 4) return x;
+  unsigned int nbits = 0;
+#if defined(__GNUC__) || defined(__clang__)
+  nbits = 31 - __builtin_clz(x);
+#else
+  while ((x >> (nbits + 1)) != 0) nbits++;
+#endif
+  return 2 * nbits + ((x >> (nbits - 1)) & 1);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// How many bytes match between 'a' and 'b' (up to 'max_len')?
+// Compares 8 bytes at a time.  Assumes a little endian machine (as does
+// crc32.cpp)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline size_t match_length(const unsigned char *a, const unsigned char *b, size_t max_len) {
+  size_t len = 0;
+#if defined(__GNUC__) || defined(__clang__)
+  while (len + 8 <= max_len) {
+    uint64_t x, y;
+    memcpy(&x, a + len, 8);
+    memcpy(&y, b + len, 8);
+    uint64_t diff = x ^ y;
+    if (diff) {
+      return len + (__builtin_ctzll(diff) >> 3);
+    }
+    len += 8;
+  }
+#endif
+  while (len < max_len && a[len] == b[len]) {
+    len++;
+  }
+  return len;
+}
+
+
+static inline uint32_t hash4(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Reverse the lowest 'nbits' of 'code'.  Huffman codes are packed starting
+// with their most significant bit, but the DEFLATE bit stream is LSB first.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline uint32_t reverse_bits(uint32_t code, int nbits) {
+  uint32_t res = 0;
+  while (nbits-- > 0) {
+    res = (res << 1) | (code & 1);
+    code >>= 1;
+  }
+  return res;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Build length-limited Huffman code lengths from symbol frequencies
+//
+//  1. Standard Huffman tree from a priority queue
+//  2. Clamp any code lengths longer than 'max_bits' and then re-balance the
+//     number of codes at each length until the Kraft sum is exactly 1
+//     (same approach as miniz)
+//  3. Hand out the lengths to the symbols - shortest codes to the most
+//     frequent symbols
+//
+// At least two symbols always get a code, as some decoders object to a
+// tree with a single code.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void build_lengths(const uint32_t *freq, int nsym, int max_bits, uint8_t *lens) {
+
+  memset(lens, 0, nsym);
+
+  std::vector<int> syms;
+  for (int i = 0; i < nsym; i++) {
+    if (freq[i] > 0) syms.push_back(i);
+  }
+
+  if (syms.size() < 2) {
+    int s0 = syms.empty() ? 0 : syms[0];
+    lens[s0] = 1;
+    lens[s0 == 0 ? 1 : 0] = 1;
+    return;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Huffman tree. Leaves are nodes [0, n), internal nodes are appended.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const int n = (int)syms.size();
+  std::vector<int> parent(2 * n - 1, -1);
+  typedef std::pair<uint64_t, int> node_t;
+  std::priority_queue<node_t, std::vector<node_t>, std::greater<node_t> > pq;
+  for (int i = 0; i < n; i++) {
+    pq.push(node_t(freq[syms[i]], i));
+  }
+  int next = n;
+  while (pq.size() > 1) {
+    node_t a = pq.top(); pq.pop();
+    node_t b = pq.top(); pq.pop();
+    parent[a.second] = next;
+    parent[b.second] = next;
+    pq.push(node_t(a.first + b.first, next));
+    next++;
+  }
+
+  // Depth of each node. Parents always have a higher index than children
+  std::vector<int> depth(2 * n - 1, 0);
+  for (int i = 2 * n - 3; i >= 0; i--) {
+    depth[i] = depth[parent[i]] + 1;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Count codes at each length, clamping to max_bits
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  int bl_count[33] = {0};
+  for (int i = 0; i < n; i++) {
+    bl_count[std::min(depth[i], max_bits)]++;
+  }
+
+  uint32_t total = 0;
+  for (int bits = max_bits; bits > 0; bits--) {
+    total += (uint32_t)bl_count[bits] << (max_bits - bits);
+  }
+  while (total != (1U << max_bits)) {
+    bl_count[max_bits]--;
+    for (int bits = max_bits - 1; bits > 0; bits--) {
+      if (bl_count[bits]) {
+        bl_count[bits]--;
+        bl_count[bits + 1] += 2;
+        break;
+      }
+    }
+    total--;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Least frequent symbols get the longest codes
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  std::stable_sort(syms.begin(), syms.end(), [freq](int a, int b) {
+    return freq[a] < freq[b];
+  });
+  int idx = 0;
+  for (int bits = max_bits; bits > 0; bits--) {
+    for (int k = 0; k < bl_count[bits]; k++) {
+      lens[syms[idx++]] = (uint8_t)bits;
+    }
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Canonical Huffman codes from code lengths (RFC1951 Section 3.2.2).
+// Codes are returned bit-reversed, ready for the LSB-first bit stream.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void build_codes(const uint8_t *lens, int nsym, uint16_t *codes) {
+  uint32_t bl_count[16]  = {0};
+  uint32_t next_code[16] = {0};
+
+  for (int i = 0; i < nsym; i++) {
+    bl_count[lens[i]]++;
+  }
+  bl_count[0] = 0;
+
+  uint32_t code = 0;
+  for (int bits = 1; bits < 16; bits++) {
+    code = (code + bl_count[bits - 1]) << 1;
+    next_code[bits] = code;
+  }
+
+  for (int i = 0; i < nsym; i++) {
+    if (lens[i]) {
+      codes[i] = (uint16_t)reverse_bits(next_code[lens[i]]++, lens[i]);
+    } else {
+      codes[i] = 0;
+    }
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Fixed Huffman code lengths (RFC1951 Section 3.2.6)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static uint8_t  fixed_lit_lens[288];
+static uint16_t fixed_lit_codes[288];
+static uint8_t  fixed_dist_lens[D_CODES];
+static uint16_t fixed_dist_codes[D_CODES];
+
+static bool init_fixed_codes() {
+  for (int i =   0; i < 144; i++) fixed_lit_lens[i] = 8;
+  for (int i = 144; i < 256; i++) fixed_lit_lens[i] = 9;
+  for (int i = 256; i < 280; i++) fixed_lit_lens[i] = 7;
+  for (int i = 280; i < 288; i++) fixed_lit_lens[i] = 8;
+  for (int i =   0; i < D_CODES; i++) fixed_dist_lens[i] = 5;
+  build_codes(fixed_lit_lens , 288    , fixed_lit_codes);
+  build_codes(fixed_dist_lens, D_CODES, fixed_dist_codes);
+  return true;
+}
+static const bool fixed_codes_ready = init_fixed_codes();
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// oooooooooooo                                        .o8
+// `888'     `8                                       "888
+//  888         ooo. .oo.    .ooooo.   .ooooo.   .oooo888   .ooooo.
+//  888oooo8    `888P"Y88b  d88' `"Y8 d88' `88b d88' `888  d88' `88b
+//  888    "     888   888  888       888   888 888   888  888ooo888
+//  888       o  888   888  888   .o8 888   888 888   888  888    .o
+// o888ooooood8 o888o o888o `Y8bod8P' `Y8bod8P' `Y8bod88P" `Y8bod8P'
+//
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+DeflateEncoder::DeflateEncoder(int level, size_t stride) :
+  level(level), stride(stride), window_len(0), window_base(0),
+  bitbuf(0), bitcount(0) {
+
+  if (level == DEFLATE_STORED) {
+    return;
+  }
+  window.resize(WSIZE + BLOCK_MAX);
+  if (level >= DEFLATE_FAST) {
+    head.assign(HASH_SIZE, 0);
+    prev.assign(WSIZE, 0);
+  }
+  tok_len.reserve(BLOCK_MAX);
+  tok_dist.reserve(BLOCK_MAX);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Bit output. Bits are accumulated LSB first, and written out 4 bytes at
+// a time to 'op'.  The caller is responsible for making sure there is
+// enough room in the output.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+inline void DeflateEncoder::put_bits(uint32_t bits, int nbits, unsigned char *&op) {
+  bitbuf   |= (uint64_t)bits << bitcount;
+  bitcount += nbits;
+  if (bitcount >= 32) {
+    uint32_t word = (uint32_t)bitbuf;
+    memcpy(op, &word, 4);
+    op      += 4;
+    bitbuf >>= 32;
+    bitcount -= 32;
+  }
+}
+
+inline void DeflateEncoder::flush_bits(unsigned char *&op) {
+  while (bitcount >= 8) {
+    *op++ = (unsigned char)bitbuf;
+    bitbuf  >>= 8;
+    bitcount -= 8;
+  }
+}
+
+void DeflateEncoder::align_to_byte(unsigned char *&op) {
+  bitcount = (bitcount + 7) & ~7;
+  flush_bits(op);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Find LZ77 matches for window[start, end) and store as tokens
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void DeflateEncoder::tokenize(size_t start, size_t end) {
+
+  const unsigned char *w = &window[0];
+  const bool use_hash = level >= DEFLATE_FAST;
+  const int  max_chain = level >= DEFLATE_BALANCED ? MAX_CHAIN : 1;
+  size_t next_insert = start;  // first position not yet inserted in hash table
+
+  tok_len.clear();
+  tok_dist.clear();
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Insert window position 'i' into the hash table
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  auto insert = [&](size_t i) {
+    uint64_t abs_pos = window_base + i;
+    uint32_t h       = hash4(w + i);
+    prev[abs_pos & WMASK] = head[h];
+    head[h] = abs_pos + 1;
+  };
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Find the longest match at window position 'i'
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  auto find_match = [&](size_t i, size_t &best_dist) -> size_t {
+    size_t max_len  = std::min((size_t)MAX_MATCH, end - i);
+    size_t best_len = 0;
+    best_dist = 0;
+    if (max_len < MIN_MATCH) return 0;
+
+    // A run of identical bytes
+    if (i >= 1 && w[i] == w[i - 1]) {
+      size_t len = match_length(w + i, w + i - 1, max_len);
+      if (len > best_len) { best_len = len; best_dist = 1; }
+    }
+
+    // Identical to the row above
+    if (stride > 1 && stride <= WSIZE && i >= stride && best_len < max_len &&
+        w[i] == w[i - stride]) {
+      size_t len = match_length(w + i, w + i - stride, max_len);
+      if (len > best_len) { best_len = len; best_dist = stride; }
+    }
+
+    if (use_hash && max_len >= 4) {
+      uint64_t cur_abs = window_base + i;
+      uint64_t p = head[hash4(w + i)];
+      int chain = max_chain;
+      while (p && chain-- > 0 && best_len < max_len) {
+        uint64_t cand = p - 1;
+        if (cand < window_base || cand >= cur_abs || cur_abs - cand > WSIZE) break;
+        const unsigned char *m = w + (cand - window_base);
+        if (m[best_len] == w[i + best_len]) {
+          size_t len = match_length(w + i, m, max_len);
+          if (len > best_len) {
+            best_len  = len;
+            best_dist = (size_t)(cur_abs - cand);
+            if (len >= NICE_MATCH) break;
+          }
+        }
+        p = prev[cand & WMASK];
+      }
+      if (i >= next_insert) {
+        insert(i);
+        next_insert = i + 1;
+      }
+    }
+
+    if (best_len == MIN_MATCH && best_dist > TOO_FAR) {
+      best_len = 0;
+    }
+    return best_len < MIN_MATCH ? 0 : best_len;
+  };
+
+
+  size_t i = start;
+  while (i < end) {
+    size_t dist;
+    size_t len = find_match(i, dist);
+
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Lazy matching: if the next position has a better match, emit a
+    // literal here instead
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    if (level >= DEFLATE_BALANCED) {
+      while (len > 0 && len < LAZY_MATCH && i + 1 < end) {
+        size_t dist2;
+        size_t len2 = find_match(i + 1, dist2);
+        if (len2 <= len) break;
+        tok_len.push_back(w[i]);
+        tok_dist.push_back(0);
+        i++;
+        len  = len2;
+        dist = dist2;
+      }
+    }
+
+    if (len) {
+      tok_len.push_back((uint16_t)len);
+      tok_dist.push_back((uint16_t)dist);
+      if (use_hash) {
+        // Skip inserting the body of long matches at the FAST level
+        size_t insert_end = (level == DEFLATE_FAST && len > 8) ? i + 1 : i + len;
+        insert_end = std::min(insert_end, end >= 3 ? end - 3 : 0);
+        for (size_t j = std::max(next_insert, i + 1); j < insert_end; j++) {
+          insert(j);
+        }
+        next_insert = std::max(next_insert, i + len);
+      }
+      i += len;
+    } else {
+      tok_len.push_back(w[i]);
+      tok_dist.push_back(0);
+      i++;
+    }
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Emit the current tokens as a single DEFLATE block.  Choose whichever
+// of stored/fixed/dynamic is smallest.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void DeflateEncoder::emit_block(const unsigned char *raw, size_t raw_len, bool final,
+                                std::vector<unsigned char> &out) {
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Symbol frequencies
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint32_t lit_freq[L_CODES]  = {0};
+  uint32_t dist_freq[D_CODES] = {0};
+  uint64_t extra_bits = 0;
+
+  const size_t ntok = tok_len.size();
+  for (size_t k = 0; k < ntok; k++) {
+    if (tok_dist[k] == 0) {
+      lit_freq[tok_len[k]]++;
+    } else {
+      unsigned int lc = len_sym[tok_len[k] - 3];
+      unsigned int dc = dist_sym(tok_dist[k]);
+      lit_freq[257 + lc]++;
+      dist_freq[dc]++;
+      extra_bits += len_extra[lc] + dist_extra[dc];
+    }
+  }
+  lit_freq[256] = 1; // End-of-block
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Dynamic trees
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint8_t  lit_lens[L_CODES], dist_lens[D_CODES];
+  build_lengths(lit_freq , L_CODES, 15, lit_lens);
+  build_lengths(dist_freq, D_CODES, 15, dist_lens);
+
+  int hlit = L_CODES;
+  while (hlit > 257 && lit_lens[hlit - 1] == 0) hlit--;
+  int hdist = D_CODES;
+  while (hdist > 1 && dist_lens[hdist - 1] == 0) hdist--;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Run-length encode the code lengths (RFC1951 Section 3.2.7)
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint8_t all_lens[L_CODES + D_CODES];
+  memcpy(all_lens, lit_lens, hlit);
+  memcpy(all_lens + hlit, dist_lens, hdist);
+  const int nlens = hlit + hdist;
+
+  uint8_t  rle_sym[L_CODES + D_CODES];
+  uint8_t  rle_val[L_CODES + D_CODES];
+  int      nrle = 0;
+  uint32_t bl_freq[BL_CODES] = {0};
+
+  for (int i = 0; i < nlens; ) {
+    uint8_t cur = all_lens[i];
+    int run = 1;
+    while (i + run < nlens && all_lens[i + run] == cur) run++;
+
+    if (cur == 0) {
+      while (run >= 11) {
+        int r = std::min(run, 138);
+        rle_sym[nrle] = 18; rle_val[nrle++] = (uint8_t)(r - 11);
+        run -= r; i += r;
+      }
+      if (run >= 3) {
+        rle_sym[nrle] = 17; rle_val[nrle++] = (uint8_t)(run - 3);
+        i += run; run = 0;
+      }
+    } else {
+      rle_sym[nrle] = cur; rle_val[nrle++] = 0;
+      i++; run--;
+      while (run >= 3) {
+        int r = std::min(run, 6);
+        rle_sym[nrle] = 16; rle_val[nrle++] = (uint8_t)(r - 3);
+        run -= r; i += r;
+      }
+    }
+    while (run > 0) {
+      rle_sym[nrle] = cur; rle_val[nrle++] = 0;
+      i++; run--;
+    }
+  }
+  for (int k = 0; k < nrle; k++) {
+    bl_freq[rle_sym[k]]++;
+  }
+
+  uint8_t bl_lens[BL_CODES];
+  build_lengths(bl_freq, BL_CODES, 7, bl_lens);
+  int hclen = BL_CODES;
+  while (hclen > 4 && bl_lens[bl_order[hclen - 1]] == 0) hclen--;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Size of each block type in bits
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint64_t dynamic_bits = 3 + 5 + 5 + 4 + 3 * hclen + extra_bits;
+  uint64_t fixed_bits   = 3 + extra_bits;
+  for (int k = 0; k < BL_CODES; k++) {
+    dynamic_bits += (uint64_t)bl_freq[k] * bl_lens[k];
+  }
+  dynamic_bits += 2 * bl_freq[16] + 3 * bl_freq[17] + 7 * bl_freq[18];
+  for (int k = 0; k < L_CODES; k++) {
+    dynamic_bits += (uint64_t)lit_freq[k] * lit_lens[k];
+    fixed_bits   += (uint64_t)lit_freq[k] * fixed_lit_lens[k];
+  }
+  for (int k = 0; k < D_CODES; k++) {
+    dynamic_bits += (uint64_t)dist_freq[k] * dist_lens[k];
+    fixed_bits   += (uint64_t)dist_freq[k] * 5;
+  }
+  uint64_t stored_bits = 3 + ((8 - ((bitcount + 3) & 7)) & 7) + 32 + 8 * (uint64_t)raw_len;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Make room for the largest block we might write, then trim afterwards
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint64_t max_bits = std::max(stored_bits, std::min(fixed_bits, dynamic_bits));
+  size_t   pos      = out.size();
+  out.resize(pos + (size_t)(max_bits / 8) + 16);
+  unsigned char *op = &out[pos];
+
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Stored block: header, align to byte, LEN, NLEN, raw data
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (stored_bits <= fixed_bits && stored_bits <= dynamic_bits) {
+    put_bits(final ? 1 : 0, 1, op);
+    put_bits(0, 2, op);
+    align_to_byte(op);
+    uint16_t LEN  = (uint16_t)raw_len;
+    uint16_t NLEN = ~LEN;
+    *op++ = LEN  & 0xFF;
+    *op++ = LEN  >> 8;
+    *op++ = NLEN & 0xFF;
+    *op++ = NLEN >> 8;
+    memcpy(op, raw, raw_len);
+    op += raw_len;
+    out.resize(op - &out[0]);
+    return;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Huffman block header
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint16_t lit_codes_dyn[L_CODES], dist_codes_dyn[D_CODES];
+  const uint8_t  *lit_lens_use, *dist_lens_use;
+  const uint16_t *lit_codes_use, *dist_codes_use;
+
+  put_bits(final ? 1 : 0, 1, op);
+
+  if (fixed_bits <= dynamic_bits) {
+    put_bits(1, 2, op); // BTYPE = 01
+    lit_lens_use   = fixed_lit_lens;
+    lit_codes_use  = fixed_lit_codes;
+    dist_lens_use  = fixed_dist_lens;
+    dist_codes_use = fixed_dist_codes;
+  } else {
+    put_bits(2, 2, op); // BTYPE = 10
+    build_codes(lit_lens , L_CODES, lit_codes_dyn);
+    build_codes(dist_lens, D_CODES, dist_codes_dyn);
+    uint16_t bl_codes[BL_CODES];
+    build_codes(bl_lens, BL_CODES, bl_codes);
+
+    put_bits(hlit  - 257, 5, op);
+    put_bits(hdist -   1, 5, op);
+    put_bits(hclen -   4, 4, op);
+    for (int k = 0; k < hclen; k++) {
+      put_bits(bl_lens[bl_order[k]], 3, op);
+    }
+    for (int k = 0; k < nrle; k++) {
+      uint8_t s = rle_sym[k];
+      put_bits(bl_codes[s], bl_lens[s], op);
+      if      (s == 16) put_bits(rle_val[k], 2, op);
+      else if (s == 17) put_bits(rle_val[k], 3, op);
+      else if (s == 18) put_bits(rle_val[k], 7, op);
+    }
+    lit_lens_use   = lit_lens;
+    lit_codes_use  = lit_codes_dyn;
+    dist_lens_use  = dist_lens;
+    dist_codes_use = dist_codes_dyn;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Compressed data
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  for (size_t k = 0; k < ntok; k++) {
+    if (tok_dist[k] == 0) {
+      uint16_t lit = tok_len[k];
+      put_bits(lit_codes_use[lit], lit_lens_use[lit], op);
+    } else {
+      unsigned int len  = tok_len[k];
+      unsigned int dist = tok_dist[k];
+      unsigned int lc   = len_sym[len - 3];
+      unsigned int dc   = dist_sym(dist);
+      put_bits(lit_codes_use[257 + lc], lit_lens_use[257 + lc], op);
+      if (len_extra[lc]) {
+        put_bits(len - len_base[lc], len_extra[lc], op);
+      }
+      put_bits(dist_codes_use[dc], dist_lens_use[dc], op);
+      if (dist_extra[dc]) {
+        put_bits(dist - dist_base[dc], dist_extra[dc], op);
+      }
+    }
+  }
+  put_bits(lit_codes_use[256], lit_lens_use[256], op);
+  out.resize(op - &out[0]);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compress 'len' bytes.  Input is split into blocks of at most BLOCK_MAX
+// bytes.  Set 'final' on the last call to close the DEFLATE stream.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void DeflateEncoder::compress(const unsigned char *data, size_t len, bool final,
+                              std::vector<unsigned char> &out) {
+
+  size_t worst_case = out.size() + len + len / 16 + 64;
+  if (out.capacity() < worst_case) {
+    out.reserve(std::max(worst_case, 2 * out.capacity()));
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Nothing to compress, but the stream must still be closed
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (len == 0 && final) {
+    tok_len.clear();
+    tok_dist.clear();
+    emit_block(data, 0, true, out);
+  }
+
+  size_t done = 0;
+  while (done < len) {
+    size_t n = std::min((size_t)BLOCK_MAX, len - done);
+
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Slide the window, keeping the most recent 32k as history
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    if (window_len + n > window.size()) {
+      size_t keep  = std::min(window_len, (size_t)WSIZE);
+      size_t shift = window_len - keep;
+      memmove(&window[0], &window[shift], keep);
+      window_base += shift;
+      window_len   = keep;
+    }
+    memcpy(&window[window_len], data + done, n);
+    size_t start = window_len;
+    window_len += n;
+
+    tokenize(start, window_len);
+    emit_block(&window[start], n, final && (done + n == len), out);
+    done += n;
+  }
+
+  size_t pos = out.size();
+  out.resize(pos + 8);
+  unsigned char *op = &out[pos];
+  if (final) {
+    align_to_byte(op);
+  } else {
+    flush_bits(op);
+  }
+  out.resize(op - &out[0]);
+}
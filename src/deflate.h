@@ -0,0 +1,79 @@
+#ifndef FOIST_DEFLATE_H
+#define FOIST_DEFLATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Compression levels
+//
+//   0 STORED   - uncompressed DEFLATE blocks. Not handled by this encoder.
+//                The PNG writer emits these directly (see write_IDAT())
+//   1 RLE      - only look for runs (distance = 1 pixel) and for repeats
+//                of the row above (distance = 1 row).  Very fast.
+//   2 FAST     - as for RLE, plus a single-probe hash table lookup
+//   3 BALANCED - as for RLE, plus hash chains with lazy matching
+//
+// All compressed levels choose the smallest of a fixed Huffman, dynamic
+// Huffman or stored block for every chunk of input.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define DEFLATE_STORED   0
+#define DEFLATE_RLE      1
+#define DEFLATE_FAST     2
+#define DEFLATE_BALANCED 3
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A streaming DEFLATE (RFC1951) encoder.
+//
+// The encoder keeps the last 32k of input as history, so matches can reach
+// back into data from previous calls i.e. the first row of an IDAT can
+// still reference the last row of the previous IDAT.
+//
+// Compressed bytes are appended to 'out'.  Any leftover bits which do not
+// yet fill a complete byte are held over to the next call.  On the final
+// call these bits are padded out to a full byte.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class DeflateEncoder {
+public:
+  DeflateEncoder(int level, size_t stride = 0);
+
+  void compress(const unsigned char *data, size_t len, bool final,
+                std::vector<unsigned char> &out);
+
+  int get_level() const { return level; }
+
+private:
+  int    level;
+  size_t stride;  // Bytes per image row (including filter byte). 0 = unknown
+
+  // Sliding window of history + current input
+  std::vector<unsigned char> window;
+  size_t   window_len;
+  uint64_t window_base;   // absolute stream position of window[0]
+
+  // Hash table and chains. Positions are absolute stream positions + 1
+  // so that 0 can mean 'empty'
+  std::vector<uint64_t> head;
+  std::vector<uint64_t> prev;
+
+  // Tokens for the current block
+  std::vector<uint16_t> tok_len;   // literal value, or match length
+  std::vector<uint16_t> tok_dist;  // 0 for a literal, else match distance
+
+  // Bit output
+  uint64_t bitbuf;
+  int      bitcount;
+
+  void tokenize(size_t start, size_t end);
+  void emit_block(const unsigned char *raw, size_t raw_len, bool final,
+                  std::vector<unsigned char> &out);
+
+  inline void put_bits(uint32_t bits, int nbits, unsigned char *&op);
+  inline void flush_bits(unsigned char *&op);
+  void align_to_byte(unsigned char *&op);
+};
+
+
+#endif
@@ -0,0 +1,118 @@
+#include <ostream>
+#include "Rcpp.h"
+
+using namespace Rcpp;
+
+#include "image-writer.h"
+#include "samples.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Open the output.  The derived class writes the header.
+// A raw vector output has no size hint, and grows as rows are appended.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ImageWriter::ImageWriter(SEXP filename, unsigned int nrow, unsigned int ncol,
+                         unsigned int depth, bool convert_to_row_major) :
+  output(filename, 0), outfile(output.stream()),
+  nrow(nrow), ncol(ncol), depth(depth), convert_to_row_major(convert_to_row_major),
+  rows_written(0), is_open(true) {
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Check that a block of rows matches the image, and write it.
+// 'dims' are the R dimensions of the block
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void ImageWriter::append_rows(SEXP block, const IntegerVector dims) {
+
+  if (!is_open) {
+    stop("append_rows(): The writer has been closed");
+  }
+
+  if (dims.length() < 2 || dims.length() > 3) {
+    stop("append_rows(): 'data' must be a matrix, or an array with 3 planes");
+  }
+
+  const unsigned int block_depth = dims.length() == 3 ? dims[2] : 1;
+  const unsigned int block_rows  = convert_to_row_major ? dims[0] : dims[1];
+  const unsigned int block_ncol  = convert_to_row_major ? dims[1] : dims[0];
+
+  if (block_ncol != ncol || block_depth != depth) {
+    stop("append_rows(): 'data' rows must be the same width (and depth) as the image");
+  }
+
+  if (block_rows > nrow - rows_written) {
+    stop("append_rows(): 'data' has more rows than are left in the image");
+  }
+
+  if (block_rows == 0) {
+    return;
+  }
+
+  write_rows(pixel_samples(block), block_rows);
+  rows_written += block_rows;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Finish the output.  The output is always closed, but is only a valid image
+// if every row was written.  Closing twice does nothing.
+//
+// Returns the raw vector if the output is a raw vector, otherwise R_NilValue
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP ImageWriter::close() {
+
+  if (!is_open) {
+    return R_NilValue;
+  }
+  is_open = false;
+
+  const bool complete = rows_written == nrow;
+  if (complete) {
+    write_trailer();
+  }
+  SEXP res = output.close();
+
+  if (!complete) {
+    stop("close(): The writer was closed before all the image rows were appended");
+  }
+  return res;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' Append a block of rows to an image writer
+//'
+//' @param writer external pointer from one of the \code{.xxx_writer_open()}
+//'        functions
+//' @param block numeric, integer, logical, raw or float32 matrix (or array with 3
+//'        planes) of rows
+//' @param dims \code{dim(block)}
+//'
+//' @return the total number of rows written so far
+//'
+//' @noRd
+// [[Rcpp::export(.writer_append_rows)]]
+int writer_append_rows(SEXP writer, SEXP block, const IntegerVector dims) {
+  XPtr<ImageWriter> w(writer);
+  w->append_rows(block, dims);
+  return w->get_rows_written();
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' Close an image writer
+//'
+//' @param writer external pointer from one of the \code{.xxx_writer_open()}
+//'        functions
+//'
+//' @return the image as a raw vector if the writer was opened with
+//'         \code{filename = NULL}, otherwise NULL
+//'
+//' @noRd
+// [[Rcpp::export(.writer_close)]]
+SEXP writer_close(SEXP writer) {
+  XPtr<ImageWriter> w(writer);
+  return w->close();
+}
@@ -0,0 +1,60 @@
+#ifndef FOIST_IMAGE_WRITER_H
+#define FOIST_IMAGE_WRITER_H
+
+#include <ostream>
+#include "Rcpp.h"
+#include "output.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// An image which is written a block of rows at a time.
+//
+// The file header is written when the writer is created, each call to
+// append_rows() writes its rows straight out, and close() writes whatever
+// trails the image data.  Only the block being appended needs to be in
+// memory, and any state which carries from one row to the next (e.g. the
+// PNG checksums and DEFLATE stream) lives in the writer between calls.
+//
+// A block of rows is a matrix (or array) in the same layout as the data for
+// the write_*_core() functions: with 'convert_to_row_major' each R row is
+// an image row, otherwise each R column is an image row.
+//
+// Rows are always appended top to bottom, so there is no 'flipy'.
+//
+// Each format derives from this class, and is handed to R as an external
+// pointer.  'nrow' and 'ncol' are the size of the output image.  The output
+// can be anything ImageOutput accepts (file, connection, file descriptor or
+// raw vector), and derived classes just write to 'outfile'.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class ImageWriter {
+public:
+  ImageWriter(SEXP filename, unsigned int nrow, unsigned int ncol,
+              unsigned int depth, bool convert_to_row_major);
+  virtual ~ImageWriter() {}
+
+  void append_rows(SEXP block, const Rcpp::IntegerVector dims);
+  SEXP close();
+
+  unsigned int get_rows_written() const { return rows_written; }
+
+protected:
+  ImageOutput   output;
+  std::ostream &outfile;
+  unsigned int  nrow;
+  unsigned int  ncol;
+  unsigned int  depth;                 // planes in the input data: 1 or 3
+  bool          convert_to_row_major;
+
+  // Write 'block_rows' rows of image data from 'block', which is a vector
+  // the pixel pipeline can read in place (see samples.h)
+  virtual void write_rows(SEXP block, unsigned int block_rows) = 0;
+
+  // Write everything after the last row of image data
+  virtual void write_trailer() = 0;
+
+private:
+  unsigned int rows_written;
+  bool         is_open;
+};
+
+
+#endif
@@ -0,0 +1,702 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#include <string>
+#include <system_error>
+#include "Rcpp.h"
+
+using namespace Rcpp;
+
+#include "output.h"
+
+
+void MemoryBuf::set_memory(char *p, size_t used, size_t capacity) {
+  base = p;
+  setp(p + used, p + capacity);
+}
+
+
+unsigned char *MemoryBuf::claim(size_t nbytes) {
+  if ((size_t)(epptr() - pptr()) < nbytes) {
+    return NULL;
+  }
+  unsigned char *p = (unsigned char *)pptr();
+  setp(pptr() + nbytes, epptr());
+  return p;
+}
+
+
+MemoryBuf::int_type MemoryBuf::overflow(int_type c) {
+  if (traits_type::eq_int_type(c, traits_type::eof())) {
+    return traits_type::not_eof(c);
+  }
+  if (!grow(1)) {
+    return traits_type::eof();
+  }
+  *pptr() = traits_type::to_char_type(c);
+  pbump(1);
+  return c;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The writers hand over large blocks (whole IDATs, or a stripe of rows), so
+// these go straight into memory with a single memcpy.  The put area is
+// reset rather than using pbump(), which only takes an 'int'.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+std::streamsize MemoryBuf::xsputn(const char *s, std::streamsize n) {
+  if (epptr() - pptr() < n && !grow(n)) {
+    return 0;
+  }
+  memcpy(pptr(), s, n);
+  setp(pptr() + n, epptr());
+  return n;
+}
+
+
+unsigned char *claim_output(std::ostream &out, size_t nbytes) {
+  MemoryBuf *mem = dynamic_cast<MemoryBuf *>(out.rdbuf());
+  return mem ? mem->claim(nbytes) : NULL;
+}
+
+
+
+RawVectorBuf::RawVectorBuf(size_t size_hint) : buf(no_init(size_hint)) {
+  set_memory((char *)buf.begin(), 0, size_hint);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// At least double the size of the vector
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+bool RawVectorBuf::grow(size_t nbytes) {
+  const size_t used     = size();
+  size_t       capacity = (size_t)buf.size() * 2;
+  if (capacity < used + nbytes) capacity = used + nbytes;
+  if (capacity < 4096)          capacity = 4096;
+
+  RawVector bigger = no_init(capacity);
+  if (used > 0) {
+    memcpy(bigger.begin(), buf.begin(), used);
+  }
+  buf = bigger;
+
+  set_memory((char *)buf.begin(), used, capacity);
+  return true;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The output as a raw vector exactly as long as what was written
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+RawVector RawVectorBuf::result() const {
+  const size_t used = size();
+  if (used == (size_t)buf.size()) {
+    return buf;
+  }
+  RawVector trimmed = no_init(used);
+  memcpy(trimmed.begin(), buf.begin(), used);
+  return trimmed;
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Create the file at its final size and map it.
+//
+// Only on Linux, where posix_fallocate() reserves the disk space up front.
+// Without it, running out of space while writing to the map would be a
+// SIGBUS rather than an error.
+//
+// Anything which already exists and isn't a regular file (e.g. a named
+// pipe) is left alone: even opening and closing a pipe would be seen by
+// whatever is reading it.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+bool MmapBuf::open(const std::string &filename, size_t length) {
+#ifdef __linux__
+  struct stat st;
+  if (stat(filename.c_str(), &st) == 0 && !S_ISREG(st.st_mode)) {
+    return false;
+  }
+
+  int f = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (f < 0) {
+    return false;
+  }
+
+  if (posix_fallocate(f, 0, length) != 0 || ftruncate(f, length) != 0) {
+    ::close(f);
+    return false;
+  }
+
+  void *p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+  if (p == MAP_FAILED) {
+    ::close(f);
+    return false;
+  }
+
+  fd           = f;
+  this->length = length;
+  set_memory((char *)p, 0, length);
+  return true;
+#else
+  (void)filename;
+  (void)length;
+  return false;
+#endif
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Unmap and close the file.  If less was written than expected, the file
+// is cut down to what was written.  false if anything failed.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+bool MmapBuf::close() {
+#ifdef __linux__
+  if (fd < 0) {
+    return true;
+  }
+
+  const size_t used = size();
+  bool ok = munmap(base, length) == 0;
+  if (used < length) {
+    ok = ftruncate(fd, used) == 0 && ok;
+  }
+  ok = ::close(fd) == 0 && ok;
+
+  fd = -1;
+  set_memory(NULL, 0, 0);
+  return ok;
+#else
+  return true;
+#endif
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The put area is the whole block buffer.  Less than a block is ever copied
+// into it at once, so pbump() (which only takes an 'int') is safe here.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+BlockBuf::BlockBuf() : buf(OUTPUT_BLOCK_SIZE), busy(false), stopping(false) {
+  setp(&buf[0], &buf[0] + buf.size());
+}
+
+
+void BlockBuf::put(const char *s, size_t n) {
+  if (error.empty() && n > 0) {
+    write_block(s, n);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Pass on whatever is in the buffer, and wait until it has been written
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void BlockBuf::flush_all() {
+  next_block();
+  if (is_async()) {
+    wait_idle();
+  }
+}
+
+
+void BlockBuf::clear_block() {
+  setp(&buf[0], &buf[0] + buf.size());
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Pass on the buffer and start on an empty one.
+//
+// With a background writer, the buffer is queued and a spare block (or a
+// new one) takes its place.  This waits while OUTPUT_ASYNC_BLOCKS blocks
+// are already queued or being written.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void BlockBuf::next_block() {
+  const size_t len = pptr() - pbase();
+
+  if (!is_async()) {
+    put(pbase(), len);
+    clear_block();
+    return;
+  }
+
+  if (len == 0) {
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&]{ return queue.size() + (busy ? 1 : 0) < OUTPUT_ASYNC_BLOCKS; });
+
+    Block block;
+    block.data.swap(buf);
+    block.len = len;
+    queue.push_back(std::move(block));
+
+    if (!spare.empty()) {
+      buf.swap(spare.back());
+      spare.pop_back();
+    }
+  }
+  cv.notify_all();
+
+  if (buf.empty()) {
+    buf.resize(OUTPUT_BLOCK_SIZE);
+  }
+  clear_block();
+}
+
+
+BlockBuf::int_type BlockBuf::overflow(int_type c) {
+  next_block();
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+  }
+  return traits_type::not_eof(c);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Top up the buffer, pass it on if full, and then either keep the rest or
+// (if it is at least a whole block) pass it straight on without a copy.
+// A background writer always gets a copy, one block at a time.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+std::streamsize BlockBuf::xsputn(const char *s, std::streamsize n) {
+  const std::streamsize total = n;
+
+  if (pptr() != pbase()) {
+    std::streamsize room = epptr() - pptr();
+    std::streamsize k    = n < room ? n : room;
+    memcpy(pptr(), s, k);
+    pbump((int)k);
+    s += k;
+    n -= k;
+    if (n == 0) {
+      return total;
+    }
+    next_block();
+  }
+
+  if (n >= (std::streamsize)buf.size() && !is_async()) {
+    put(s, n);
+    return total;
+  }
+
+  while (n > 0) {
+    std::streamsize room = epptr() - pptr();
+    std::streamsize k    = n < room ? n : room;
+    memcpy(pptr(), s, k);
+    pbump((int)k);
+    s += k;
+    n -= k;
+    if (pptr() == epptr()) {
+      next_block();
+    }
+  }
+
+  return total;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Start the background writer.  false (and carry on writing blocks on the
+// calling thread) if it can't be started.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+bool BlockBuf::start_async() {
+  if (is_async()) {
+    return true;
+  }
+  try {
+    writer = std::thread(&BlockBuf::write_queue, this);
+  } catch (const std::system_error &) {
+    return false;
+  }
+  return true;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write whatever is queued, then stop the background writer.  Anything
+// still in the buffer is not written (see flush_all())
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void BlockBuf::stop_async() {
+  if (!is_async()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    stopping = true;
+  }
+  cv.notify_all();
+  writer.join();
+}
+
+
+void BlockBuf::wait_idle() {
+  std::unique_lock<std::mutex> lock(mtx);
+  cv.wait(lock, [&]{ return queue.empty() && !busy; });
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The background writer: write the queued blocks in order.
+//
+// 'error' is only touched here while the writer is running.  The calling
+// thread reads it after wait_idle() or stop_async().
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void BlockBuf::write_queue() {
+  std::unique_lock<std::mutex> lock(mtx);
+  for (;;) {
+    cv.wait(lock, [&]{ return !queue.empty() || stopping; });
+    if (queue.empty()) {
+      return;
+    }
+
+    Block block = std::move(queue.front());
+    queue.pop_front();
+    busy = true;
+    lock.unlock();
+
+    put(&block.data[0], block.len);
+
+    lock.lock();
+    spare.push_back(std::move(block.data));
+    busy = false;
+    cv.notify_all();
+  }
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Only a regular file is quick to write to.  Anything else (a pipe, socket or
+// terminal), or a descriptor which can't be checked, may keep write(2)
+// waiting on whatever is at the other end.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+bool FdBuf::is_slow() const {
+  struct stat st;
+  return fstat(fd, &st) != 0 || !S_ISREG(st.st_mode);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// write(2) can write less than asked for (e.g. to a pipe), or be interrupted
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void FdBuf::write_block(const char *s, size_t n) {
+  while (n > 0) {
+    ssize_t k = write(fd, s, n);
+    if (k < 0) {
+      if (errno == EINTR) continue;
+      error = std::string("Could not write to ") + what + ": " + strerror(errno);
+      return;
+    }
+    s += k;
+    n -= k;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Pieces which fit in what's left of the block are just copied into it.
+// Otherwise the block and the pieces go out together, without copying.
+// A background writer needs its own copy of everything, as usual.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void FdBuf::gather(const OutputPiece *pieces, size_t n) {
+  if (is_async()) {
+    for (size_t i = 0; i < n; i++) {
+      xsputn((const char *)pieces[i].data, pieces[i].len);
+    }
+    return;
+  }
+
+  size_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    total += pieces[i].len;
+  }
+
+  if (total <= (size_t)(epptr() - pptr())) {
+    for (size_t i = 0; i < n; i++) {
+      memcpy(pptr(), pieces[i].data, pieces[i].len);
+      pbump((int)pieces[i].len);
+    }
+    return;
+  }
+
+  std::vector<OutputPiece> all;
+  all.reserve(n + 1);
+  if (pptr() > pbase()) {
+    OutputPiece block = {pbase(), (size_t)(pptr() - pbase())};
+    all.push_back(block);
+  }
+  for (size_t i = 0; i < n; i++) {
+    if (pieces[i].len > 0) {
+      all.push_back(pieces[i]);
+    }
+  }
+
+  if (error.empty()) {
+    write_pieces(all);
+  }
+  clear_block();
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// writev(2) takes at most IOV_MAX pieces at a time, and (like write(2)) can
+// stop part way through a piece.  'pieces' is used up as it is written.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void FdBuf::write_pieces(std::vector<OutputPiece> &pieces) {
+#ifdef _WIN32
+  for (size_t i = 0; i < pieces.size() && error.empty(); i++) {
+    write_block((const char *)pieces[i].data, pieces[i].len);
+  }
+#else
+#ifdef IOV_MAX
+  const size_t max_iov = IOV_MAX;
+#else
+  const size_t max_iov = 16;
+#endif
+  std::vector<struct iovec> iov(pieces.size() < max_iov ? pieces.size() : max_iov);
+
+  size_t first = 0;
+  while (first < pieces.size()) {
+    size_t niov = pieces.size() - first < max_iov ? pieces.size() - first : max_iov;
+    for (size_t i = 0; i < niov; i++) {
+      iov[i].iov_base = (void *)pieces[first + i].data;
+      iov[i].iov_len  = pieces[first + i].len;
+    }
+
+    ssize_t k = writev(fd, &iov[0], (int)niov);
+    if (k < 0) {
+      if (errno == EINTR) continue;
+      error = std::string("Could not write to ") + what + ": " + strerror(errno);
+      return;
+    }
+
+    // Skip the pieces which were written, and the written part of the next
+    size_t done = (size_t)k;
+    while (first < pieces.size() && done >= pieces[first].len) {
+      done -= pieces[first].len;
+      first++;
+    }
+    if (done > 0) {
+      pieces[first].data = (const char *)pieces[first].data + done;
+      pieces[first].len -= done;
+    }
+  }
+#endif
+}
+
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+bool FileBuf::open(const std::string &filename) {
+  fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  return fd >= 0;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write whatever is left in the buffer, and close the file.  false if the
+// close failed.  A write error is kept in 'error' as usual.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+bool FileBuf::close() {
+  if (fd < 0) {
+    return true;
+  }
+  flush_all();
+  stop_async();
+  bool ok = ::close(fd) == 0;
+  fd = -1;
+  return ok;
+}
+
+
+void write_gather(std::ostream &out, const OutputPiece *pieces, size_t n) {
+  FdBuf *fb = dynamic_cast<FdBuf *>(out.rdbuf());
+  if (fb) {
+    fb->gather(pieces, n);
+  } else {
+    for (size_t i = 0; i < n; i++) {
+      out.write((const char *)pieces[i].data, pieces[i].len);
+    }
+  }
+}
+
+
+
+ConnectionBuf::ConnectionBuf(SEXP con) : con(con), opened(false) {
+  Environment base = Environment::base_namespace();
+  Function isOpen = base["isOpen"];
+  Function open   = base["open"];
+
+  if (!as<bool>(isOpen(con))) {
+    open(con, "wb");
+    opened = true;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// If the writer stop()s part way, a connection opened here is still closed.
+// An R error can't be thrown from here, so it is dropped.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ConnectionBuf::~ConnectionBuf() {
+  try {
+    close();
+  } catch (...) {
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// An R error (e.g. the connection is read-only) is kept, to be reported
+// when the output is closed.  So is an interrupt, which isn't a
+// std::exception: left to escape, std::ostream would swallow it and quietly
+// drop the rest of the output.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void ConnectionBuf::write_block(const char *s, size_t n) {
+  try {
+    Environment base = Environment::base_namespace();
+    Function writeBin = base["writeBin"];
+
+    RawVector block = no_init(n);
+    memcpy(block.begin(), s, n);
+    writeBin(block, con);
+  } catch (std::exception &e) {
+    error = std::string("Could not write to connection: ") + e.what();
+  } catch (...) {
+    error = "Could not write to connection: interrupted";
+  }
+}
+
+
+void ConnectionBuf::close() {
+  if (opened) {
+    opened = false;
+    Environment base = Environment::base_namespace();
+    Function close = base["close"];
+    close(con);
+  }
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Work out which sink 'filename' is, and open it.
+//
+// File descriptors and files are only written from a background thread if
+// they are slow (e.g. a named pipe).  A regular file is written directly,
+// so that stored IDATs can be gathered with writev() without being copied.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ImageOutput::ImageOutput(SEXP filename, size_t size_hint, bool exact_size) : out(NULL) {
+
+  if (Rf_isNull(filename)) {
+    sink = SINK_RAW;
+    buf.reset(new RawVectorBuf(size_hint));
+  } else if (Rf_inherits(filename, "connection")) {
+    sink = SINK_CONNECTION;
+    buf.reset(new ConnectionBuf(filename));
+  } else if ((TYPEOF(filename) == INTSXP || TYPEOF(filename) == REALSXP) &&
+             Rf_length(filename) == 1) {
+    const int fd = as<int>(filename);
+    if (fd < 0) {
+      stop("'filename' is not a valid file descriptor");
+    }
+    sink = SINK_FD;
+    FdBuf *fb = new FdBuf(fd);
+    buf.reset(fb);
+    if (fb->is_slow()) {
+      fb->start_async();
+    }
+  } else if (TYPEOF(filename) == STRSXP && Rf_length(filename) == 1) {
+    const std::string path = as<std::string>(filename);
+
+    sink = SINK_FILE;
+    if (exact_size && size_hint >= MMAP_MIN_SIZE) {
+      MmapBuf *mb = new MmapBuf();
+      buf.reset(mb);
+      if (mb->open(path, size_hint)) {
+        sink = SINK_MMAP;
+      }
+    }
+
+    if (sink == SINK_FILE) {
+      FileBuf *fb = new FileBuf();
+      buf.reset(fb);
+      if (!fb->open(path)) {
+        stop("Could not open file for writing");
+      }
+      if (fb->is_slow()) {
+        fb->start_async();
+      }
+    }
+  } else {
+    stop("'filename' must be a file name, a connection, a file descriptor, or NULL");
+  }
+
+  out.rdbuf(buf.get());
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Finish the output, and report any error from writing it
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+SEXP ImageOutput::close() {
+  std::string error;
+
+  switch (sink) {
+  case SINK_RAW:
+    return static_cast<RawVectorBuf *>(buf.get())->result();
+  case SINK_FILE: {
+    FileBuf *fb = static_cast<FileBuf *>(buf.get());
+    bool closed = fb->close();
+    error = fb->get_error();
+    if (error.empty() && (!closed || !out)) {
+      error = "Could not write to file";
+    }
+    break;
+  }
+  case SINK_MMAP:
+    if (!static_cast<MmapBuf *>(buf.get())->close() || !out) {
+      error = "Could not write to file";
+    }
+    break;
+  case SINK_FD:
+    static_cast<FdBuf *>(buf.get())->flush_all();
+    error = static_cast<FdBuf *>(buf.get())->get_error();
+    if (error.empty() && !out) {
+      error = "Could not write to file descriptor";
+    }
+    break;
+  case SINK_CONNECTION: {
+    ConnectionBuf *cb = static_cast<ConnectionBuf *>(buf.get());
+    cb->flush_all();
+    error = cb->get_error();
+    if (error.empty() && !out) {
+      error = "Could not write to connection";
+    }
+    cb->close();
+    break;
+  }
+  }
+
+  if (!error.empty()) {
+    stop(error);
+  }
+  return R_NilValue;
+}
@@ -0,0 +1,308 @@
+#ifndef FOIST_OUTPUT_H
+#define FOIST_OUTPUT_H
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Rcpp.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Bytes are handed to a file descriptor or R connection in blocks of this
+// size.  Large enough that a pipe to e.g. ffmpeg is limited by the reader,
+// not by the number of write(2) calls.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define OUTPUT_BLOCK_SIZE (1 << 20)
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// With a background writer, up to this many full blocks are queued or being
+// written while the next one is filled.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define OUTPUT_ASYNC_BLOCKS 2
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Only map a file for output if it will be at least this big.  For smaller
+// files a single write(2) is cheaper than setting up the mapping.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define MMAP_MIN_SIZE (1 << 20)
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A streambuf over a block of memory which holds the whole output: an R raw
+// vector or a memory-mapped file.
+//
+// The put area is always [pptr(), end of memory), and 'base' is the start
+// of the memory, so the number of bytes written so far is pptr() - base.
+//
+// claim() lets a writer generate pixels straight into their final place,
+// rather than into a buffer which is then copied into the stream.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class MemoryBuf : public std::streambuf {
+public:
+  MemoryBuf() : base(NULL) {}
+  virtual ~MemoryBuf() {}
+
+  size_t         size() const { return pptr() - base; }
+  unsigned char *claim(size_t nbytes);
+
+protected:
+  char *base;
+
+  void set_memory(char *p, size_t used, size_t capacity);
+
+  // Make room for at least 'nbytes' more bytes.  false if there can't be
+  virtual bool grow(size_t nbytes) = 0;
+
+  int_type        overflow(int_type c);
+  std::streamsize xsputn(const char *s, std::streamsize n);
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Output into the memory of an R raw vector.
+//
+// The vector is allocated up front with 'size_hint' bytes.  When the hint
+// is the exact size of the output (e.g. PNM, GIF and uncompressed PNG),
+// the bytes are written once, into their final place, and the vector is
+// returned as-is.  Otherwise the vector doubles in size whenever it fills
+// up, and is trimmed to size (one copy) at the end.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class RawVectorBuf : public MemoryBuf {
+public:
+  explicit RawVectorBuf(size_t size_hint);
+
+  Rcpp::RawVector result() const;
+
+protected:
+  bool grow(size_t nbytes);
+
+private:
+  Rcpp::RawVector buf;
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Output into a regular file which is created with its final size and
+// mapped into memory.  Only for output whose exact size is known up front,
+// so it never grows: writing past the end is an error.
+//
+// open() returns false (and leaves nothing open) if the file can't be
+// mapped e.g. it is a pipe, or mmap() isn't available.  The caller then
+// falls back to writing the file with a FileBuf.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class MmapBuf : public MemoryBuf {
+public:
+  MmapBuf() : fd(-1), length(0) {}
+  ~MmapBuf() { close(); }
+
+  bool open(const std::string &filename, size_t length);
+  bool close();
+
+protected:
+  bool grow(size_t) { return false; }
+
+private:
+  int    fd;
+  size_t length;
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// If 'out' writes into memory (a raw vector or mapped file) with room for
+// 'nbytes' more bytes, return where those bytes go and move the stream past
+// them.  The caller must fill them in.  Otherwise NULL, and the caller
+// writes to 'out' as usual.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+unsigned char *claim_output(std::ostream &out, size_t nbytes);
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// One piece of a gathered write.  See write_gather()
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct OutputPiece {
+  const void *data;
+  size_t      len;
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write 'n' pieces of memory to 'out', one after the other.
+//
+// A file or file descriptor without a background writer gets them (along
+// with anything already in its block buffer) in one writev(2), so the
+// pieces are never copied.  Unless they're small enough to fit in the block
+// buffer, which is cheaper than a system call.  Any other output just gets
+// the pieces one at a time.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_gather(std::ostream &out, const OutputPiece *pieces, size_t n);
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A streambuf which collects bytes into blocks of OUTPUT_BLOCK_SIZE and
+// passes each full block on with write_block().  Writes at least as big as
+// a block skip the buffer.  Nothing is passed on early: flush_all() is only
+// called when the output is closed.
+//
+// After start_async(), write_block() is called from a background thread
+// instead, so the image data for the next block is generated while the
+// last one is being written.  Everything is then copied into a block, as
+// the caller is free to reuse its memory as soon as a write returns.  A
+// derived class must call stop_async() in its destructor.
+//
+// Errors while writing do not throw (the writers may be part way through
+// handing out work to threads).  The first error is kept, the rest of the
+// output is dropped, and the error is reported by ImageOutput::close().
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class BlockBuf : public std::streambuf {
+public:
+  BlockBuf();
+  virtual ~BlockBuf() {}
+
+  bool               start_async();
+  void               flush_all();
+  const std::string &get_error() const { return error; }
+
+protected:
+  std::string error;
+
+  // Write 'n' bytes.  Set 'error' on failure
+  virtual void write_block(const char *s, size_t n) = 0;
+
+  // Empty the buffer, once its contents have been written some other way
+  void clear_block();
+
+  bool is_async() const { return writer.joinable(); }
+  void stop_async();
+
+  int_type        overflow(int_type c);
+  std::streamsize xsputn(const char *s, std::streamsize n);
+
+private:
+  std::vector<char> buf;
+
+  // Background writing.  'spare' holds blocks which have been written, for
+  // reuse.  'busy' while the thread is writing a block.
+  struct Block {
+    std::vector<char> data;
+    size_t            len;
+  };
+
+  std::thread                     writer;
+  std::mutex                      mtx;
+  std::condition_variable         cv;
+  std::deque<Block>               queue;
+  std::vector<std::vector<char> > spare;
+  bool                            busy;
+  bool                            stopping;
+
+  void put(const char *s, size_t n);
+  void next_block();
+  void wait_idle();
+  void write_queue();
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Blocks go to an already open file descriptor with write(2) e.g. 1 for
+// stdout.  The descriptor belongs to the caller, and is never closed.
+//
+// gather() is write_gather() for a file descriptor.  Only without a
+// background writer (i.e. for a regular file, see ImageOutput) are the
+// pieces written in place with writev().
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class FdBuf : public BlockBuf {
+public:
+  explicit FdBuf(int fd, const char *what = "file descriptor") : fd(fd), what(what) {}
+  ~FdBuf() { stop_async(); }
+
+  void gather(const OutputPiece *pieces, size_t n);
+
+  // true unless 'fd' is a regular file
+  bool is_slow() const;
+
+protected:
+  int fd;
+
+  void write_block(const char *s, size_t n);
+
+private:
+  const char *what;  // For error messages
+
+  void write_pieces(std::vector<OutputPiece> &pieces);
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A file descriptor for a file which is opened (created or truncated) here,
+// and closed by close().  Used for files which aren't memory-mapped.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class FileBuf : public FdBuf {
+public:
+  FileBuf() : FdBuf(-1, "file") {}
+  ~FileBuf() { close(); }
+
+  bool open(const std::string &filename);
+  bool close();
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Blocks go to an R connection with writeBin().  A connection which is not
+// open is opened ("wb") and closed again by close(), or by the destructor
+// if the output is abandoned.  An open connection is left open.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class ConnectionBuf : public BlockBuf {
+public:
+  explicit ConnectionBuf(SEXP con);
+  ~ConnectionBuf();
+
+  void close();
+
+protected:
+  void write_block(const char *s, size_t n);
+
+private:
+  Rcpp::RObject con;
+  bool          opened;
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Where the encoded image goes.  'filename' is one of
+//   - a file name (including a named pipe)
+//   - an R connection
+//   - a file descriptor (a single number) e.g. 1 for stdout
+//   - NULL, for a raw vector 'size_hint' bytes to start with
+//
+// If 'exact_size' then 'size_hint' is the exact size of the output, and a
+// large enough regular file is written through a memory map.
+//
+// The writers only ever see the std::ostream.  close() returns the raw
+// vector, or R_NilValue for the other outputs.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class ImageOutput {
+public:
+  ImageOutput(SEXP filename, size_t size_hint, bool exact_size = false);
+
+  std::ostream &stream() { return out; }
+  SEXP close();
+
+private:
+  enum Sink { SINK_FILE, SINK_MMAP, SINK_CONNECTION, SINK_FD, SINK_RAW };
+
+  Sink                            sink;
+  std::unique_ptr<std::streambuf> buf;
+  std::ostream                    out;
+};
+
+
+#endif
@@ -0,0 +1,346 @@
+#ifndef FOIST_PIXELS_H
+#define FOIST_PIXELS_H
+
+#include <stddef.h>
+#include <string.h>
+
+#include "quantise.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Pixel pipeline shared by the PNG, PNM and GIF writers
+//
+// A pixel source turns the samples of an R matrix or array into rows of
+// 8-bit output pixels.  The choices which used to be runtime branches in
+// each writer's loops are template parameters, so every combination gets
+// its own inner loops:
+//
+//   T          the type of the samples, read in place: double, int (R
+//              integer or logical), float ('float' package float32) or
+//              unsigned char (R raw)
+//   ROW_MAJOR  convert R's column-major data to row-major output
+//   FLIPY      output row 0 is the last row of the data
+//   NPLANE     planes of the array interleaved into each pixel
+//              (1 = grey or palette indices, 3 = RGB)
+//
+// PalettePixels<> wraps a 1 plane source and looks up each index in a
+// palette.
+//
+// Every pixel source has
+//
+//   CHANNELS   bytes per output pixel
+//   BAND_ROWS  how many rows are worth asking for at once:
+//              QUANTISE_BAND_ROWS when converting to row-major order (see
+//              quantise8_rows()), otherwise 1
+//   nrow, ncol the size of the output image
+//
+//   fill(uc, ustride, row, n, col, m)
+//              write columns [col, col + m) of output rows [row, row + n)
+//              to 'uc', with the rows 'ustride' bytes apart.  Any number
+//              of rows can be asked for.
+//   fill_image(uc)
+//              write the whole image to memory which won't be read again
+//              here (a memory-mapped file or raw vector)
+//
+// The writers only add their own framing around the rows: nothing for
+// PNM, the filter byte and IDATs for PNG, and the chunk length and CLEAR
+// codes for GIF.  with_pixels() picks the specialisation matching the
+// runtime arguments, and hands it to a functor with a templated
+// operator().
+//
+// As in the rest of foist, 'nrow' and 'ncol' are the size of the output
+// image, so when not converting to row-major order they are swapped
+// relative to the R data.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+enum SampleType {
+  SAMPLE_DOUBLE,   // R numeric
+  SAMPLE_INT,      // R integer or logical
+  SAMPLE_FLOAT,    // float32 from the 'float' package
+  SAMPLE_RAW       // R raw
+};
+
+struct PixelData {
+  const void   *v0;
+  SampleType    type;
+  unsigned int  nrow;
+  unsigned int  ncol;
+  SampleScale   scale;
+};
+
+// Bytes per sample of each SampleType
+static inline size_t sample_bytes(SampleType type) {
+  switch (type) {
+  case SAMPLE_INT:   return sizeof(int);
+  case SAMPLE_FLOAT: return sizeof(float);
+  case SAMPLE_RAW:   return 1;
+  default:           return sizeof(double);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// How Pixels<> quantises each type of sample (see quantise.h).  Doubles,
+// integers and floats are scaled; raw bytes are looked up in a ByteTable,
+// which is built once per image.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline double to_sample(double x) { return x; }
+static inline double to_sample(int    x) { return int_sample(x); }
+static inline double to_sample(float  x) { return x; }
+
+template <class T>
+struct SampleQuantiser {
+  SampleScale scale;
+
+  explicit SampleQuantiser(const SampleScale &scale) : scale(scale) {}
+
+  unsigned char one(T x) const {
+    return (unsigned char)scale.one(to_sample(x));
+  }
+
+  void row(unsigned char *out, size_t ostep, const T *v, size_t vstride, size_t n) const {
+    quantise8(out, ostep, v, vstride, n, scale);
+  }
+
+  void band(unsigned char *out, ptrdiff_t ostride, size_t ostep, const T *v, size_t vstride,
+            size_t n, size_t ncol) const {
+    quantise8_rows(out, ostride, ostep, v, vstride, n, ncol, scale);
+  }
+};
+
+template <>
+struct SampleQuantiser<unsigned char> {
+  ByteTable table;
+
+  explicit SampleQuantiser(const SampleScale &scale) : table(scale) {}
+
+  unsigned char one(unsigned char x) const {
+    return table.sample[x];
+  }
+
+  void row(unsigned char *out, size_t ostep, const unsigned char *v, size_t vstride, size_t n) const {
+    quantise8(out, ostep, v, vstride, n, table);
+  }
+
+  void band(unsigned char *out, ptrdiff_t ostride, size_t ostep, const unsigned char *v,
+            size_t vstride, size_t n, size_t ncol) const {
+    quantise8_rows(out, ostride, ostep, v, vstride, n, ncol, table);
+  }
+};
+
+
+template <class T, bool ROW_MAJOR, bool FLIPY, unsigned int NPLANE>
+struct Pixels {
+  static const unsigned int CHANNELS  = NPLANE;
+  static const unsigned int BAND_ROWS = ROW_MAJOR ? QUANTISE_BAND_ROWS : 1;
+
+  const T            *v0;
+  unsigned int        nrow;
+  unsigned int        ncol;
+  SampleQuantiser<T>  q;
+
+  explicit Pixels(const PixelData &data) :
+    v0((const T *)data.v0), nrow(data.nrow), ncol(data.ncol),
+    q(data.scale) {}
+
+  void fill(unsigned char *uc, size_t ustride, unsigned int row, unsigned int n,
+            unsigned int col, unsigned int m) const {
+    const size_t plane = (size_t)nrow * ncol;
+
+    if (ROW_MAJOR) {
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+      // A band of rows at a time, reading down R's columns.  With FLIPY the
+      // band comes from the bottom of the matrix, and is written bottom-up.
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+      const ptrdiff_t ostride = FLIPY ? -(ptrdiff_t)ustride : (ptrdiff_t)ustride;
+      for (unsigned int k = 0; k < n; k += QUANTISE_BAND_ROWS) {
+        const unsigned int b   = n - k < QUANTISE_BAND_ROWS ? n - k : QUANTISE_BAND_ROWS;
+        const size_t       src = FLIPY ? nrow - (row + k) - b : row + k;
+        unsigned char     *out = uc + (FLIPY ? k + b - 1 : k) * ustride;
+        const T           *v   = v0 + src + (size_t)col * nrow;
+        for (unsigned int p = 0; p < NPLANE; p++) {
+          q.band(out + p, ostride, NPLANE, v + plane * p, nrow, b, m);
+        }
+      }
+    } else if (NPLANE == 1 && !FLIPY && col == 0 && m == ncol && (n == 1 || ustride == ncol)) {
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+      // Whole rows in R's order, packed together: one run of samples
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+      q.row(uc, 1, v0 + (size_t)ncol * row, 1, (size_t)n * ncol);
+    } else if (NPLANE == 1) {
+      for (unsigned int k = 0; k < n; k++) {
+        const size_t offset = FLIPY ? nrow - 1 - (row + k) : row + k;
+        q.row(uc + k * ustride, 1, v0 + (size_t)ncol * offset + col, 1, m);
+      }
+    } else {
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+      // Each plane is contiguous along the row.  Reading all of them at
+      // once and writing each pixel whole is limited by memory bandwidth,
+      // and is faster than quantising the planes separately and then
+      // interleaving them.
+      //
+      // The byte stores could alias anything, so keep everything the loop
+      // reads in locals.  RGB is written out by hand with a pointer per
+      // plane: the generic loop over planes is not unrolled, and is about
+      // half the speed.
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+      const SampleQuantiser<T> sq = q;
+      for (unsigned int k = 0; k < n; k++) {
+        const size_t   offset = FLIPY ? nrow - 1 - (row + k) : row + k;
+        const T       *v      = v0 + (size_t)ncol * offset + col;
+        unsigned char *out    = uc + k * ustride;
+        if (NPLANE == 3) {
+          const T *r = v, *g = v + plane, *b = v + 2 * plane;
+          for (unsigned int i = 0; i < m; i++) {
+            *out++ = sq.one(*r++);
+            *out++ = sq.one(*g++);
+            *out++ = sq.one(*b++);
+          }
+        } else {
+          for (size_t i = 0; i < m; i++, out += NPLANE) {
+            for (unsigned int p = 0; p < NPLANE; p++) {
+              out[p] = sq.one(v[i + plane * p]);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  void fill_image(unsigned char *uc) const {
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // A large grey image of doubles in R's order is one run of samples
+    // going straight to memory, so bypass the cache
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    const size_t n = (size_t)nrow * ncol;
+    if (stream(uc, v0, n)) {
+      return;
+    }
+    fill(uc, (size_t)ncol * CHANNELS, 0, nrow, 0, ncol);
+  }
+
+private:
+  bool stream(unsigned char *uc, const double *v, size_t n) const {
+    if (ROW_MAJOR || FLIPY || NPLANE != 1 || n < QUANTISE_STREAM_BYTES) {
+      return false;
+    }
+    quantise8_stream(uc, v, n, q.scale);
+    return true;
+  }
+
+  template <class U>
+  bool stream(unsigned char *, const U *, size_t) const {
+    return false;
+  }
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// RGB pixels from a palette: each 8-bit sample of 'Index' is looked up in a
+// table of up to 256 colours.
+//
+// 'pal' is an R integer matrix with one row per colour, and (at least)
+// red, green and blue columns.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template <class Index>
+struct PalettePixels {
+  static const unsigned int CHANNELS  = 3;
+  static const unsigned int BAND_ROWS = Index::BAND_ROWS;
+
+  Index         index;
+  unsigned int  nrow;
+  unsigned int  ncol;
+  unsigned char rgb[256 * 3];
+
+  PalettePixels(const Index &index, const int *pal, unsigned int npal) :
+    index(index), nrow(index.nrow), ncol(index.ncol) {
+    memset(rgb, 0, sizeof(rgb));
+    for (unsigned int i = 0; i < npal && i < 256; i++) {
+      rgb[3 * i    ] = (unsigned char)pal[i           ];
+      rgb[3 * i + 1] = (unsigned char)pal[i + npal    ];
+      rgb[3 * i + 2] = (unsigned char)pal[i + npal * 2];
+    }
+  }
+
+  void fill(unsigned char *uc, size_t ustride, unsigned int row, unsigned int n,
+            unsigned int col, unsigned int m) const {
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Indices for a block of up to BAND_ROWS x 256 pixels at a time
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    const unsigned int block_cols = 256;
+    unsigned char idx[BAND_ROWS * block_cols];
+
+    for (unsigned int k = 0; k < n; k += BAND_ROWS) {
+      const unsigned int b = n - k < BAND_ROWS ? n - k : BAND_ROWS;
+      for (unsigned int c = 0; c < m; c += block_cols) {
+        const unsigned int w = m - c < block_cols ? m - c : block_cols;
+        index.fill(idx, w, row + k, b, col + c, w);
+        for (unsigned int j = 0; j < b; j++) {
+          unsigned char       *out = uc + (k + j) * ustride + (size_t)c * 3;
+          const unsigned char *in  = idx + j * w;
+          for (unsigned int i = 0; i < w; i++) {
+            memcpy(out + 3 * i, rgb + 3 * in[i], 3);
+          }
+        }
+      }
+    }
+  }
+
+  void fill_image(unsigned char *uc) const {
+    fill(uc, (size_t)ncol * CHANNELS, 0, nrow, 0, ncol);
+  }
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Call 'func' with the Pixels<> for these arguments.  'nplane' must be 1
+// or 3.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template <class T, unsigned int NPLANE, class Func>
+void with_typed_pixels(Func &func, const PixelData &data, bool convert_to_row_major,
+                       bool flipy) {
+  if (convert_to_row_major) {
+    if (flipy) {
+      func(Pixels<T, true , true , NPLANE>(data));
+    } else {
+      func(Pixels<T, true , false, NPLANE>(data));
+    }
+  } else {
+    if (flipy) {
+      func(Pixels<T, false, true , NPLANE>(data));
+    } else {
+      func(Pixels<T, false, false, NPLANE>(data));
+    }
+  }
+}
+
+
+template <unsigned int NPLANE, class Func>
+void with_pixels_planes(Func &func, const PixelData &data, bool convert_to_row_major,
+                        bool flipy) {
+  switch (data.type) {
+  case SAMPLE_INT:
+    with_typed_pixels<int          , NPLANE>(func, data, convert_to_row_major, flipy);
+    break;
+  case SAMPLE_FLOAT:
+    with_typed_pixels<float        , NPLANE>(func, data, convert_to_row_major, flipy);
+    break;
+  case SAMPLE_RAW:
+    with_typed_pixels<unsigned char, NPLANE>(func, data, convert_to_row_major, flipy);
+    break;
+  default:
+    with_typed_pixels<double       , NPLANE>(func, data, convert_to_row_major, flipy);
+    break;
+  }
+}
+
+
+template <class Func>
+void with_pixels(Func &func, const PixelData &data, unsigned int nplane,
+                 bool convert_to_row_major, bool flipy) {
+  if (nplane == 3) {
+    with_pixels_planes<3>(func, data, convert_to_row_major, flipy);
+  } else {
+    with_pixels_planes<1>(func, data, convert_to_row_major, flipy);
+  }
+}
+
+#endif
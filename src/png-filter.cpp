@@ -0,0 +1,265 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// PNG scanline filters
+//
+// Reference: https://www.w3.org/TR/PNG/#9Filters
+//
+// When encoding, every filter only depends on the *unfiltered* bytes of the
+// current and previous rows, so there is no serial dependency along the
+// row (unlike decoding), and Average and Paeth vectorise nicely.
+//
+// SSE2 versions are used on x86-64 (where SSE2 is always available, so
+// there are none of the compilation issues we had with the old SSE adler32).
+// Other platforms use the scalar versions.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "png-filter.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Sub:  Raw(x) - Raw(x - bpp)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void filter_sub(unsigned char *out, const unsigned char *raw, size_t n, size_t bpp) {
+  size_t i = 0;
+  for (; i < bpp && i < n; i++) {
+    out[i] = raw[i];
+  }
+  for (; i < n; i++) {
+    out[i] = raw[i] - raw[i - bpp];
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Up:  Raw(x) - Prior(x)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void filter_up(unsigned char *out, const unsigned char *raw, const unsigned char *prev, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    out[i] = raw[i] - prev[i];
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Average:  Raw(x) - floor((Raw(x - bpp) + Prior(x)) / 2)
+//
+// SSE2 has an unsigned byte average, but it rounds up. Rounding down
+// is achieved by subtracting the carry from the lowest bit:
+//      floor((a + b)/2) = avg_up(a, b) - ((a ^ b) & 1)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void filter_average(unsigned char *out, const unsigned char *raw, const unsigned char *prev,
+                           size_t n, size_t bpp) {
+  size_t i = 0;
+  for (; i < bpp && i < n; i++) {
+    out[i] = raw[i] - (prev[i] >> 1);
+  }
+
+#if defined(__SSE2__)
+  const __m128i one = _mm_set1_epi8(1);
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(raw  + i - bpp));
+    __m128i b = _mm_loadu_si128((const __m128i *)(prev + i      ));
+    __m128i x = _mm_loadu_si128((const __m128i *)(raw  + i      ));
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_sub_epi8(x, avg));
+  }
+#endif
+
+  for (; i < n; i++) {
+    out[i] = raw[i] - ((raw[i - bpp] + prev[i]) >> 1);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Paeth:  Raw(x) - PaethPredictor(Raw(x - bpp), Prior(x), Prior(x - bpp))
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline unsigned char paeth_predictor(int a, int b, int c) {
+  int pa = abs(b - c);
+  int pb = abs(a - c);
+  int pc = abs(a + b - 2 * c);
+  if (pa <= pb && pa <= pc) return (unsigned char)a;
+  if (pb <= pc) return (unsigned char)b;
+  return (unsigned char)c;
+}
+
+#if defined(__SSE2__)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Paeth predictor for 8 pixels at once in 16-bit lanes
+//   pa = |b - c|,  pb = |a - c|,  pc = |(b - c) + (a - c)|
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline __m128i paeth_predictor_epi16(__m128i a, __m128i b, __m128i c) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i bc = _mm_sub_epi16(b, c);
+  __m128i ac = _mm_sub_epi16(a, c);
+  __m128i pc = _mm_add_epi16(bc, ac);
+  __m128i pa = _mm_max_epi16(bc, _mm_sub_epi16(zero, bc));
+  __m128i pb = _mm_max_epi16(ac, _mm_sub_epi16(zero, ac));
+  pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+  __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+  __m128i not_b = _mm_cmpgt_epi16(pb, pc);
+
+  __m128i b_or_c = _mm_or_si128(_mm_andnot_si128(not_b, b), _mm_and_si128(not_b, c));
+  return _mm_or_si128(_mm_andnot_si128(not_a, a), _mm_and_si128(not_a, b_or_c));
+}
+#endif
+
+static void filter_paeth(unsigned char *out, const unsigned char *raw, const unsigned char *prev,
+                         size_t n, size_t bpp) {
+  size_t i = 0;
+  // a = c = 0 for the first pixel, so the predictor is always 'b'
+  for (; i < bpp && i < n; i++) {
+    out[i] = raw[i] - prev[i];
+  }
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(raw  + i - bpp));
+    __m128i b = _mm_loadu_si128((const __m128i *)(prev + i      ));
+    __m128i c = _mm_loadu_si128((const __m128i *)(prev + i - bpp));
+    __m128i x = _mm_loadu_si128((const __m128i *)(raw  + i      ));
+
+    __m128i lo = paeth_predictor_epi16(_mm_unpacklo_epi8(a, zero),
+                                       _mm_unpacklo_epi8(b, zero),
+                                       _mm_unpacklo_epi8(c, zero));
+    __m128i hi = paeth_predictor_epi16(_mm_unpackhi_epi8(a, zero),
+                                       _mm_unpackhi_epi8(b, zero),
+                                       _mm_unpackhi_epi8(c, zero));
+
+    _mm_storeu_si128((__m128i *)(out + i), _mm_sub_epi8(x, _mm_packus_epi16(lo, hi)));
+  }
+#endif
+
+  for (; i < n; i++) {
+    out[i] = raw[i] - paeth_predictor(raw[i - bpp], prev[i], prev[i - bpp]);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Sum of absolute values of the filtered bytes, treated as signed bytes.
+// This is the adaptive filter heuristic from the PNG spec.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static uint64_t sum_abs_signed(const unsigned char *x, size_t n) {
+  uint64_t total = 0;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(x + i));
+    // |signed(v)| == min(v, -v) when viewed as unsigned bytes
+    __m128i m = _mm_min_epu8(v, _mm_sub_epi8(zero, v));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(m, zero));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  total = lanes[0] + lanes[1];
+#endif
+
+  for (; i < n; i++) {
+    total += x[i] < 128 ? x[i] : 256 - x[i];
+  }
+  return total;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Apply the given filter type (0-4), writing output to 'out'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static void filter_row(int type, unsigned char *out, const unsigned char *raw,
+                       const unsigned char *prev, size_t n, size_t bpp) {
+  switch(type) {
+  case PNG_FILTER_SUB:
+    filter_sub(out, raw, n, bpp);
+    break;
+  case PNG_FILTER_UP:
+    filter_up(out, raw, prev, n);
+    break;
+  case PNG_FILTER_AVERAGE:
+    filter_average(out, raw, prev, n, bpp);
+    break;
+  case PNG_FILTER_PAETH:
+    filter_paeth(out, raw, prev, n, bpp);
+    break;
+  default:
+    memcpy(out, raw, n);
+  }
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The 'previous row' for the first row of the image is all zeros
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+PngFilter::PngFilter(int filter, size_t rowbytes, size_t bpp) :
+  filter(filter), rowbytes(rowbytes), bpp(bpp < 1 ? 1 : bpp) {
+
+  if (filter == PNG_FILTER_NONE) {
+    return;
+  }
+  raw.assign(rowbytes, 0);
+  prev.assign(rowbytes, 0);
+  if (filter == PNG_FILTER_ADAPTIVE) {
+    cand.assign(4 * rowbytes, 0);
+  }
+}
+
+
+void PngFilter::apply(unsigned char *row) {
+
+  if (filter == PNG_FILTER_NONE) {
+    row[0] = PNG_FILTER_NONE;
+    return;
+  }
+
+  unsigned char *data = row + 1;
+  memcpy(&raw[0], data, rowbytes);
+
+  if (filter != PNG_FILTER_ADAPTIVE) {
+    row[0] = (unsigned char)filter;
+    filter_row(filter, data, &raw[0], &prev[0], rowbytes, bpp);
+  } else {
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Try every filter and keep the one with the smallest output
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    int      best_type = PNG_FILTER_NONE;
+    uint64_t best_sum  = sum_abs_signed(&raw[0], rowbytes);
+
+    for (int type = PNG_FILTER_SUB; type <= PNG_FILTER_PAETH; type++) {
+      unsigned char *out = &cand[(type - 1) * rowbytes];
+      filter_row(type, out, &raw[0], &prev[0], rowbytes, bpp);
+      uint64_t sum = sum_abs_signed(out, rowbytes);
+      if (sum < best_sum) {
+        best_sum  = sum;
+        best_type = type;
+      }
+    }
+
+    row[0] = (unsigned char)best_type;
+    if (best_type != PNG_FILTER_NONE) {
+      memcpy(data, &cand[(best_type - 1) * rowbytes], rowbytes);
+    }
+  }
+
+  raw.swap(prev);
+}
+
+
+void PngFilter::set_previous_row(const unsigned char *row) {
+  if (filter == PNG_FILTER_NONE) {
+    return;
+  }
+  memcpy(&prev[0], row, rowbytes);
+}
@@ -0,0 +1,53 @@
+#ifndef FOIST_PNG_FILTER_H
+#define FOIST_PNG_FILTER_H
+
+#include <stddef.h>
+#include <vector>
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// PNG filter types.  https://www.w3.org/TR/PNG/#9Filters
+// The values 0-4 are the filter-type byte written at the start of each row.
+// PNG_FILTER_ADAPTIVE chooses one of these for each row.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define PNG_FILTER_NONE     0
+#define PNG_FILTER_SUB      1
+#define PNG_FILTER_UP       2
+#define PNG_FILTER_AVERAGE  3
+#define PNG_FILTER_PAETH    4
+#define PNG_FILTER_ADAPTIVE 5
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Filter rows of image data in-place as they are written to the stripe buffer
+//
+// 'row' points to the filter-type byte at the start of a row, and is
+// followed by 'rowbytes' bytes of unfiltered data.  A copy of the unfiltered
+// row is kept, as the filters for the next row need it.
+//
+// Adaptive filtering uses the 'minimum sum of absolute differences'
+// heuristic recommended by the PNG spec:  each filter is tried, and the one
+// whose output bytes (as signed values) have the smallest total magnitude
+// is used.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class PngFilter {
+public:
+  PngFilter(int filter, size_t rowbytes, size_t bpp);
+
+  void apply(unsigned char *row);
+
+  // Set the (unfiltered) row which precedes the next call to apply().
+  // Only needed when filtering starts part way through an image
+  void set_previous_row(const unsigned char *row);
+
+private:
+  int    filter;
+  size_t rowbytes;
+  size_t bpp;      // bytes per complete pixel (minimum 1)
+
+  std::vector<unsigned char> raw;   // unfiltered copy of the current row
+  std::vector<unsigned char> prev;  // unfiltered copy of the previous row
+  std::vector<unsigned char> cand;  // adaptive: output of each filter
+};
+
+
+#endif
@@ -0,0 +1,150 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Quantise contiguous doubles to 8-bit samples using AVX2
+//
+// 32 doubles per loop:
+//   - scale and offset (4 doubles per register)
+//   - clamp, swap NaN for the NA sample, truncate to int32 (VCVTTPD2DQ)
+//     and add the bias, as SampleScale::one() does (see quantise.h)
+//   - pack to 16 bits then 8 bits.  The samples are in [0, 255] so the
+//     packs don't saturate them.  The packs work within each 128-bit
+//     lane, so the 4-byte groups are then put back in order with a
+//     cross-lane permute
+//
+// quantise8f_avx2() does the same for floats: each load is 8 floats (one
+// 256-bit register), widened to 2 x 4 doubles (VCVTPS2PD) before the same
+// scale, offset and truncation, so only the reads are halved.
+//
+// Compiled with a per-function 'target' attribute, so only ever call these
+// when cpu_features().avx2 is true.  See quantise8() in quantise.cpp
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdint.h>
+
+#include "quantise.h"
+#include "cpu-features.h"
+
+#ifdef FOIST_X86_DISPATCH
+
+#include <immintrin.h>
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A SampleScale in AVX registers (see ScaleSSE2 in quantise.cpp)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct ScaleAVX2 {
+  __m256d scale;
+  __m256d offset;
+  __m256d lo;
+  __m256d hi;
+  __m256d na;
+  __m128i bias;
+};
+
+
+__attribute__((target("avx2")))
+static inline ScaleAVX2 scale_avx2(const SampleScale &s) {
+  ScaleAVX2 q = {
+    _mm256_set1_pd(s.scale_factor), _mm256_set1_pd(s.round_offset),
+    _mm256_set1_pd(s.lo), _mm256_set1_pd(s.hi),
+    _mm256_set1_pd((double)s.na - s.bias), _mm_set1_epi32(s.bias)
+  };
+  return q;
+}
+
+
+// 4 doubles -> 4 x int32 samples
+__attribute__((target("avx2")))
+static inline __m128i cvt4(__m256d d, const ScaleAVX2 &q) {
+  __m256d y   = _mm256_add_pd(_mm256_mul_pd(d, q.scale), q.offset);
+  __m256d nan = _mm256_cmp_pd(y, y, _CMP_UNORD_Q);
+  y = _mm256_min_pd(_mm256_max_pd(y, q.lo), q.hi);   // MAXPD gives 'lo' for NaN
+  y = _mm256_blendv_pd(y, q.na, nan);
+  return _mm_add_epi32(_mm256_cvttpd_epi32(y), q.bias);
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i cvt8(__m256d lo, __m256d hi, const ScaleAVX2 &q) {
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(cvt4(lo, q)), cvt4(hi, q), 1);
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i cvt8(const double *v, const ScaleAVX2 &q) {
+  return cvt8(_mm256_loadu_pd(v), _mm256_loadu_pd(v + 4), q);
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i cvt8(const float *v, const ScaleAVX2 &q) {
+  const __m256 f = _mm256_loadu_ps(v);
+  return cvt8(_mm256_cvtps_pd(_mm256_castps256_ps128(f)),
+              _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1)), q);
+}
+
+
+__attribute__((target("avx2")))
+void quantise8_avx2(unsigned char *out, const double *v, size_t n,
+                    const SampleScale &scale, bool stream) {
+  const ScaleAVX2 q     = scale_avx2(scale);
+  const __m256i   order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Non-temporal stores must be aligned: do the first few samples on their
+  // own
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  size_t i = 0;
+  if (stream) {
+    while (i < n && ((uintptr_t)(out + i) & 31)) {
+      out[i] = (unsigned char)scale.one(v[i]);
+      i++;
+    }
+  }
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i x0 = cvt8(v + i     , q);
+    __m256i x1 = cvt8(v + i +  8, q);
+    __m256i x2 = cvt8(v + i + 16, q);
+    __m256i x3 = cvt8(v + i + 24, q);
+    __m256i b  = _mm256_packus_epi16(_mm256_packs_epi32(x0, x1), _mm256_packs_epi32(x2, x3));
+    b = _mm256_permutevar8x32_epi32(b, order);
+
+    if (stream) {
+      _mm256_stream_si256((__m256i *)(out + i), b);
+    } else {
+      _mm256_storeu_si256((__m256i *)(out + i), b);
+    }
+  }
+
+  if (stream) {
+    _mm_sfence();
+  }
+
+  for (; i < n; i++) {
+    out[i] = (unsigned char)scale.one(v[i]);
+  }
+}
+
+
+
+__attribute__((target("avx2")))
+void quantise8f_avx2(unsigned char *out, const float *v, size_t n,
+                     const SampleScale &scale) {
+  const ScaleAVX2 q     = scale_avx2(scale);
+  const __m256i   order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x0 = cvt8(v + i     , q);
+    __m256i x1 = cvt8(v + i +  8, q);
+    __m256i x2 = cvt8(v + i + 16, q);
+    __m256i x3 = cvt8(v + i + 24, q);
+    __m256i b  = _mm256_packus_epi16(_mm256_packs_epi32(x0, x1), _mm256_packs_epi32(x2, x3));
+    _mm256_storeu_si256((__m256i *)(out + i), _mm256_permutevar8x32_epi32(b, order));
+  }
+
+  for (; i < n; i++) {
+    out[i] = (unsigned char)scale.one(v[i]);
+  }
+}
+
+#endif // FOIST_X86_DISPATCH
@@ -0,0 +1,655 @@
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Quantise doubles to 8-bit samples, 16-bit big-endian samples, or 8-bit
+// samples a band of rows at a time.  The 8-bit samples can also come from
+// R integers, floats or raw bytes.
+//
+// quantise8() on contiguous doubles uses the fastest kernel this CPU supports
+// (AVX2 in quantise-avx2.cpp, SSE2 or scalar), chosen once at load time.
+//
+// All the SIMD kernels turn values into samples the same way as
+// SampleScale::one() (see quantise.h), 2 (SSE2) or 4 (AVX2) doubles per
+// register:
+//   - scale and offset
+//   - clamp to [lo, hi] with MINPD/MAXPD, which also handle Inf
+//   - replace NaN with the NA sample, using a CMPUNORDPD mask
+//   - truncate to int32 (CVTTPD2DQ, the same as a C cast) and add the bias
+//
+// The SSE2 version of quantise16_be() converts 8 doubles at a time, then
+//   - keeps the low 16 bits of each and packs to 8 x int16
+//   - swaps the bytes in each 16-bit lane to make them big-endian
+// Input is loaded directly when contiguous, or gathered 2 at a time when
+// strided.  Output is stored directly when contiguous, or scattered when
+// interleaving RGB planes.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "quantise.h"
+#include "cpu-features.h"
+
+
+SampleScale::SampleScale(double scale_factor, double round_offset, bool invert,
+                         unsigned int maxval, int na) :
+  scale_factor(scale_factor), round_offset(round_offset),
+  lo(invert ? -(double)maxval - 1 : 0), hi(invert ? -1 : (double)maxval),
+  bias(invert ? (int)maxval + 1 : 0), na(na) {}
+
+
+#if defined(__SSE2__)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A SampleScale in SSE2 registers.  NaN is swapped for 'na - bias' before
+// truncating, so that adding the bias gives 'na'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct ScaleSSE2 {
+  __m128d scale;
+  __m128d offset;
+  __m128d lo;
+  __m128d hi;
+  __m128d na;
+  __m128i bias;
+
+  explicit ScaleSSE2(const SampleScale &s) :
+    scale(_mm_set1_pd(s.scale_factor)), offset(_mm_set1_pd(s.round_offset)),
+    lo(_mm_set1_pd(s.lo)), hi(_mm_set1_pd(s.hi)),
+    na(_mm_set1_pd((double)s.na - s.bias)), bias(_mm_set1_epi32(s.bias)) {}
+
+  // 2 doubles -> 2 x int32 samples (in the low half)
+  __m128i cvt2(__m128d d) const {
+    __m128d y   = _mm_add_pd(_mm_mul_pd(d, scale), offset);
+    __m128d nan = _mm_cmpunord_pd(y, y);
+    y = _mm_min_pd(_mm_max_pd(y, lo), hi);   // MAXPD gives 'lo' for NaN
+    y = _mm_or_pd(_mm_and_pd(nan, na), _mm_andnot_pd(nan, y));
+    return _mm_add_epi32(_mm_cvttpd_epi32(y), bias);
+  }
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// 4 doubles -> 4 x int32 with only the low 16 bits kept (sign extended, so
+// that the saturating pack that follows doesn't change them)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline __m128i cvt4_low16(__m128d a, __m128d b, const ScaleSSE2 &q) {
+  __m128i x = _mm_unpacklo_epi64(q.cvt2(a), q.cvt2(b));
+  return _mm_srai_epi32(_mm_slli_epi32(x, 16), 16);
+}
+#endif
+
+
+void quantise16_be(unsigned char *out, size_t ostep,
+                   const double *v, size_t vstride, size_t n,
+                   const SampleScale &scale) {
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const ScaleSSE2 q(scale);
+
+  for (; i + 8 <= n; i += 8) {
+    __m128d d0, d1, d2, d3;
+    if (vstride == 1) {
+      d0 = _mm_loadu_pd(v    );
+      d1 = _mm_loadu_pd(v + 2);
+      d2 = _mm_loadu_pd(v + 4);
+      d3 = _mm_loadu_pd(v + 6);
+    } else {
+      d0 = _mm_set_pd(v[1 * vstride], v[0 * vstride]);
+      d1 = _mm_set_pd(v[3 * vstride], v[2 * vstride]);
+      d2 = _mm_set_pd(v[5 * vstride], v[4 * vstride]);
+      d3 = _mm_set_pd(v[7 * vstride], v[6 * vstride]);
+    }
+    v += 8 * vstride;
+
+    __m128i w = _mm_packs_epi32(cvt4_low16(d0, d1, q), cvt4_low16(d2, d3, q));
+    w = _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8));
+
+    if (ostep == 2) {
+      _mm_storeu_si128((__m128i *)out, w);
+      out += 16;
+    } else {
+      uint16_t tmp[8];
+      _mm_storeu_si128((__m128i *)tmp, w);
+      for (int k = 0; k < 8; k++) {
+        memcpy(out, &tmp[k], 2);
+        out += ostep;
+      }
+    }
+  }
+#endif
+
+  for (; i < n; i++) {
+    int32_t x = scale.one(*v);
+    out[0] = (x >> 8) & 0xFF;
+    out[1] = (x     ) & 0xFF;
+    out += ostep;
+    v   += vstride;
+  }
+}
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Where 8-bit samples come from.  Each has
+//
+//   one(x)              a single sample
+//   load16(v)           16 contiguous samples (SSE2)
+//   gather16(v, stride) 16 samples 'vstride' apart (SSE2)
+//
+// ScaledSamples<> scales and truncates doubles, R integers/logicals or
+// floats.  Integers and floats are converted to double first, with NA
+// (INT_MIN) becoming NaN, so they give exactly the samples that the
+// coerced doubles would.
+//
+// LookupSamples looks raw bytes up in a ByteTable.
+//
+// The kernels below are templated on these, so doubles, integers, floats
+// and raw bytes share the same strided, interleaved and row-major loops.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline double sample(double x) { return x; }
+static inline double sample(int    x) { return int_sample(x); }
+static inline double sample(float  x) { return x; }
+
+#if defined(__SSE2__)
+static inline __m128d load2(const double *v) {
+  return _mm_loadu_pd(v);
+}
+
+static inline __m128d load2(const int *v) {
+  const __m128i x  = _mm_loadl_epi64((const __m128i *)v);
+  const __m128i na = _mm_cmpeq_epi32(x, _mm_set1_epi32(INT_MIN));
+  // All bits set is a NaN
+  return _mm_or_pd(_mm_cvtepi32_pd(x), _mm_castsi128_pd(_mm_unpacklo_epi32(na, na)));
+}
+
+static inline __m128d load2(const float *v) {
+  return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)v)));
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A SampleScale in SSE2 registers, for 8-bit samples.  Rather than clamping
+// every pair of doubles (as ScaleSSE2 does), the clamp is done once for 16
+// packed samples:
+//
+//   - each scaled value is only bounded to +-16384 (which keeps NaN as NaN),
+//     so after truncating, NaN is the only value which packs to -32768
+//   - the bias is a saturating 16-bit add, the unsigned byte pack clamps
+//     at 0, and a byte min clamps at 'maxval'
+//   - NaN lanes are then swapped for 'na'
+//
+// This gives exactly SampleScale::one(), as the ends of the scale are whole
+// numbers well inside +-16384.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct Scale8SSE2 {
+  __m128d scale;
+  __m128d offset;
+  __m128d big;
+  __m128d nbig;
+  __m128i bias;
+  __m128i nan;
+  __m128i maxval;
+  __m128i na;
+
+  explicit Scale8SSE2(const SampleScale &s) :
+    scale(_mm_set1_pd(s.scale_factor)), offset(_mm_set1_pd(s.round_offset)),
+    big(_mm_set1_pd(16384)), nbig(_mm_set1_pd(-16384)),
+    bias(_mm_set1_epi16((short)s.bias)), nan(_mm_set1_epi16(SHRT_MIN)),
+    maxval(_mm_set1_epi8((char)((int)s.hi + s.bias))), na(_mm_set1_epi8((char)s.na)) {}
+
+  // 2 doubles -> 2 x int32 in [-16384, 16384], or INT_MIN for NaN (in the
+  // low half).  MAXPD and MINPD return their second operand for NaN
+  __m128i cvt2(__m128d d) const {
+    __m128d y = _mm_add_pd(_mm_mul_pd(d, scale), offset);
+    return _mm_cvttpd_epi32(_mm_min_pd(big, _mm_max_pd(nbig, y)));
+  }
+
+  // 4 x 4 int32 from cvt2() -> 16 samples
+  __m128i bytes(const __m128i *x) const {
+    __m128i w0 = _mm_packs_epi32(x[0], x[1]);
+    __m128i w1 = _mm_packs_epi32(x[2], x[3]);
+    __m128i m  = _mm_packs_epi16(_mm_cmpeq_epi16(w0, nan), _mm_cmpeq_epi16(w1, nan));
+    __m128i b  = _mm_packus_epi16(_mm_adds_epi16(w0, bias), _mm_adds_epi16(w1, bias));
+    b = _mm_min_epu8(b, maxval);
+    return _mm_or_si128(_mm_and_si128(m, na), _mm_andnot_si128(m, b));
+  }
+};
+
+
+// 16 pairs of values -> 16 bytes
+static inline __m128i cvt16_bytes(const __m128d *d, const Scale8SSE2 &q) {
+  __m128i x[4];
+  for (int i = 0; i < 4; i++) {
+    x[i] = _mm_unpacklo_epi64(q.cvt2(d[2 * i]), q.cvt2(d[2 * i + 1]));
+  }
+  return q.bytes(x);
+}
+
+// 16 contiguous doubles -> 16 bytes
+static inline __m128i cvt16_bytes(const double *v, const Scale8SSE2 &q) {
+  __m128i x[4];
+  for (int i = 0; i < 4; i++) {
+    x[i] = _mm_unpacklo_epi64(q.cvt2(_mm_loadu_pd(v + 4 * i)), q.cvt2(_mm_loadu_pd(v + 4 * i + 2)));
+  }
+  return q.bytes(x);
+}
+#endif
+
+
+template <class T>
+struct ScaledSamples {
+  typedef T type;
+
+  const SampleScale &scale;
+#if defined(__SSE2__)
+  Scale8SSE2 q;
+#endif
+
+  explicit ScaledSamples(const SampleScale &scale) :
+#if defined(__SSE2__)
+    scale(scale), q(scale) {}
+#else
+    scale(scale) {}
+#endif
+
+  unsigned char one(T x) const {
+    return (unsigned char)scale.one(sample(x));
+  }
+
+#if defined(__SSE2__)
+  __m128i load16(const T *v) const {
+    __m128d d[8];
+    for (int i = 0; i < 8; i++) {
+      d[i] = load2(v + 2 * i);
+    }
+    return cvt16_bytes(d, q);
+  }
+
+  __m128i gather16(const T *v, size_t vstride) const {
+    __m128d d[8];
+    for (int i = 0; i < 8; i++) {
+      d[i] = _mm_set_pd(sample(v[(2 * i + 1) * vstride]), sample(v[2 * i * vstride]));
+    }
+    return cvt16_bytes(d, q);
+  }
+#endif
+};
+
+
+struct LookupSamples {
+  typedef unsigned char type;
+
+  const ByteTable &table;
+
+  unsigned char one(unsigned char x) const {
+    return table.sample[x];
+  }
+
+#if defined(__SSE2__)
+  __m128i load16(const unsigned char *v) const {
+    if (table.identity) {
+      return _mm_loadu_si128((const __m128i *)v);
+    }
+    unsigned char tmp[16];
+    for (int i = 0; i < 16; i++) {
+      tmp[i] = table.sample[v[i]];
+    }
+    return _mm_loadu_si128((const __m128i *)tmp);
+  }
+
+  __m128i gather16(const unsigned char *v, size_t vstride) const {
+    unsigned char tmp[16];
+    for (int i = 0; i < 16; i++) {
+      tmp[i] = table.sample[v[i * vstride]];
+    }
+    return _mm_loadu_si128((const __m128i *)tmp);
+  }
+#endif
+};
+
+
+#if defined(__SSE2__)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Transpose a 16 x 16 tile of bytes in place: on entry t[j] is column j,
+// on exit t[k] is row k.  Four rounds of interleaving t[i] with t[i + 8]
+// move each byte to its transposed position.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline void transpose16x16(__m128i *t) {
+  __m128i u[16];
+  for (int round = 0; round < 4; round++) {
+    for (int i = 0; i < 8; i++) {
+      u[2 * i    ] = _mm_unpacklo_epi8(t[i], t[i + 8]);
+      u[2 * i + 1] = _mm_unpackhi_epi8(t[i], t[i + 8]);
+    }
+    for (int i = 0; i < 16; i++) {
+      t[i] = u[i];
+    }
+  }
+}
+#endif
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Contiguous doubles to contiguous 8-bit samples.  'stream' writes with
+// non-temporal stores, which go straight to memory rather than through the
+// cache (the scalar kernel ignores it).
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void quantise8_scalar(unsigned char *out, const double *v, size_t n,
+                      const SampleScale &scale, bool) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    out[i    ] = (unsigned char)scale.one(v[i    ]);
+    out[i + 1] = (unsigned char)scale.one(v[i + 1]);
+    out[i + 2] = (unsigned char)scale.one(v[i + 2]);
+    out[i + 3] = (unsigned char)scale.one(v[i + 3]);
+
+    out[i + 4] = (unsigned char)scale.one(v[i + 4]);
+    out[i + 5] = (unsigned char)scale.one(v[i + 5]);
+    out[i + 6] = (unsigned char)scale.one(v[i + 6]);
+    out[i + 7] = (unsigned char)scale.one(v[i + 7]);
+  }
+  for (; i < n; i++) {
+    out[i] = (unsigned char)scale.one(v[i]);
+  }
+}
+
+
+#if defined(__SSE2__)
+void quantise8_sse2(unsigned char *out, const double *v, size_t n,
+                    const SampleScale &scale, bool stream) {
+  const ScaledSamples<double> q(scale);
+
+  // Non-temporal stores must be aligned: do the first few samples on their own
+  size_t i = 0;
+  if (stream) {
+    while (i < n && ((uintptr_t)(out + i) & 15)) {
+      out[i] = q.one(v[i]);
+      i++;
+    }
+  }
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i b = q.load16(v + i);
+    if (stream) {
+      _mm_stream_si128((__m128i *)(out + i), b);
+    } else {
+      _mm_storeu_si128((__m128i *)(out + i), b);
+    }
+  }
+
+  if (stream) {
+    _mm_sfence();
+  }
+
+  quantise8_scalar(out + i, v + i, n - i, scale, false);
+}
+#endif
+
+
+typedef void (*quantise8_func)(unsigned char *out, const double *v, size_t n,
+                               const SampleScale &scale, bool stream);
+
+static quantise8_func quantise8_select() {
+#ifdef FOIST_X86_DISPATCH
+  if (cpu_features().avx2) {
+    return quantise8_avx2;
+  }
+#endif
+#if defined(__SSE2__)
+  return quantise8_sse2;
+#else
+  return quantise8_scalar;
+#endif
+}
+
+static const quantise8_func quantise8_impl = quantise8_select();
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Strided input (along an R row) and/or interleaved output (RGB planes)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template <class Samples>
+static void quantise8_strided(unsigned char *out, size_t ostep,
+                              const typename Samples::type *v, size_t vstride, size_t n,
+                              const Samples &q) {
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 16 <= n; i += 16) {
+    __m128i b = vstride == 1 ? q.load16(v + i) : q.gather16(v + i * vstride, vstride);
+    if (ostep == 1) {
+      _mm_storeu_si128((__m128i *)(out + i), b);
+    } else {
+      unsigned char tmp[16];
+      _mm_storeu_si128((__m128i *)tmp, b);
+      for (int k = 0; k < 16; k++) {
+        out[(i + k) * ostep] = tmp[k];
+      }
+    }
+  }
+#endif
+
+  for (; i < n; i++) {
+    out[i * ostep] = q.one(v[i * vstride]);
+  }
+}
+
+
+void quantise8(unsigned char *out, size_t ostep,
+               const double *v, size_t vstride, size_t n,
+               const SampleScale &scale) {
+  if (ostep == 1 && vstride == 1) {
+    quantise8_impl(out, v, n, scale, false);
+    return;
+  }
+  quantise8_strided(out, ostep, v, vstride, n, ScaledSamples<double>(scale));
+}
+
+
+void quantise8(unsigned char *out, size_t ostep,
+               const int *v, size_t vstride, size_t n,
+               const SampleScale &scale) {
+  quantise8_strided(out, ostep, v, vstride, n, ScaledSamples<int>(scale));
+}
+
+
+void quantise8(unsigned char *out, size_t ostep,
+               const float *v, size_t vstride, size_t n,
+               const SampleScale &scale) {
+#ifdef FOIST_X86_DISPATCH
+  if (ostep == 1 && vstride == 1 && cpu_features().avx2) {
+    quantise8f_avx2(out, v, n, scale);
+    return;
+  }
+#endif
+  quantise8_strided(out, ostep, v, vstride, n, ScaledSamples<float>(scale));
+}
+
+
+void quantise8(unsigned char *out, size_t ostep,
+               const unsigned char *v, size_t vstride, size_t n,
+               const ByteTable &table) {
+  if (table.identity && ostep == 1 && vstride == 1) {
+    memcpy(out, v, n);
+    return;
+  }
+  LookupSamples q = { table };
+  quantise8_strided(out, ostep, v, vstride, n, q);
+}
+
+
+void quantise8_stream(unsigned char *out, const double *v, size_t n,
+                      const SampleScale &scale) {
+  quantise8_impl(out, v, n, scale, true);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Raw bytes can only take 256 values, so quantise each of them once
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ByteTable::ByteTable(const SampleScale &scale) {
+  double v[256];
+  for (int i = 0; i < 256; i++) {
+    v[i] = i;
+  }
+  quantise8(sample, 1, v, 1, 256, scale);
+
+  identity = true;
+  for (int i = 0; i < 256; i++) {
+    identity = identity && sample[i] == i;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Columns [c0, c1) of rows [k0, k1) one column at a time, scattered down
+// the rows
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template <class Samples>
+static void quantise8_columns(unsigned char *out, ptrdiff_t ostride, size_t ostep,
+                              const typename Samples::type *v, size_t vstride,
+                              size_t k0, size_t k1, size_t c0, size_t c1,
+                              const Samples &q) {
+  for (size_t c = c0; c < c1; c++) {
+    const typename Samples::type *vc = v + c * vstride;
+    unsigned char                *oc = out + c * ostep;
+    size_t k = k0;
+
+#if defined(__SSE2__)
+    for (; k + 16 <= k1; k += 16) {
+      unsigned char tmp[16];
+      _mm_storeu_si128((__m128i *)tmp, q.load16(vc + k));
+      for (int i = 0; i < 16; i++) {
+        oc[(ptrdiff_t)(k + i) * ostride] = tmp[i];
+      }
+    }
+#endif
+
+    for (; k < k1; k++) {
+      oc[(ptrdiff_t)k * ostride] = q.one(vc[k]);
+    }
+  }
+}
+
+
+#if defined(__SSE2__)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Transpose a tile of 16 quantised columns and store it as 16 rows.  Grey
+// rows are stored whole; interleaved samples are still written along the
+// row.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline void store_tile(unsigned char *out, ptrdiff_t ostride, size_t ostep,
+                              __m128i *t) {
+  transpose16x16(t);
+  for (int k = 0; k < 16; k++) {
+    unsigned char *o = out + (ptrdiff_t)k * ostride;
+    if (ostep == 1) {
+      _mm_storeu_si128((__m128i *)o, t[k]);
+    } else {
+      unsigned char tmp[16];
+      _mm_storeu_si128((__m128i *)tmp, t[k]);
+      for (int i = 0; i < 16; i++) {
+        o[i * ostep] = tmp[i];
+      }
+    }
+  }
+}
+#endif
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Tiles of 16 rows x 16 columns: quantise the 16 columns, transpose, and
+// store 16 rows.  All the tiles down the band are done before moving on to
+// the next 16 columns, so each column is read in one go.  Everything else
+// (the rows below the tiles, and the columns to their right) is done a
+// column at a time.
+//
+// 'q' is a copy: 'out' is an unsigned char pointer, which may alias
+// anything, so constants reached through a reference would be reloaded
+// from memory after every store.
+//
+// Integers, floats and raw bytes use this.  Doubles, the common case,
+// have their own copy of the tile loop in quantise8_rows().
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template <class Samples>
+static void quantise8_band(unsigned char *out, ptrdiff_t ostride, size_t ostep,
+                           const typename Samples::type *v, size_t vstride, size_t n, size_t ncol,
+                           const Samples q) {
+  size_t ntile = 0;  // rows [0, ntile) of columns [0, ctile) are done in tiles
+  size_t ctile = 0;
+
+#if defined(__SSE2__)
+  ntile = n & ~(size_t)15;
+  if (ntile > 0) {
+    for (; ctile + 16 <= ncol; ctile += 16) {
+      for (size_t r = 0; r < ntile; r += 16) {
+        __m128i t[16];
+        for (int j = 0; j < 16; j++) {
+          t[j] = q.load16(v + (ctile + j) * vstride + r);
+        }
+        store_tile(out + (ptrdiff_t)r * ostride + ctile * ostep, ostride, ostep, t);
+      }
+    }
+  }
+#endif
+
+  quantise8_columns(out, ostride, ostep, v, vstride, ntile, n, 0, ctile, q);
+  quantise8_columns(out, ostride, ostep, v, vstride, 0, n, ctile, ncol, q);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// quantise8_band() for doubles.  The 16 doubles of each tile column are
+// loaded and converted directly, with the scale in local registers.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void quantise8_rows(unsigned char *out, ptrdiff_t ostride, size_t ostep,
+                    const double *v, size_t vstride, size_t n, size_t ncol,
+                    const SampleScale &scale) {
+  size_t ntile = 0;
+  size_t ctile = 0;
+
+#if defined(__SSE2__)
+  const Scale8SSE2 q(scale);
+
+  ntile = n & ~(size_t)15;
+  if (ntile > 0) {
+    for (; ctile + 16 <= ncol; ctile += 16) {
+      for (size_t r = 0; r < ntile; r += 16) {
+        __m128i t[16];
+        for (int j = 0; j < 16; j++) {
+          t[j] = cvt16_bytes(v + (ctile + j) * vstride + r, q);
+        }
+        store_tile(out + (ptrdiff_t)r * ostride + ctile * ostep, ostride, ostep, t);
+      }
+    }
+  }
+#endif
+
+  const ScaledSamples<double> qs(scale);
+  quantise8_columns(out, ostride, ostep, v, vstride, ntile, n, 0, ctile, qs);
+  quantise8_columns(out, ostride, ostep, v, vstride, 0, n, ctile, ncol, qs);
+}
+
+
+void quantise8_rows(unsigned char *out, ptrdiff_t ostride, size_t ostep,
+                    const int *v, size_t vstride, size_t n, size_t ncol,
+                    const SampleScale &scale) {
+  quantise8_band(out, ostride, ostep, v, vstride, n, ncol, ScaledSamples<int>(scale));
+}
+
+
+void quantise8_rows(unsigned char *out, ptrdiff_t ostride, size_t ostep,
+                    const float *v, size_t vstride, size_t n, size_t ncol,
+                    const SampleScale &scale) {
+  quantise8_band(out, ostride, ostep, v, vstride, n, ncol, ScaledSamples<float>(scale));
+}
+
+
+void quantise8_rows(unsigned char *out, ptrdiff_t ostride, size_t ostep,
+                    const unsigned char *v, size_t vstride, size_t n, size_t ncol,
+                    const ByteTable &table) {
+  LookupSamples q = { table };
+  quantise8_band(out, ostride, ostep, v, vstride, n, ncol, q);
+}
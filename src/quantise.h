@@ -0,0 +1,186 @@
+#ifndef FOIST_QUANTISE_H
+#define FOIST_QUANTISE_H
+
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// How values become samples
+//
+//   y      = v * scale_factor + round_offset, clamped to [lo, hi]
+//   sample = (int)y + bias, or 'na' if y is NaN (NA, or NaN in the data)
+//
+// Every value gives a defined sample: anything past the ends of the scale
+// (including Inf) saturates to the first or last sample, rather than
+// wrapping around as the old '(unsigned char)' cast did, so data doesn't
+// have to be cleaned with pmin()/pmax()/is.na() in R first.  In the SIMD
+// kernels this is a min, a max and a NaN blend per register, with no
+// branches.
+//
+// 'maxval'  is the largest sample: 255, 65535, or the number of palette
+//           colours less one.
+// 'invert'  is written with a negative scale factor and round_offset = -1.5
+//           so that values in [0, 1] truncate to [-(maxval + 1), -1];
+//           'bias' = maxval + 1 then brings them back to [0, maxval].  For
+//           255 and 65535 this is the same as keeping the low 8 or 16 bits.
+// 'na'      is the sample for NA and NaN (a grey level, or palette index).
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct SampleScale {
+  double scale_factor;
+  double round_offset;
+  double lo;
+  double hi;
+  int    bias;
+  int    na;
+
+  SampleScale(double scale_factor, double round_offset, bool invert,
+              unsigned int maxval, int na);
+
+  int one(double x) const {
+    double y = x * scale_factor + round_offset;
+    const bool nan = y != y;
+    y = y > lo ? y : lo;
+    y = y < hi ? y : hi;
+    return nan ? na : (int)y + bias;
+  }
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Quantise doubles to 8-bit samples
+//
+//   sample[i] = scale.one(v[i * vstride])
+//
+// 'vstride' is the distance between input values: 1 when walking along an
+//           R column, 'nrow' when walking along an R row.
+// 'ostep'   is the distance in bytes between output samples: 1 for grey,
+//           3 when interleaving R, G and B planes.
+//
+// Contiguous data (ostep = vstride = 1) uses the fastest kernel this CPU
+// supports (AVX2, SSE2 or scalar), chosen once at load time.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void quantise8(unsigned char *out, size_t ostep,
+               const double *v, size_t vstride, size_t n,
+               const SampleScale &scale);
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// quantise8() of R integers or logicals, read in place.  Each is quantised
+// exactly as if it had been coerced to a double first (int_sample()),
+// including NA (INT_MIN) as NaN.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void quantise8(unsigned char *out, size_t ostep,
+               const int *v, size_t vstride, size_t n,
+               const SampleScale &scale);
+
+static inline double int_sample(int x) {
+  return x == INT_MIN ? NAN : (double)x;
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// quantise8() of single precision floats (the 'float' package's float32
+// storage), read in place.  Each float is widened to a double (which is
+// exact) and then scaled just like the doubles, so the samples are the
+// same as for 'as.numeric()' of the data, but only half as many bytes are
+// read.  Contiguous floats are loaded 8 at a time with AVX2.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void quantise8(unsigned char *out, size_t ostep,
+               const float *v, size_t vstride, size_t n,
+               const SampleScale &scale);
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Raw bytes only have 256 possible values, so each is quantised once (as a
+// double) into a table, and the samples are looked up.  When every byte
+// maps to itself (e.g. 'intensity_factor = 1/255') contiguous bytes are
+// just copied.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct ByteTable {
+  unsigned char sample[256];
+  bool          identity;
+
+  ByteTable(const SampleScale &scale);
+};
+
+void quantise8(unsigned char *out, size_t ostep,
+               const unsigned char *v, size_t vstride, size_t n,
+               const ByteTable &table);
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// quantise8() of contiguous data, written with non-temporal stores.  For
+// large output which won't be read again soon (an image being written
+// straight into a memory-mapped file or raw vector): it doesn't push the
+// input out of the cache, and doesn't read each output cache line before
+// overwriting it.  Worth it above QUANTISE_STREAM_BYTES.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define QUANTISE_STREAM_BYTES (4 << 20)
+
+void quantise8_stream(unsigned char *out, const double *v, size_t n,
+                      const SampleScale &scale);
+
+// Individual contiguous kernels.  quantise8_avx2() must only be called if
+// cpu_features() says AVX2 is available
+void quantise8_scalar(unsigned char *out, const double *v, size_t n,
+                      const SampleScale &scale, bool stream);
+void quantise8_sse2  (unsigned char *out, const double *v, size_t n,
+                      const SampleScale &scale, bool stream);
+void quantise8_avx2  (unsigned char *out, const double *v, size_t n,
+                      const SampleScale &scale, bool stream);
+void quantise8f_avx2 (unsigned char *out, const float *v, size_t n,
+                      const SampleScale &scale);
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Quantise doubles to 16-bit big-endian samples (the byte order used by both
+// PNG and PNM) and write them straight into the output buffer.
+//
+//   sample[i] = scale.one(v[i * vstride])
+//
+// with 'maxval' = 65535.
+//
+// 'vstride' is the distance between input values: 1 when walking along an
+//           R column, 'nrow' when walking along an R row.
+// 'ostep'   is the distance in bytes between output samples: 2 for grey,
+//           6 when interleaving R, G and B planes.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void quantise16_be(unsigned char *out, size_t ostep,
+                   const double *v, size_t vstride, size_t n,
+                   const SampleScale &scale);
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Quantise a band of 'n' rows of an R matrix to 8-bit samples, reading down
+// R's columns rather than along its rows.  For rows k < n and columns
+// c < ncol:
+//
+//   out[k * ostride + c * ostep] = scale.one(v[k + c * vstride])
+//
+// 'v'       points at the first row of the band in the first column.
+// 'vstride' is the distance between R columns, i.e. 'nrow'.
+// 'ostride' is the distance in bytes between output rows.  It is negative
+//           to write the band bottom-up (for 'flipy').
+// 'ostep'   is the distance in bytes between output samples: 1 for grey,
+//           3 when interleaving R, G and B planes.
+//
+// Converting to row-major order a row at a time touches a new cache line
+// (and usually a new page) for every pixel.  A band of QUANTISE_BAND_ROWS
+// rows reads 512 contiguous bytes from each column instead.  With SSE2 the
+// band is done in 16 x 16 tiles which are transposed in registers.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define QUANTISE_BAND_ROWS 64
+
+void quantise8_rows(unsigned char *out, ptrdiff_t ostride, size_t ostep,
+                    const double *v, size_t vstride, size_t n, size_t ncol,
+                    const SampleScale &scale);
+
+// The same for R integers, floats and raw bytes, as for quantise8()
+void quantise8_rows(unsigned char *out, ptrdiff_t ostride, size_t ostep,
+                    const int *v, size_t vstride, size_t n, size_t ncol,
+                    const SampleScale &scale);
+void quantise8_rows(unsigned char *out, ptrdiff_t ostride, size_t ostep,
+                    const float *v, size_t vstride, size_t n, size_t ncol,
+                    const SampleScale &scale);
+void quantise8_rows(unsigned char *out, ptrdiff_t ostride, size_t ostep,
+                    const unsigned char *v, size_t vstride, size_t n, size_t ncol,
+                    const ByteTable &table);
+
+#endif
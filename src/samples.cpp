@@ -0,0 +1,139 @@
+#include <algorithm>
+#include "Rcpp.h"
+
+using namespace Rcpp;
+
+#include "samples.h"
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A 'float32' object from the 'float' package is an S4 object with the
+// floats' bits stored in an integer vector in its 'Data' slot (which also
+// carries the 'dim')
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static bool is_float32(SEXP vec) {
+  return TYPEOF(vec) == S4SXP && Rf_inherits(vec, "float32");
+}
+
+static SEXP float32_data(SEXP vec) {
+  SEXP data = R_do_slot(vec, Rf_install("Data"));
+  if (TYPEOF(data) != INTSXP) {
+    stop("foist: 'float32' data must be stored in an integer vector");
+  }
+  return data;
+}
+
+static const float *float32_values(SEXP vec) {
+  return (const float *)INTEGER(float32_data(vec));
+}
+
+
+bool is_pixel_samples(SEXP vec) {
+  switch (TYPEOF(vec)) {
+  case REALSXP:
+  case INTSXP:
+  case LGLSXP:
+  case RAWSXP:
+    return true;
+  default:
+    return is_float32(vec);
+  }
+}
+
+
+RObject pixel_samples(SEXP vec) {
+  if (is_pixel_samples(vec)) {
+    return vec;
+  }
+  return NumericVector(vec);
+}
+
+
+SEXP sample_vector(SEXP vec) {
+  return is_float32(vec) ? float32_data(vec) : vec;
+}
+
+
+NumericVector numeric_samples(SEXP vec) {
+  if (!is_float32(vec)) {
+    return NumericVector(vec);
+  }
+
+  SEXP data = float32_data(vec);
+  const R_xlen_t n = XLENGTH(data);
+  const float   *v = (const float *)INTEGER(data);
+
+  NumericVector dvec(no_init(n));
+  std::copy(v, v + n, dvec.begin());
+  return dvec;
+}
+
+
+PixelData pixel_data(SEXP vec, unsigned int nrow, unsigned int ncol,
+                     const SampleScale &scale) {
+  PixelData data = { NULL, SAMPLE_DOUBLE, nrow, ncol, scale };
+
+  switch (TYPEOF(vec)) {
+  case INTSXP:
+    data.v0   = INTEGER(vec);
+    data.type = SAMPLE_INT;
+    break;
+  case LGLSXP:
+    data.v0   = LOGICAL(vec);
+    data.type = SAMPLE_INT;
+    break;
+  case RAWSXP:
+    data.v0   = RAW(vec);
+    data.type = SAMPLE_RAW;
+    break;
+  case S4SXP:
+    data.v0   = float32_values(vec);
+    data.type = SAMPLE_FLOAT;
+    break;
+  default:
+    data.v0   = REAL(vec);
+    break;
+  }
+
+  return data;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// std::max_element() over doubles only returns NaN if it is the first
+// value (NaN is never greater than anything, and nothing is greater than
+// it), so an integer NA counts only if it is first.  Floats compare the
+// same way as the doubles they widen to.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+double max_sample(SEXP vec) {
+  if (is_float32(vec)) {
+    SEXP data = float32_data(vec);
+    const R_xlen_t n = XLENGTH(data);
+    const float   *v = (const float *)INTEGER(data);
+    return n == 0 ? 0 : *std::max_element(v, v + n);
+  }
+
+  const R_xlen_t n = XLENGTH(vec);
+  if (n == 0) {
+    return 0;
+  }
+
+  switch (TYPEOF(vec)) {
+  case INTSXP:
+  case LGLSXP: {
+    const int *v = TYPEOF(vec) == INTSXP ? INTEGER(vec) : LOGICAL(vec);
+    if (v[0] == NA_INTEGER) {
+      return NA_REAL;
+    }
+    int max_value = v[0];
+    for (R_xlen_t i = 1; i < n; i++) {
+      max_value = std::max(max_value, v[i]);   // NA is the smallest int
+    }
+    return max_value;
+  }
+  case RAWSXP:
+    return *std::max_element(RAW(vec), RAW(vec) + n);
+  default:
+    return *std::max_element(REAL(vec), REAL(vec) + n);
+  }
+}
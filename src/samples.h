@@ -0,0 +1,45 @@
+#ifndef FOIST_SAMPLES_H
+#define FOIST_SAMPLES_H
+
+#include "Rcpp.h"
+#include "pixels.h"
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Image data from R, as samples for the 8-bit pixel pipeline (pixels.h)
+//
+// Numeric, integer, logical and raw vectors are read where they are, so an
+// integer matrix of labels or a raw vector of bytes is never copied into a
+// double vector 8 (or 4) times the size.  Integers and raw bytes give the
+// same pixels as the doubles they would be coerced to.
+//
+// So are 'float32' objects from the 'float' package, whose single
+// precision values are kept in the integer vector in their 'Data' slot.
+// They give the same pixels as 'as.numeric()' of the data.
+//
+// Anything else (and any output which still needs doubles: 16-bit samples,
+// alpha, packed palette indices) goes through numeric_samples().
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+// Can the pixel pipeline read this vector in place?
+bool is_pixel_samples(SEXP vec);
+
+// 'vec' itself if is_pixel_samples(), otherwise coerced to a numeric vector
+Rcpp::RObject pixel_samples(SEXP vec);
+
+// The vector which holds the samples: the 'Data' slot of a 'float32',
+// otherwise 'vec' itself.  Its length and 'dim' are those of the samples
+SEXP sample_vector(SEXP vec);
+
+// The PixelData for the samples in 'vec', which must be is_pixel_samples()
+PixelData pixel_data(SEXP vec, unsigned int nrow, unsigned int ncol,
+                     const SampleScale &scale);
+
+// The samples as doubles, for the code which only handles doubles.  This is
+// a copy unless 'vec' is already numeric
+Rcpp::NumericVector numeric_samples(SEXP vec);
+
+// The largest value, as the doubles would give it for
+// 'intensity_factor <= 0'.  'vec' must be is_pixel_samples()
+double max_sample(SEXP vec);
+
+#endif
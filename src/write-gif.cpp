@@ -3,8 +3,14 @@
 
 using namespace Rcpp;
 
+#include "quantise.h"
+#include "pixels.h"
+#include "samples.h"
+#include "image-writer.h"
+#include "output.h"
 
-#define BUFFER_ROWS 20
+
+#define BUFFER_ROWS QUANTISE_BAND_ROWS
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Swap endianness for a 32bit unsigned int
@@ -34,7 +40,7 @@ using namespace Rcpp;
 //
 //  - Write GIF header
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_gif_header(std::ofstream &outfile, const unsigned int ncol, const unsigned int nrow) {
+void write_gif_header(std::ostream &outfile, const unsigned int ncol, const unsigned int nrow) {
   char GIF_header[10] = {
     0x47, 0x49, 0x46,  // "GIF89a
     0x38, 0x39, 0x61,
@@ -65,7 +71,7 @@ void write_gif_header(std::ofstream &outfile, const unsigned int ncol, const uns
 //
 //
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_global_colour_table(std::ofstream &outfile, Rcpp::IntegerMatrix pal) {
+void write_global_colour_table(std::ostream &outfile, Rcpp::IntegerMatrix pal) {
 
 
     const unsigned int nrow = pal.nrow();
@@ -124,7 +130,7 @@ void write_global_colour_table(std::ofstream &outfile, Rcpp::IntegerMatrix pal)
 //
 // - Write IEND chunk
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_gif_terminator(std::ofstream &outfile) {
+void write_gif_terminator(std::ostream &outfile) {
   unsigned char GIF_terminator[1] = { 0x3B };
 
   outfile.write((const char *)&GIF_terminator[0], 1);
@@ -146,22 +152,15 @@ void write_gif_terminator(std::ofstream &outfile) {
 //                                  `Y8P'
 //
 //
-// - Write GREY data
+// - Write the image descriptor which comes before the image data
+// - Write GREY data. Every row is self-contained, so rows can be written
+//   a few at a time
+// - Write the End-of-Data marker
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_gif_data(std::ofstream &outfile,
-                    const NumericVector vec,
-                    const unsigned int ncol,
-                    const unsigned int nrow,
-                    const double scale_factor,
-                    const double round_offset,
-                    const bool convert_to_row_major,
-                    const bool flipy) {
+void write_gif_image_descriptor(std::ostream &outfile,
+                                const unsigned int ncol,
+                                const unsigned int nrow) {
 
-
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Image descriptor header
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   unsigned char image_descriptor[11] = {
     0x2c,
     0x00, 0x00, 0x00, 0x00,  // NW corner position of image
@@ -177,165 +176,139 @@ void write_gif_data(std::ofstream &outfile,
   image_descriptor[8] = nrow >> 8 & 0xFF;
 
   outfile.write((char *)image_descriptor, sizeof(unsigned char) * 11);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write the image data from any 1 plane pixel source (see pixels.h)
+//
+// Because we're writing an uncompressed GIF, need to do extra work to
+// write a CLEAR instruction no further apart than every 2^n-1 bytes.  Since
+// our colour depth is n=7, every 126 bytes(at most) must be interupted by a
+// 'CLEAR' byte (value = 2^n = 2^7 = 128 = 0x80)
+//
+// See https://en.wikipedia.org/wiki/GIF section on 'Uncompressed GIF'
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template <class Pix>
+void write_gif_pixels(std::ostream &outfile, const Pix &px) {
+
+  const unsigned int ncol = px.ncol;
+  const unsigned int nrow = px.nrow;
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Set up buffer to write only BUFFER_ROWS rows a time
-  // Reduces memory usage (by not allocating full size copy of the image)
-  //
-  // However, because we're writing an uncompressed GIF, need to do extra
-  // work to write a CLEAR instruction no further apart than every 2^n-1 bytes.
-  // Since our colour depth is n=7, every 126 bytes(at most) must be interupted
-  // by a 'CLEAR' byte (value = 2^n = 2^7 = 128 = 0x80)
-  //
-  // See https://en.wikipedia.org/wiki/GIF section on 'Uncompressed GIF'
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   const unsigned int chunk_length        = 120;  // How many bytes can be output before a CLEAR code is needed? Max: 128-2
   const unsigned int full_chunks_per_row = ncol/chunk_length;
   const unsigned int leftover_bytes      = ncol % chunk_length;
   const unsigned int leftover_chunks     = leftover_bytes > 0 ? 1 : 0;
   const unsigned int total_chunks        = full_chunks_per_row + leftover_chunks;
-  const unsigned int row_data_length     = ncol + total_chunks * 2; // 2 extra bytes per chunk
-
-  // std::cout << "ncol:             " << ncol                << std::endl;
-  // std::cout << "full chunks/row:  " << full_chunks_per_row << std::endl;
-  // std::cout << "leftover bytes:   " << leftover_bytes      << std::endl;
-  // std::cout << "leftover chunks:  " << leftover_chunks     << std::endl;
-  // std::cout << "total chunks:     " << total_chunks        << std::endl;
-  // std::cout << "raw data length:  " << row_data_length     << std::endl;
-
-
-  const unsigned int buffer_size     =         BUFFER_ROWS  * row_data_length;
-  const unsigned int remainder_size  = (nrow % BUFFER_ROWS) * row_data_length;
-  unsigned char *uc0 = (unsigned char *) calloc(buffer_size, sizeof(unsigned char));
-  if (!uc0) stop("write_pnm_grey_data(): out of memory");
-  unsigned char *uc = uc0;
+  const size_t       row_data_length     = ncol + total_chunks * 2; // 2 extra bytes per chunk
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Get a pointer to the actual data in the supplied vector
+  // Set up buffer to write only BUFFER_ROWS rows a time
+  // Reduces memory usage (by not allocating full size copy of the image)
+  //
+  // If the output is in memory (raw vector or mapped file) with room for
+  // the whole image, the pixels are written straight into it instead.
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  double *v0 = (double *)vec.begin();
+  const size_t buffer_size = (size_t)BUFFER_ROWS * row_data_length;
+  unsigned char *direct = claim_output(outfile, (size_t)nrow * row_data_length);
+  unsigned char *uc0 = direct ? direct : (unsigned char *) calloc(buffer_size, sizeof(unsigned char));
+  if (!uc0) stop("write_gif_pixels(): out of memory");
+  unsigned char *uc = uc0;
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Convert from R's column-major ordering to row-major output order
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (convert_to_row_major) {
-    for (unsigned int row = 0; row < nrow; row++) {
-      unsigned int j = flipy ? nrow - 1 - row : row;
-
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      // Write as many full chunks per row as possible
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      for (unsigned int chunk = 0; chunk < full_chunks_per_row; chunk++) {
-        *uc++ = (unsigned char)(chunk_length + 1);
-        *uc++ = 0x80;  // CLEAR
-        for (unsigned int idx = 0; idx < chunk_length; idx++) {
-          *uc++ = (unsigned char)(v0[j] * scale_factor + round_offset);
-          j += nrow;
-        }
-      }
-
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      // Write any leftover bytes in their own chunk. Inefficient, but
-      // it's easier to think about each 'row' as a fully contained entity
-      // (and not carry over chunks from one row to the next)
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      if (leftover_bytes > 0) {
-        *uc++ = (unsigned char)(leftover_bytes + 1);
-        *uc++ = 0x80;  // CLEAR
-        for (unsigned int idx = 0; idx < leftover_bytes; idx++) {
-          *uc++ = (unsigned char)(v0[j] * scale_factor + round_offset);
-          j += nrow;
-        }
+  // As many rows at a time as the pixel source likes (a band of rows when
+  // converting to row-major order), one chunk across all of them at a time.
+  //
+  // Each row is as many full chunks as possible, then any leftover bytes in
+  // their own chunk. Inefficient, but it's easier to think about each 'row'
+  // as a fully contained entity (and not carry over chunks from one row to
+  // the next)
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  for (unsigned int row = 0; row < nrow; ) {
+    const unsigned int n = nrow - row < Pix::BAND_ROWS ? nrow - row : Pix::BAND_ROWS;
+
+    for (unsigned int chunk = 0; chunk < total_chunks; chunk++) {
+      const unsigned int length = chunk < full_chunks_per_row ? chunk_length : leftover_bytes;
+      const size_t       start  = (size_t)chunk * (chunk_length + 2);
+      for (unsigned int k = 0; k < n; k++) {
+        uc[k * row_data_length + start    ] = (unsigned char)(length + 1);
+        uc[k * row_data_length + start + 1] = 0x80;  // CLEAR
       }
+      px.fill(uc + start + 2, row_data_length, row, n, chunk * chunk_length, length);
+    }
+    uc  += n * row_data_length;
+    row += n;
 
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      // Flush the buffer to file
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      if ((row + 1) % BUFFER_ROWS == 0) {
-        outfile.write((char *)uc0, sizeof(unsigned char) * buffer_size);
-        uc = uc0;
-      }
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Flush the buffer to file when it's full, or at the end of the image
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    if (!direct && (row % BUFFER_ROWS == 0 || row == nrow)) {
+      outfile.write((char *)uc0, sizeof(unsigned char) * (uc - uc0));
+      uc = uc0;
     }
-  } else {
-    for (unsigned int row = 0; row < nrow; row++) {
-      const unsigned int offset = flipy ? nrow - 1 - row : row;
-      double *v = v0 + ncol * offset;
-
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      // Write as many full chunks per row as possible
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      for (unsigned int chunk = 0; chunk < full_chunks_per_row; chunk++) {
-        *uc++ = (unsigned char)(chunk_length + 1);
-        *uc++ = 0x80;  // CLEAR
-        for (unsigned int idx = 0; idx < 15; idx++) { // chunk_length/8 = 15
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        }
-      }
+  }
 
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      // Write any leftover bytes in their own chunk. Inefficient, but
-      // it's easier to think about each 'row' as a fully contained entity
-      // (and not carry over chunks from one row to the next)
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      if (leftover_bytes > 0) {
-        *uc++ = (unsigned char)(leftover_bytes + 1);
-        *uc++ = 0x80;  // CLEAR
-        unsigned int idx = 0;
-        for (; idx <= leftover_bytes - 8; idx += 8) {
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        }
-
-        for (; idx < leftover_bytes; idx++) {
-          *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        }
-      }
+  if (!direct) {
+    free(uc0);
+  }
+}
 
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      // Flush the buffer to file
-      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-      if ((row + 1) % BUFFER_ROWS == 0) {
-        outfile.write((char *)uc0, sizeof(unsigned char) * buffer_size);
-        uc = uc0;
-      }
-    }
+
+struct GifPixelWriter {
+  std::ostream &outfile;
+
+  template <class Pix>
+  void operator()(const Pix &px) const {
+    write_gif_pixels(outfile, px);
   }
+};
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Flush any remaining data to file
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  outfile.write((char *)uc0, sizeof(unsigned char) * remainder_size);
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Write marker for End-of-Data
-  //   0x01   - a block of length 1
-  //   0x81   - STOP marker = 2^n + 1 = 2^7 + 1 = 129 = 0x81
-  //   0x00   - end of image data
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_gif_data(std::ostream &outfile,
+                    SEXP vec,
+                    const unsigned int ncol,
+                    const unsigned int nrow,
+                    const SampleScale &scale,
+                    const bool convert_to_row_major,
+                    const bool flipy) {
+
+  PixelData data = pixel_data(vec, nrow, ncol, scale);
+  GifPixelWriter writer = { outfile };
+  with_pixels_planes<1>(writer, data, convert_to_row_major, flipy);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write marker for End-of-Data
+//   0x01   - a block of length 1
+//   0x81   - STOP marker = 2^n + 1 = 2^7 + 1 = 129 = 0x81
+//   0x00   - end of image data
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_gif_image_end(std::ostream &outfile) {
   unsigned char image_end[3] = { 0x01, 0x81, 0x00 };
   outfile.write((char *)image_end, sizeof(unsigned char) * 3);
-
-  free(uc0);
 }
 
 
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Exact size in bytes of a GIF written by write_gif_core():
+//   header (10) + global colour table (3 + 128 * 3) + image descriptor (11)
+//   + image data + End-of-Data (3) + terminator (1)
+//
+// Each row of image data is a run of chunks of at most 120 pixels, and every
+// chunk has 2 extra bytes (length and CLEAR code).  See write_gif_pixels()
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t gif_size(const unsigned int ncol, const unsigned int nrow) {
+  const size_t chunks_per_row  = (ncol + 120 - 1) / 120;
+  const size_t row_data_length = ncol + chunks_per_row * 2;
+
+  return 10 + (3 + 128 * 3) + 11 + nrow * row_data_length + 3 + 1;
+}
+
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //' Write a numeric matrix or array to a GIF file
 //'
@@ -350,9 +323,11 @@ void write_gif_data(std::ofstream &outfile,
 //' }
 //'
 //'
-//' @param vec numeric 2d matrix
+//' @param vec numeric, integer, logical, raw or float32 2d matrix
 //' @param dims integer vector of length 2 i.e. \code{c(nrow, ncol)} for a matrix/grey image
-//' @param filename output filename e.g. "example.ppm"
+//' @param filename output filename e.g. "example.gif", an R connection or a
+//'        file descriptor (e.g. 1 for stdout). If NULL, the GIF is returned
+//'        as a raw vector instead.
 //' @param convert_to_row_major Convert to row-major order before output. R stores matrix
 //'        and array data in column-major order. In order to output row-major order (as
 //'        expected by PGM/PPM image format) data ordering must be converted. If this argument
@@ -366,7 +341,7 @@ void write_gif_data(std::ofstream &outfile,
 //'        converted into a negative. Dark areas become bright and bright areas become dark.
 //'        Default: FALSE
 //' @param intensity_factor Multiplication factor applied to all values in image
-//'        (note: no checking is performed to ensure values remain in range [0, 1]).
+//'        (values which end up outside [0, 1] are clamped to the ends of the scale).
 //'        If intensity_factor <= 0, then automatically determine (and apply) a multiplication factor
 //'        to set the maximum value to 1.0. Default: intensity_factor = 1.0
 //' @param pal integer matrix of size 128x3 or 256x3 with values in the range [0, 255]. Each
@@ -374,18 +349,24 @@ void write_gif_data(std::ofstream &outfile,
 //'        GIF writer only supports 128 colours, so a 256x3 palette is reduced
 //'        to 128 colours by selecting every second colour. If supplied with a
 //'        128-colour-palette then it is used as-is.
+//' @param na_value the colour index in [0, 127] written for NA and NaN
+//'        values.  Values outside [0, 1] are always clamped to the ends of
+//'        the scale.  Default: 0
 //'
+//' @return If \code{filename} is NULL, a raw vector containing the GIF.
+//'         Otherwise NULL.
 //'
 //'
 // [[Rcpp::export]]
-void write_gif_core(const NumericVector vec,
+SEXP write_gif_core(SEXP vec,
                     const IntegerVector dims,
-                    const std::string filename,
+                    SEXP filename,
                     const bool convert_to_row_major = true,
                     const bool flipy                = false,
                     const bool invert               = false,
                     const double intensity_factor   = 1,
-                    Rcpp::IntegerMatrix pal = R_NilValue) {
+                    Rcpp::IntegerMatrix pal = R_NilValue,
+                    const int na_value              = 0) {
 
 
   unsigned int nrow = dims[0];
@@ -399,6 +380,17 @@ void write_gif_core(const NumericVector vec,
     stop("write_gif(): 'dims' must be length = 2");
   }
 
+  if (na_value < 0 || na_value > 127) {
+    stop("write_gif(): 'na_value' must be in the range [0, 127]");
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // GIF stores the width and height in 2 bytes each
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (nrow > 65535 || ncol > 65535) {
+    stop("write_gif(): GIF images can not be wider or taller than 65535 pixels");
+  }
+
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // If writing in column-major, swap 'nrow' and 'ncol'
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -409,10 +401,15 @@ void write_gif_core(const NumericVector vec,
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Open stream
+  // Integer, logical and raw data is read in place (see samples.h)
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  RObject samples = pixel_samples(vec);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Open the output: a file, or a raw vector of exactly the right size
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  std::ofstream outfile;
-  outfile.open(filename, std::ios::out | std::ios::binary);
+  ImageOutput output(filename, gif_size(ncol, nrow), true);
+  std::ostream &outfile = output.stream();
 
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -435,11 +432,11 @@ void write_gif_core(const NumericVector vec,
   // Scale the intensity
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (intensity_factor <= 0) {
-    double *max_value = (double *)std::max_element(vec.begin(), vec.end());
-    if (*max_value == 0) {
-      *max_value = 1;
+    double max_value = max_sample(samples);
+    if (max_value == 0) {
+      max_value = 1;
     }
-    scale_factor /= *max_value;
+    scale_factor /= max_value;
   } else {
     scale_factor *= intensity_factor;
   }
@@ -448,16 +445,24 @@ void write_gif_core(const NumericVector vec,
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Invert the colours?
-  // Rounding offset is -1.5 in order to take advantage of the way a
-  // 'double' is truncated to an 'unsigned char'
+  // Rounding offset is -1.5 so that values truncate to [-125, -1], which
+  // SampleScale's bias brings back to [124, 0]
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (invert) {
     round_offset = -1.5;
     scale_factor = -scale_factor;
   }
 
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Values outside the scale saturate at 0 and 124, so no index ever
+  // reaches the CLEAR (128) and STOP (129) codes.  NA becomes 'na_value'
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const SampleScale scale(scale_factor, round_offset, invert, 127 - 3, na_value);
+
 
-  write_gif_data(outfile, vec, ncol, nrow, scale_factor, round_offset, convert_to_row_major, flipy);
+  write_gif_image_descriptor(outfile, ncol, nrow);
+  write_gif_data(outfile, samples, ncol, nrow, scale, convert_to_row_major, flipy);
+  write_gif_image_end(outfile);
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // IEND
@@ -465,10 +470,109 @@ void write_gif_core(const NumericVector vec,
   write_gif_terminator(outfile);
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Close stream
+  // Close the file, or return the raw vector
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  outfile.close();
+  return output.close();
+
+}
+
+
+
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A GIF written a block of rows at a time (see image-writer.h)
+//
+// Every row of the image data is self-contained (each starts with a CLEAR
+// code), so each block is written exactly as if it were a whole image.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class GifWriter : public ImageWriter {
+public:
+  GifWriter(SEXP filename, unsigned int nrow, unsigned int ncol,
+            bool convert_to_row_major, const SampleScale &scale,
+            Rcpp::IntegerMatrix pal);
+
+private:
+  SampleScale scale;
 
+  void write_rows(SEXP block, unsigned int block_rows) {
+    write_gif_data(outfile, block, ncol, block_rows, scale, convert_to_row_major, false);
+  }
+
+  void write_trailer() {
+    write_gif_image_end(outfile);
+    write_gif_terminator(outfile);
+  }
+};
+
+
+GifWriter::GifWriter(SEXP filename, unsigned int nrow, unsigned int ncol,
+                     bool convert_to_row_major, const SampleScale &scale,
+                     Rcpp::IntegerMatrix pal) :
+  ImageWriter(filename, nrow, ncol, 1, convert_to_row_major),
+  scale(scale) {
+
+  write_gif_header(outfile, ncol, nrow);
+  write_global_colour_table(outfile, pal);
+  write_gif_image_descriptor(outfile, ncol, nrow);
 }
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' Open a GIF file to be written a block of rows at a time
+//'
+//' @param filename output filename, connection, file descriptor or NULL.
+//'        See \code{write_gif_core}
+//' @param dims dimensions of the whole image as R data i.e. \code{c(nrow, ncol)}
+//' @param convert_to_row_major,invert,pal,na_value See \code{write_gif_core}
+//' @param intensity_factor multiplication factor applied to all values.
+//'        Must be positive, as the maximum of the whole image is never known.
+//'
+//' @return external pointer to the writer
+//'
+//' @noRd
+// [[Rcpp::export(.gif_writer_open)]]
+SEXP gif_writer_open(SEXP filename,
+                     const IntegerVector dims,
+                     const bool convert_to_row_major = true,
+                     const bool invert               = false,
+                     const double intensity_factor   = 1,
+                     Rcpp::IntegerMatrix pal         = R_NilValue,
+                     const int na_value              = 0) {
+
+  if (dims.length() != 2) {
+    stop("image_writer(): 'dims' must be length = 2 for a GIF");
+  }
+  if (dims[0] < 1 || dims[1] < 1) {
+    stop("image_writer(): Image must not be empty");
+  }
+  if (dims[0] > 65535 || dims[1] > 65535) {
+    stop("image_writer(): GIF images can not be wider or taller than 65535 pixels");
+  }
+  if (intensity_factor <= 0) {
+    stop("image_writer(): 'intensity_factor' must be positive");
+  }
+  if (na_value < 0 || na_value > 127) {
+    stop("image_writer(): 'na_value' must be in the range [0, 127] for a GIF");
+  }
+
+  const unsigned int nrow = convert_to_row_major ? dims[0] : dims[1];
+  const unsigned int ncol = convert_to_row_major ? dims[1] : dims[0];
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Same scaling and clamping as write_gif_core()
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  double scale_factor = (127.0 - 3) * intensity_factor;
+  double round_offset = 0.5;
+  if (invert) {
+    round_offset = -1.5;
+    scale_factor = -scale_factor;
+  }
+  const SampleScale scale(scale_factor, round_offset, invert, 127 - 3, na_value);
+
+  GifWriter *writer = new GifWriter(filename, nrow, ncol, convert_to_row_major,
+                                    scale, pal);
+
+  return XPtr<ImageWriter>(writer, true);
+}
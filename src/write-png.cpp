@@ -1,17 +1,26 @@
 #include <fstream>
+#include <vector>
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <system_error>
 #include "Rcpp.h"
 
 using namespace Rcpp;
 
 #include "crc32.h"
 #include "adler32.h"
+#include "checksum.h"
+#include "deflate.h"
+#include "png-filter.h"
+#include "quantise.h"
+#include "pixels.h"
+#include "samples.h"
+#include "image-writer.h"
+#include "output.h"
 
 
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// Use an SSE version of ADLER32?
-//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// #define ADLER32_SSE
-
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Swap endianness for a 32bit unsigned int
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -41,7 +50,7 @@ static inline uint32_t bswap32(uint32_t x) {
 //
 //  - Write PNG header - 8 bytes.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_PNG_signature(std::ofstream &outfile) {
+void write_PNG_signature(std::ostream &outfile) {
   const unsigned char PNG_header[12] = {
     0x89, 0x50, 0x4e, 0x47,   // ".PNG"
     0x0d, 0x0a, 0x1a, 0x0a    // CRC32
@@ -66,12 +75,13 @@ void write_PNG_signature(std::ofstream &outfile) {
 // - Write IHDR chunk
 // - 17 bytes of goodness
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_IHDR(std::ofstream &outfile, unsigned int ncol, unsigned int nrow, unsigned int colour_type) {
+void write_IHDR(std::ostream &outfile, unsigned int ncol, unsigned int nrow, unsigned int colour_type,
+                unsigned int bit_depth) {
   unsigned char IHDR[17] = {
     0x49, 0x48, 0x44, 0x52, // "IHDR"
     0, 0, 0, 0,  // width  - Overwrite later
     0, 0, 0, 0,  // height - Overwrite later
-    8,           // bit-depth - 8 bits per channel
+    8,           // bit-depth - Overwrite later
     0,           // colour-type. 0 = greyscale.  2 = RGB, 3 = Palette/indexed
     0,           // compression method. Set to 0
     0,           // filter method.      Set to 0
@@ -83,6 +93,11 @@ void write_IHDR(std::ofstream &outfile, unsigned int ncol, unsigned int nrow, un
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   IHDR[13] = colour_type; // 0 = greyscale.  2 = RGB, 3 = Palette/indexed
 
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Bits per channel. 8 or 16
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  IHDR[12] = bit_depth;
+
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Insert the width into the IHDR chunk
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -111,7 +126,7 @@ void write_IHDR(std::ofstream &outfile, unsigned int ncol, unsigned int nrow, un
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   uint32_t crc32 = 0;
   outfile.write((const char *)&IHDR[0], 17);
-  crc32 = crc32_16bytes(&IHDR[0], 17, crc32);
+  crc32 = crc32_fast(&IHDR[0], 17, crc32);
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Write IHDR CRC32 to output
@@ -134,14 +149,17 @@ void write_IHDR(std::ofstream &outfile, unsigned int ncol, unsigned int nrow, un
 //
 // - Write out a PLTE (palette) chunk
 // - Reference: https://www.w3.org/TR/PNG/#11PLTE
+// - A 4th column in 'pal' is alpha, and is written separately by write_tRNS()
+// - If 'na_entry' is set, an extra (black) colour is added at the end of
+//   the palette for NA values
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_PLTE(std::ofstream &outfile, Rcpp::IntegerMatrix pal) {
+void write_PLTE(std::ostream &outfile, Rcpp::IntegerMatrix pal, bool na_entry) {
 
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
     // Sanity check
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    if (pal.nrow() < 2 | pal.nrow() > 256 | pal.ncol() != 3) {
-      stop("\'pal\' must be a N x 3 IntegerMatrix with values in the range [0,255]");
+    if (pal.nrow() < 2 | pal.nrow() > 256 | (pal.ncol() != 3 && pal.ncol() != 4)) {
+      stop("\'pal\' must be a N x 3 (or N x 4 with alpha) IntegerMatrix with values in the range [0,255]");
     }
 
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -154,14 +172,15 @@ void write_PLTE(std::ofstream &outfile, Rcpp::IntegerMatrix pal) {
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
     // Write PLTE header to output
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-    unsigned int nrow = pal.nrow();
-    uint32_t data_length = 3 * nrow;
+    unsigned int nrow   = pal.nrow();
+    unsigned int ncolour = nrow + (na_entry ? 1 : 0);
+    uint32_t data_length = 3 * ncolour;
     data_length = bswap32(data_length);
     outfile.write(reinterpret_cast<const char *>(&data_length), sizeof(data_length));
 
     uint32_t crc32 = 0;
     outfile.write((const char *)&PLTE[0], 4);
-    crc32 = crc32_16bytes(&PLTE[0], 4, crc32);
+    crc32 = crc32_fast(&PLTE[0], 4, crc32);
 
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
     // Convert the palette data to unsigned char and write to output
@@ -173,8 +192,13 @@ void write_PLTE(std::ofstream &outfile, Rcpp::IntegerMatrix pal) {
       *pucpal++ = (unsigned char)pal[i + nrow    ];
       *pucpal++ = (unsigned char)pal[i + nrow * 2];
     }
-    outfile.write((const char *)&ucpal[0], 3*nrow);
-    crc32 = crc32_16bytes(&ucpal[0], 3*nrow, crc32);
+    if (na_entry) {
+      *pucpal++ = 0;
+      *pucpal++ = 0;
+      *pucpal++ = 0;
+    }
+    outfile.write((const char *)&ucpal[0], 3*ncolour);
+    crc32 = crc32_fast(&ucpal[0], 3*ncolour, crc32);
 
     //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
     // Write PLTE CRC32 to output
@@ -185,6 +209,51 @@ void write_PLTE(std::ofstream &outfile, Rcpp::IntegerMatrix pal) {
 
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+//    .             ooooooooo.   ooooo      ooo  .oooooo..o
+//  .o8             `888   `Y88. `888b.     `8' d8P'    `Y8
+// .o888oo oooo d8b  888   .d88'  8 `88b.    8  Y88bo.
+//   888   `888""8P  888ooo88P'   8   `88b.  8   `"Y8888o.
+//   888    888      888`88b.     8     `88b.8       `"Y88b
+//   888 .  888      888  `88b.   8       `888  oo     .d8P
+//   "888" d888b    o888o  o888o o8o        `8  8""88888P'
+//
+//
+// - Write out a tRNS (transparency) chunk for an indexed image
+// - Reference: https://www.w3.org/TR/PNG/#11tRNS
+// - One alpha value per palette entry. Taken from the 4th column of 'pal'
+//   (or fully opaque if there isn't one), plus a fully transparent entry
+//   for NA values if 'na_entry' is set.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_tRNS(std::ostream &outfile, Rcpp::IntegerMatrix pal, bool na_entry) {
+
+    unsigned int nrow    = pal.nrow();
+    unsigned int ncolour = nrow + (na_entry ? 1 : 0);
+
+    unsigned char tRNS[4 + 256] = {
+      116, 82, 78, 83  // "tRNS"
+    };
+
+    for (unsigned int i = 0; i < nrow; i++) {
+      tRNS[4 + i] = pal.ncol() == 4 ? (unsigned char)pal[i + nrow * 3] : 255;
+    }
+    if (na_entry) {
+      tRNS[4 + nrow] = 0;
+    }
+
+    uint32_t data_length = bswap32(ncolour);
+    outfile.write(reinterpret_cast<const char *>(&data_length), sizeof(data_length));
+
+    outfile.write((const char *)&tRNS[0], 4 + ncolour);
+    uint32_t crc32 = crc32_fast(&tRNS[0], 4 + ncolour, 0);
+
+    crc32 = bswap32(crc32);
+    outfile.write(reinterpret_cast<const char *>(&crc32), sizeof(crc32));
+}
+
+
+
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //
 // ooooo oooooooooo.         .o.       ooooooooooooo
@@ -196,7 +265,15 @@ void write_PLTE(std::ofstream &outfile, Rcpp::IntegerMatrix pal) {
 // o888o o888bood8P'   o88o     o8888o     o888o
 //
 //
-// Write out an IDAT chunk
+// Build the bytes which precede the data in an uncompressed IDAT chunk:
+//   IDAT data length (4) + "IDAT" (4) + [ZLIB header (2)] + DEFLATE header (5)
+//
+// If 'sequence' is not negative, this is an APNG "fdAT" chunk instead, which
+// is identical except for the chunk type and a 4 byte sequence number
+// before the data:
+//   data length (4) + "fdAT" (4) + sequence (4) + [ZLIB header (2)] + DEFLATE header (5)
+//
+// Returns the number of header bytes written into 'hdr' (19 bytes max)
 //
 // Reference: https://stackoverflow.com/questions/9050260/what-does-a-zlib-header-look-like
 // Only using uncompressed DEFLATE blocks, see:
@@ -207,23 +284,57 @@ void write_PLTE(std::ofstream &outfile, Rcpp::IntegerMatrix pal) {
 // header. Since it's only 2 bytes, max deflate size is then 2^16 (65535)
 //
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_IDAT(std::ofstream &outfile, unsigned char *uc0, unsigned int nbytes,
-                uint32_t &adler32,
-                bool first_idat_chunk, bool final_idat_chunk) {
+unsigned int make_IDAT_header(unsigned char *hdr, unsigned int nbytes,
+                              bool first_idat_chunk, bool final_idat_chunk,
+                              int sequence = -1) {
 
-  uint32_t data_length   = 0;
+  unsigned char *p = hdr;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // IDAT data length
+  //   If this is the first chunk, then we need to write the zlib header.
+  //   For all subsequent chunks, we only write the DEFLATE header
+  //   Adler32 is calculated over the entire data, and written at the end
+  //   of the final DEFLATE block. it is 32 bits = 4 bytes.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  uint32_t data_length = 5 + nbytes;  // (DEFLATE header) + LEN
+  if (first_idat_chunk) {
+    data_length += 2;                 // (zlib header)
+  }
+  if (final_idat_chunk) {
+    data_length += 4;                 // ADLER32
+  }
+  if (sequence >= 0) {
+    data_length += 4;                 // fdAT sequence number
+  }
+
+  *p++ = (data_length >> 24) & 0xFF;
+  *p++ = (data_length >> 16) & 0xFF;
+  *p++ = (data_length >>  8) & 0xFF;
+  *p++ = (data_length      ) & 0xFF;
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // IDAT marker
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  unsigned char IDAT[4] = {0x49, 0x44, 0x41, 0x54}; // "IDAT" text
+  if (sequence < 0) {
+    *p++ = 0x49; *p++ = 0x44; *p++ = 0x41; *p++ = 0x54; // "IDAT" text
+  } else {
+    *p++ = 0x66; *p++ = 0x64; *p++ = 0x41; *p++ = 0x54; // "fdAT" text
+    *p++ = (sequence >> 24) & 0xFF;
+    *p++ = (sequence >> 16) & 0xFF;
+    *p++ = (sequence >>  8) & 0xFF;
+    *p++ = (sequence      ) & 0xFF;
+  }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // ZLIB header - https://tools.ietf.org/html/rfc1950
   // 2 bytes = CFM + FLG.
   // Setting to {78, 01} is largest window = 32k
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  unsigned char ZLIB_header[2] = {0x78, 0x01};
+  if (first_idat_chunk) {
+    *p++ = 0x78;
+    *p++ = 0x01;
+  }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // DEFLATE header - https://tools.ietf.org/html/rfc1951
@@ -233,591 +344,2420 @@ void write_IDAT(std::ofstream &outfile, unsigned char *uc0, unsigned int nbytes,
   //    5 Empty bits - BTYPE (2 bits) - BFINAL (1 bit)
   //  BTYPE = 00 for No compression
   //  BFINAL = set if and only if this is the last block of the data set.
+  //
+  // Followed by LEN and NLEN (1s complement of LEN). Little Endian
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  unsigned char DEFLATE_header[5] = {
-    0x00,        // Is this the last block? 1/0 = Y/N.
-    0x00, 0x00,  // LEN  = Data size not exceeding 32k.
-    0x00, 0x00,  // NLEN = 1s complement of above datasize
+  uint16_t LEN  = nbytes;
+  uint16_t NLEN = ~LEN; // 1s complement
+
+  *p++ = final_idat_chunk ? 1 : 0;
+  *p++ =  LEN       & 0xFF;
+  *p++ =  LEN >> 8  & 0xFF;
+  *p++ = NLEN       & 0xFF;
+  *p++ = NLEN >> 8  & 0xFF;
+
+  return p - hdr;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A run of uncompressed IDAT chunks whose checksums have already been
+// calculated, written out together by write().
+//
+// 'crc32' must already cover "IDAT", the zlib/DEFLATE headers and the data.
+// 'adler32' must already cover the data.  These are usually accumulated row
+// by row as the image data is generated (see IDATStream), while the bytes
+// are still in cache.
+//
+// Only the framing of each chunk (headers, ADLER32 and CRC32) is built
+// here.  The data is written from wherever it already is, so it must stay
+// put until write().  A file or file descriptor gets the whole run in one
+// writev(2) (see write_gather()), rather than 3 or 4 writes per chunk
+// through a buffer.
+//
+// A non-negative 'sequence' writes an APNG fdAT chunk (see make_IDAT_header())
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class StoredIDATs {
+public:
+  void add(const unsigned char *data, unsigned int nbytes,
+           uint32_t adler32, uint32_t crc32,
+           bool first_idat_chunk, bool final_idat_chunk,
+           int sequence = -1);
+  void write(std::ostream &outfile);
+
+private:
+  struct Chunk {
+    unsigned char        hdr[19];
+    unsigned int         hdr_len;
+    const unsigned char *data;
+    unsigned int         nbytes;
+    unsigned char        tail[8];  // ADLER32 (final chunk only) and CRC32
+    unsigned int         tail_len;
   };
 
+  std::vector<Chunk>       chunks;
+  std::vector<OutputPiece> pieces;
+};
+
+
+void StoredIDATs::add(const unsigned char *data, unsigned int nbytes,
+                      uint32_t adler32, uint32_t crc32,
+                      bool first_idat_chunk, bool final_idat_chunk,
+                      int sequence) {
+  chunks.resize(chunks.size() + 1);
+  Chunk &chunk = chunks.back();
+
+  chunk.hdr_len = make_IDAT_header(chunk.hdr, nbytes, first_idat_chunk, final_idat_chunk, sequence);
+  chunk.data    = data;
+  chunk.nbytes  = nbytes;
+
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Only if this is the final_idat_chunk do we set the BFINAL bit
+  // ADLER32 - only if this is the last DEFLATE block
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  unsigned char *p = chunk.tail;
   if (final_idat_chunk) {
-    DEFLATE_header[0] = 1;
+    *p++ = (adler32 >> 24) & 0xFF;
+    *p++ = (adler32 >> 16) & 0xFF;
+    *p++ = (adler32 >>  8) & 0xFF;
+    *p++ = (adler32      ) & 0xFF;
+    crc32 = crc32_fast(chunk.tail, 4, crc32);
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Write the LEN and NLEN data into the zip block header. Little Endian
+  // CRC32
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  uint16_t LEN  = nbytes;
-  uint16_t NLEN = ~LEN; // 1s complement
+  *p++ = (crc32 >> 24) & 0xFF;
+  *p++ = (crc32 >> 16) & 0xFF;
+  *p++ = (crc32 >>  8) & 0xFF;
+  *p++ = (crc32      ) & 0xFF;
 
-  DEFLATE_header[1] =  LEN       & 0xFF;
-  DEFLATE_header[2] =  LEN >> 8  & 0xFF;
-  DEFLATE_header[3] = NLEN       & 0xFF;
-  DEFLATE_header[4] = NLEN >> 8  & 0xFF;
+  chunk.tail_len = p - chunk.tail;
+}
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // IDAT prep
-  //   If this is the first chunk, then we need to write the zlib header.
-  //   For all subsequent chunks, we only write the DEFLATE header
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (first_idat_chunk) {
-    data_length = 2 + 5 + LEN; // (zlib header) + (DEFLATE header) + LEN
-  } else {
-    data_length =     5 + LEN; //                 (DEFLATE header) + LEN
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write all the chunks added so far, and start a new run
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void StoredIDATs::write(std::ostream &outfile) {
+  pieces.clear();
+  for (size_t i = 0; i < chunks.size(); i++) {
+    OutputPiece hdr  = {chunks[i].hdr , chunks[i].hdr_len };
+    OutputPiece data = {chunks[i].data, chunks[i].nbytes  };
+    OutputPiece tail = {chunks[i].tail, chunks[i].tail_len};
+    pieces.push_back(hdr);
+    pieces.push_back(data);
+    pieces.push_back(tail);
   }
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Adler32 is calculated over the entire data, and written at the end
-  // of the final DEFLATE block. it is 32 bits = 4 bytes.
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (final_idat_chunk) {
-    data_length += 4;
+  if (!pieces.empty()) {
+    write_gather(outfile, &pieces[0], pieces.size());
   }
+  chunks.clear();
+}
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Write IDAT data length
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  data_length = bswap32(data_length);
-  outfile.write(reinterpret_cast<const char *>(&data_length), sizeof(data_length));
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write out a single uncompressed IDAT chunk whose checksums have already
+// been calculated.  See StoredIDATs
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_IDAT_checksummed(std::ostream &outfile, unsigned char *uc0, unsigned int nbytes,
+                            uint32_t adler32, uint32_t crc32,
+                            bool first_idat_chunk, bool final_idat_chunk,
+                            int sequence = -1) {
+  StoredIDATs idats;
+  idats.add(uc0, nbytes, adler32, crc32, first_idat_chunk, final_idat_chunk, sequence);
+  idats.write(outfile);
+}
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Write IDAT header
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  uint32_t crc32 = 0;
-  outfile.write((const char *)&IDAT[0], 4);
-  crc32 = crc32_16bytes(&IDAT[0], 4, crc32);
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// CRC32 of the start of an uncompressed IDAT chunk i.e. "IDAT" and the
+// zlib/DEFLATE headers (or "fdAT", the sequence number and the headers).
+// The CRC32 of the data is then accumulated on top of this.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+uint32_t crc32_IDAT_header(unsigned int nbytes, bool first_idat_chunk, bool final_idat_chunk,
+                           int sequence = -1) {
+  unsigned char hdr[19];
+  unsigned int hdr_len = make_IDAT_header(hdr, nbytes, first_idat_chunk, final_idat_chunk, sequence);
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // if this is first IDAT, then write ZLIB header
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (first_idat_chunk) {
-    outfile.write((const char *)&ZLIB_header[0], 2);
-    crc32 = crc32_16bytes(&ZLIB_header[0], 2, crc32);
-  }
+  // The data length is not part of the CRC32
+  return crc32_fast(&hdr[4], hdr_len - 4, 0);
+}
 
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // write DEFLATE header
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  outfile.write((const char *)&DEFLATE_header[0], 5);
-  crc32 = crc32_16bytes(&DEFLATE_header[0], 5, crc32);
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write out an IDAT chunk containing a single uncompressed DEFLATE block
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_IDAT(std::ostream &outfile, unsigned char *uc0, unsigned int nbytes,
+                uint32_t &adler32,
+                bool first_idat_chunk, bool final_idat_chunk) {
 
+  uint32_t crc32 = crc32_IDAT_header(nbytes, first_idat_chunk, final_idat_chunk);
+  update_crc32_adler32(uc0, nbytes, crc32, adler32);
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Write the data
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  outfile.write((const char *)&uc0[0], nbytes);
-  crc32 = crc32_16bytes(&uc0[0], nbytes, crc32);
+  write_IDAT_checksummed(outfile, uc0, nbytes, adler32, crc32,
+                         first_idat_chunk, final_idat_chunk);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write out an IDAT chunk of compressed data
+//
+// Unlike write_IDAT(), the DEFLATE blocks here are not aligned with the
+// IDAT chunks.  The zlib stream is just split across consecutive IDATs:
+//   - the first IDAT starts with the zlib header
+//   - the encoder carries any partial byte over to the next IDAT
+//   - the final IDAT ends with the ADLER32 of the raw (uncompressed) data
+//
+// 'adler32' must already cover the raw data in 'uc0'
+// 'zbuf' is working space for the compressed bytes, and is reused across calls
+// A non-negative 'sequence' writes an APNG fdAT chunk (see make_IDAT_header())
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_IDAT_deflate(std::ostream &outfile, unsigned char *uc0, unsigned int nbytes,
+                        uint32_t adler32,
+                        DeflateEncoder &encoder, std::vector<unsigned char> &zbuf,
+                        bool first_idat_chunk, bool final_idat_chunk,
+                        int sequence = -1) {
 
+  zbuf.clear();
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Update the ADLER32
+  // ZLIB header - https://tools.ietf.org/html/rfc1950
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  adler32 = update_adler32(adler32, &uc0[0], nbytes);
+  if (first_idat_chunk) {
+    zbuf.push_back(0x78);
+    zbuf.push_back(0x01);
+  }
 
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Compress the data
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  encoder.compress(uc0, nbytes, final_idat_chunk, zbuf);
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Output ADLER32 - only if this is the last DEFLATE block
+  // ADLER32 follows the final DEFLATE block. Big endian.
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (final_idat_chunk) {
-    adler32 = bswap32(adler32);
-    outfile.write(reinterpret_cast<const char *>(&adler32), sizeof(adler32));
-    crc32 = crc32_16bytes(&adler32, 4, crc32);
+    zbuf.push_back((adler32 >> 24) & 0xFF);
+    zbuf.push_back((adler32 >> 16) & 0xFF);
+    zbuf.push_back((adler32 >>  8) & 0xFF);
+    zbuf.push_back((adler32      ) & 0xFF);
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Output CRC32
+  // Write IDAT data length, "IDAT", data and CRC32
+  // fdAT chunks have a sequence number between "fdAT" and the data
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  unsigned char IDAT[8] = {0x49, 0x44, 0x41, 0x54}; // "IDAT" text
+  unsigned int  IDAT_len = 4;
+  if (sequence >= 0) {
+    IDAT[0] = 0x66; IDAT[1] = 0x64;                 // "fdAT" text
+    IDAT[4] = (sequence >> 24) & 0xFF;
+    IDAT[5] = (sequence >> 16) & 0xFF;
+    IDAT[6] = (sequence >>  8) & 0xFF;
+    IDAT[7] = (sequence      ) & 0xFF;
+    IDAT_len = 8;
+  }
+
+  uint32_t data_length = bswap32((uint32_t)(zbuf.size() + IDAT_len - 4));
+  outfile.write(reinterpret_cast<const char *>(&data_length), sizeof(data_length));
+
+  uint32_t crc32 = 0;
+  outfile.write((const char *)&IDAT[0], IDAT_len);
+  crc32 = crc32_fast(&IDAT[0], IDAT_len, crc32);
+
+  if (zbuf.size() > 0) {
+    outfile.write((const char *)&zbuf[0], zbuf.size());
+    crc32 = crc32_fast(&zbuf[0], zbuf.size(), crc32);
+  }
+
   crc32 = bswap32(crc32);
   outfile.write(reinterpret_cast<const char *>(&crc32), sizeof(crc32));
 }
 
 
-
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The filtered rows are treated as one continuous stream of bytes, which is
+// cut into IDAT chunks of IDAT_BUDGET bytes (the last chunk may be shorter).
+// Rows are allowed to straddle the cut, so there is no limit on row width.
 //
-// ooooo oooooooooooo ooooo      ooo oooooooooo.
-// `888' `888'     `8 `888b.     `8' `888'   `Y8b
-//  888   888          8 `88b.    8   888      888
-//  888   888oooo8     8   `88b.  8   888      888
-//  888   888    "     8     `88b.8   888      888
-//  888   888       o  8       `888   888     d88'
-// o888o o888ooooood8 o8o        `8  o888bood8P'
-//
-//
-// - Write IEND chunk
+// IDAT_BUDGET is the maximum size of 'LEN' in the DEFLATE header of a stored
+// block (2 bytes = 65535).  Want to make the deflate blocks as large as
+// possible so that
+//   - the number of IDATs is reduced
+//   - CRC32 calculations which operate on larger buffers can really get
+//     their money's worth e.g. splice-by-8 and splice-by-16
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_IEND(std::ofstream &outfile) {
-  unsigned char IEND[12] = {
-    0x00, 0x00, 0x00, 0x00,  // Data length for IEND is always 0
-    0x49, 0x45, 0x4E, 0x44,  // "IEND"
-    0xAe, 0x42, 0x60, 0x82   // CRC32 for "IEND"
-  };
+#define IDAT_BUDGET 65535
 
-  outfile.write((const char *)&IEND[0], 12);
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Uncompressed IDATs are written out this many at a time (about 1MB), so
+// each write(2) carries plenty of data
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define IDAT_BATCH 16
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Size of the IDAT chunk which starts at offset 'pos' in the stream
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline size_t IDAT_length(size_t pos, size_t total) {
+  return total - pos < IDAT_BUDGET ? total - pos : IDAT_BUDGET;
 }
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// APNG sequence number of the chunk which starts at offset 'pos' in the
+// stream, when the first chunk has sequence number 'sequence'.
+// A negative 'sequence' means plain IDATs, which have no sequence number.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline int IDAT_sequence(int sequence, size_t pos) {
+  return sequence < 0 ? -1 : sequence + (int)(pos / IDAT_BUDGET);
+}
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Checksum 'n' bytes of an uncompressed stream of 'total' bytes, starting
+// at stream offset 'pos'.
 //
-//   .oooooo.
-//  d8P'  `Y8b
-// 888           oooo d8b  .ooooo.  oooo    ooo
-// 888           `888""8P d88' `88b  `88.  .8'
-// 888     ooooo  888     888ooo888   `88..8'
-// `88.    .88'   888     888    .o    `888'
-//  `Y8bood8P'   d888b    `Y8bod8P'     .8'
-//                                  .o..P'
-//                                  `Y8P'
+// Every IDAT has its own CRC32. Whenever 'pos' reaches the start of an IDAT,
+// a new CRC32 is started on its headers and appended to 'crc32', so a piece
+// of data which crosses IDAT boundaries ends up with one CRC32 per IDAT.
+// The ADLER32 runs across all the data.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void update_stored_checksums(const unsigned char *p, size_t n, size_t pos, size_t total,
+                             std::vector<uint32_t> &crc32, uint32_t &adler32,
+                             int sequence = -1) {
+  while (n > 0) {
+    size_t offset = pos % IDAT_BUDGET;
+    if (offset == 0) {
+      size_t len = IDAT_length(pos, total);
+      crc32.push_back(crc32_IDAT_header(len, pos == 0, pos + len == total,
+                                        IDAT_sequence(sequence, pos)));
+    }
+    size_t len = IDAT_BUDGET - offset < n ? IDAT_BUDGET - offset : n;
+    update_crc32_adler32(p, len, crc32.back(), adler32);
+    p   += len;
+    n   -= len;
+    pos += len;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// IDATStream
+//
+// Collects rows of image data into a stripe buffer and writes out an IDAT
+// chunk each time the buffer holds IDAT_BUDGET bytes.  Any part of a row
+// left over after an IDAT is moved to the start of the buffer and carried
+// into the next IDAT.  The buffer only ever needs room for IDAT_BUDGET bytes
+// plus one row, however wide the image.
 //
+// Uncompressed IDATs are instead written IDAT_BATCH at a time (see
+// StoredIDATs), so the buffer holds that many IDATs plus one row.
 //
-// - Write GREY data
+// The data functions fill in one row at a time:
+//
+//     unsigned char *uc = idat.begin_row();
+//     for (...) { *uc++ = ...; }
+//     idat.end_row();
+//
+// end_row() applies the scanline filter and then updates the checksums for
+// the row straight away, while the row is still in cache.  For uncompressed
+// output the CRC32 and ADLER32 are calculated together in a single pass
+// (see checksum.h), so the stripe buffer is only read once more - when it
+// is written to file.
+//
+// For APNG frames after the first, 'sequence' is the sequence number of the
+// first fdAT chunk, and the stream is written as fdAT chunks instead of IDATs.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_png_grey_data(std::ofstream &outfile,
-                         const NumericVector vec,
-                         const unsigned int ncol,
-                         const unsigned int nrow,
-                         const double scale_factor,
-                         const double round_offset,
-                         const bool convert_to_row_major,
-                         const bool flipy) {
+class IDATStream {
+public:
+  IDATStream(std::ostream &outfile, unsigned int nrow, size_t rowbytes,
+             unsigned int bpp, int compression, int filter, int sequence = -1);
+  ~IDATStream() { free(uc0); }
+
+  unsigned char *begin_row();
+  void end_row();
+
+private:
+  std::ostream &outfile;
+  unsigned int nrow;
+  size_t       stride;       // bytes per row, including the filter-type byte
+  unsigned int row;          // number of rows completed so far
+  size_t       total;        // bytes in the whole stream i.e. nrow * stride
+  size_t       written;      // bytes written out in IDATs so far
+  int          sequence;     // fdAT sequence number of the first chunk. -1 for IDAT
+
+  size_t         capacity;   // bytes of IDATs to collect before writing them
+  unsigned char *uc0;        // stripe buffer
+  unsigned char *uc;         // current write position in stripe buffer
+
+  uint32_t adler32;
+  std::vector<uint32_t> crc32;  // CRC32 of each IDAT which has been started
+  bool     first_idat;
+
+  DeflateEncoder             encoder;
+  std::vector<unsigned char> zbuf;
+  StoredIDATs                idats;
+  PngFilter                  png_filter;
+
+  void checksum(const unsigned char *p, size_t n);
+  void flush(size_t nbytes);
+};
+
+
+IDATStream::IDATStream(std::ostream &outfile, unsigned int nrow, size_t rowbytes,
+                       unsigned int bpp, int compression, int filter, int sequence) :
+  outfile(outfile), nrow(nrow), stride(rowbytes + 1), row(0),
+  total(nrow * (rowbytes + 1)), written(0), sequence(sequence),
+  capacity(IDAT_BUDGET), uc0(NULL), uc(NULL),
+  adler32(1), first_idat(true),
+  encoder(compression, rowbytes + 1),
+  png_filter(filter, rowbytes, bpp) {
+
+  if (encoder.get_level() == DEFLATE_STORED) {
+    capacity = (size_t)IDAT_BATCH * IDAT_BUDGET;
+    if (capacity > total) {
+      capacity = total;
+    }
+  }
 
-  const unsigned int depth = 1;
+  uc0 = (unsigned char *) calloc(capacity + stride, sizeof(unsigned char));
+  if (!uc0) stop("IDATStream: out of memory");
+  uc = uc0;
+}
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Calculate a number of rows that fit into an IDAT (with some leeway)
-  // The data for each row actually has a zero-byte pre-pended to it.
-  // Not sure why this is done!
-  // Calculate the number of rows that would fit in a maximally sized deflate block.
-  // Maximum size os 'LEN' in DEFLATE header is 2 bytes = 65535
-  // Want to make the defalte blocks as large as possible so that
-  //   - the number of IDATs is reduced
-  //   - CRC32 calculations which operate on larger buffers can really get
-  //     their money's worth e.g. splice-by-8 and splice-by-16
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if ((ncol * depth + 1) > 65535) {
-    stop("Images wider than 65535/depth not currently handled.");
-  }
-  unsigned int nrow_buffer = 65535/(ncol * depth + 1);
-  if (nrow_buffer > nrow) {
-    nrow_buffer = nrow;
-  }
-  unsigned int buffer_size = nrow_buffer * (ncol * depth + 1);
-  unsigned int remainder_size = (nrow % nrow_buffer) * (ncol * depth + 1);
-  unsigned char *uc0 = (unsigned char *) calloc(buffer_size, sizeof(unsigned char));
-  if (!uc0) stop("write_png_grey_data(): out of memory");
-  unsigned char *uc = uc0;
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Start a new row. Returns where the first pixel byte should be written
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+unsigned char *IDATStream::begin_row() {
+  *uc = 0; // Filter-type byte. Set by png_filter.apply()
+  return uc + 1;
+}
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Get a pointer to the actual data in the supplied matrix
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  double *v0 = (double *)vec.begin();
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Initialise the ADLER32 checksum. This is the checksum across the
-  // entirity of the raw data
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  uint32_t adler32 = 1;
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Finish the current row: filter it, checksum it and write out every IDAT
+// which is now complete
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void IDATStream::end_row() {
+  png_filter.apply(uc);
+  checksum(uc, stride);
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // There are some things which are only done for the first IDAT chunk
-  // output e.g. outputting the full DEFLATE header
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  bool first_idat  = true;
+  uc += stride;
+  row++;
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  //  Prepare a buffer of data. Either transposing it (be default) or
-  // leaving it in 'column-major' form which writes the raw data in the same
-  // it is stored in R
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (convert_to_row_major) {
-    for (unsigned int row = 0; row < nrow; row++) {
-      unsigned int j = flipy ? nrow - 1 - row : row;
-      *uc++ = 0; // First byte of every row is set to zero? No idea why.
-      for (unsigned int col = 0; col < ncol; col++) {
-        *uc++ = (unsigned char)(v0[j] * scale_factor + round_offset);
-        j += nrow;
-      }
+  while ((size_t)(uc - uc0) >= capacity) {
+    flush(capacity);
+  }
 
-      // Flush the buffer to file
-      if ((row + 1) % nrow_buffer == 0) {
-        write_IDAT(outfile, uc0, buffer_size, adler32,
-                   first_idat,          // first IDAT
-                   (row + 1) == nrow);  // final IDAT
-        first_idat = false;
-        uc = uc0;
-      }
-    }
+  if (row == nrow && uc > uc0) {
+    flush(uc - uc0);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Update the checksums with 'n' bytes at 'p', which must be the next bytes
+// in the stream after those already checksummed
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void IDATStream::checksum(const unsigned char *p, size_t n) {
+  if (encoder.get_level() == DEFLATE_STORED) {
+    size_t pos = written + (p - uc0);
+    update_stored_checksums(p, n, pos, total, crc32, adler32, sequence);
   } else {
-    // Write pixels in R's column-major ordering
-    for (unsigned int row = 0; row < nrow; row++) {
-      unsigned int col = 0;
-      *uc++ = 0; // First byte of every row is set to zero? No idea why.
-      const unsigned int offset = flipy ? nrow - 1 - row : row;
-      double *v = v0 + ncol * offset;
-      for (; col <= ncol - 8; col+=8) {
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-      }
-      for (; col < ncol; col++) {
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-      }
+    adler32 = update_adler32(adler32, p, n);
+  }
+}
 
-      // Flush the buffer to file
-      if ((row + 1) % nrow_buffer == 0) {
-        write_IDAT(outfile, uc0, buffer_size, adler32,
-                   first_idat,          // first IDAT
-                   (row + 1) == nrow);  // final IDAT
-        first_idat = false;
-        uc = uc0;
-      }
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write the first 'nbytes' of the stripe buffer as either stored
+// (uncompressed) IDATs, or one compressed IDAT, depending on the encoder's
+// compression level. Whatever is left in the buffer is moved to the start.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void IDATStream::flush(size_t nbytes) {
+  if (encoder.get_level() == DEFLATE_STORED) {
+    size_t done = 0;
+    while (done < nbytes) {
+      size_t pos = written + done;
+      size_t len = IDAT_length(pos, total);
+      idats.add(uc0 + done, len, adler32, crc32.front(), pos == 0, pos + len == total,
+                IDAT_sequence(sequence, pos));
+      crc32.erase(crc32.begin());
+      done += len;
     }
+    idats.write(outfile);
+  } else {
+    bool final_idat = written + nbytes == total;
+    int  chunk_seq  = IDAT_sequence(sequence, written);
+    write_IDAT_deflate(outfile, uc0, nbytes, adler32, encoder, zbuf, first_idat, final_idat, chunk_seq);
   }
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Write final IDAT chunk ff there's any remaining data in the buffer
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (remainder_size > 0) {
-    write_IDAT(outfile, uc0, remainder_size, adler32, first_idat, true);
-  }
+  written   += nbytes;
+  first_idat = false;
+
+  size_t remaining = (uc - uc0) - nbytes;
+  memmove(uc0, uc0 + nbytes, remaining);
+  uc = uc0 + remaining;
 }
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Rows which are converted to row-major order are generated a band of
+// QUANTISE_BAND_ROWS rows at a time (see quantise8_rows()), and handed out
+// one at a time from the band.
 //
-// ooooooooo.     .oooooo.    oooooooooo.
-// `888   `Y88.  d8P'  `Y8b   `888'   `Y8b
-//  888   .d88' 888            888     888
-//  888ooo88P'  888            888oooo888'
-//  888`88b.    888     ooooo  888    `88b
-//  888  `88b.  `88.    .88'   888    .88P
-// o888o  o888o  `Y8bood8P'   o888bood8P'
-//
+// A row functor supports this with
+//   band_rows()                     QUANTISE_BAND_ROWS, or 1 if its rows
+//                                   are generated one at a time
+//   fill_band(uc, ustride, row, n)  write rows [row, row + n) to 'uc',
+//                                   'ustride' bytes apart
+// Functors without these are passed straight through.
 //
-// - Write RGB data
+// Each thread generating rows needs its own BandedRows.  'set_end()' stops
+// bands running past the last row that a parallel stripe needs.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_png_RGB_data(std::ofstream &outfile,
-                        const NumericVector vec,
-                        const unsigned int ncol,
-                        const unsigned int nrow,
-                        const double scale_factor,
-                        const double round_offset,
-                        const bool convert_to_row_major,
-                        const bool flipy) {
-
-  const unsigned int depth = 3;
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Calculate a number of rows that fit into an IDAT (with some leeway)
-  // The data for each row actually has a zero-byte pre-pended to it.
-  // Not sure why this is done!
-  // Calculate the number of rows that would fit in a maximally sized deflate block.
-  // Maximum size os 'LEN' in DEFLATE header is 2 bytes = 65535
-  // Want to make the defalte blocks as large as possible so that
-  //   - the number of IDATs is reduced
-  //   - CRC32 calculations which operate on larger buffers can really get
-  //     their money's worth e.g. splice-by-8 and splice-by-16
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if ((ncol * depth + 1) > 65535) {
-    stop("Images wider than 65535/depth not currently handled.");
-  }
-  unsigned int nrow_buffer = 65535/(ncol * depth + 1);
-  if (nrow_buffer > nrow) {
-    nrow_buffer = nrow;
-  }
-  unsigned int buffer_size = nrow_buffer * (ncol * depth + 1);
-  unsigned int remainder_size = (nrow % nrow_buffer) * (ncol * depth + 1);
-  unsigned char *uc0 = (unsigned char *) calloc(buffer_size, sizeof(unsigned char));
-  if (!uc0) stop("write_png_RGB_data(): out of memory");
-  unsigned char *uc = uc0;
+template <class RowFunc>
+struct has_fill_band {
+  template <class T> static char test(decltype(&T::fill_band));
+  template <class T> static long test(...);
+  static const bool value = sizeof(test<RowFunc>(0)) == sizeof(char);
+};
 
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Get a pointer to the actual data in the supplied matrix
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  double *v0 = (double *)vec.begin();
+template <class RowFunc, bool = has_fill_band<RowFunc>::value>
+class BandedRows {
+public:
+  BandedRows(const RowFunc &rows, size_t, unsigned int) : rows(rows) {}
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Initialise the ADLER32 checksum. This is the checksum across the
-  // entirity of the raw data
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  uint32_t adler32 = 1;
+  void set_end(unsigned int) {}
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // There are some things which are only done for the first IDAT chunk
-  // output e.g. outputting the full DEFLATE header
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  bool first_idat  = true;
+  void operator()(unsigned char *uc, unsigned int row) {
+    rows(uc, row);
+  }
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  //  Prepare a buffer of data. Either transposing it (be default) or
-  // leaving it in 'column-major' form which writes the raw data in the same
-  // it is stored in R
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (convert_to_row_major) {
-    // Convert from R's column-major ordering to row-major output order
-    // Red, Green and Blue values are in different array planes, but
-    // reordered to be written consecutively
-    for (unsigned int row = 0; row < nrow; row++) {
-      const unsigned int offset = flipy ? nrow - 1 - row : row;
-      unsigned int r = offset;
-      unsigned int g = offset + nrow * ncol;
-      unsigned int b = offset + nrow * ncol * 2;
-      *uc++ = 0;
-      for (unsigned int col = 0; col < ncol; col ++) {
-        *uc++ = (unsigned char)(v0[r] * scale_factor + round_offset);
-        *uc++ = (unsigned char)(v0[g] * scale_factor + round_offset);
-        *uc++ = (unsigned char)(v0[b] * scale_factor + round_offset);
-        r += nrow;
-        g += nrow;
-        b += nrow;
-      }
+private:
+  const RowFunc &rows;
+};
 
-      // Flush the buffer to file
-      if ((row + 1) % nrow_buffer == 0) {
-        write_IDAT(outfile, uc0, buffer_size, adler32,
-                   first_idat,          // first IDAT
-                   (row + 1) == nrow);  // final IDAT
-        first_idat = false;
-        uc = uc0;
-      }
-    }
-  } else {
-    // Write pixels in R's column-major ordering
-    for (unsigned int row = 0; row < nrow; row++) {
-      const unsigned int offset = flipy ? nrow - 1 - row : row;
-      double *r = v0 + ncol * offset;
-      double *g = v0 + ncol * offset + nrow * ncol;
-      double *b = v0 + ncol * offset + nrow * ncol * 2;
-      *uc++ = 0;
-      for (unsigned int col = 0; col < ncol; col ++) {
-        *uc++ = (unsigned char)(*r++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*g++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*b++ * scale_factor + round_offset);
-      }
 
-      // Flush the buffer to file
-      if ((row + 1) % nrow_buffer == 0) {
-        write_IDAT(outfile, uc0, buffer_size, adler32,
-                   first_idat,          // first IDAT
-                   (row + 1) == nrow);  // final IDAT
-        first_idat = false;
-        uc = uc0;
-      }
+template <class RowFunc>
+class BandedRows<RowFunc, true> {
+public:
+  BandedRows(const RowFunc &rows, size_t rowbytes, unsigned int nrow) :
+    rows(rows), rowbytes(rowbytes), band_rows(rows.band_rows()), end(nrow), first(0), n(0) {
+    if (band_rows > 1) {
+      band.resize(band_rows * rowbytes);
     }
   }
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Write final IDAT chunk ff there's any remaining data in the buffer
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (remainder_size > 0) {
-    write_IDAT(outfile, uc0, remainder_size, adler32, first_idat, true);
+  void set_end(unsigned int row_end) {
+    end = row_end;
   }
 
-  free(uc0);
+  void operator()(unsigned char *uc, unsigned int row) {
+    if (band_rows <= 1) {
+      rows(uc, row);
+      return;
+    }
+    if (row < first || row >= first + n) {
+      first = row;
+      n     = end - row < band_rows ? end - row : band_rows;
+      rows.fill_band(&band[0], rowbytes, first, n);
+    }
+    memcpy(uc, &band[(size_t)(row - first) * rowbytes], rowbytes);
+  }
+
+private:
+  const RowFunc             &rows;
+  size_t                     rowbytes;
+  unsigned int               band_rows;
+  unsigned int               end;    // rows at or past 'end' are not needed
+  unsigned int               first;  // rows [first, first + n) are in 'band'
+  unsigned int               n;
+  std::vector<unsigned char> band;
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A row functor for any pixel source (see pixels.h).  All 8 bit grey, RGB
+// and palette index rows come from here, and are banded whenever the pixel
+// source is.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template <class Pix>
+struct PixelRows {
+  Pix px;
+
+  void operator()(unsigned char *uc, unsigned int row) const {
+    px.fill(uc, 0, row, 1, 0, px.ncol);
+  }
+
+  unsigned int band_rows() const {
+    return Pix::BAND_ROWS;
+  }
+
+  void fill_band(unsigned char *uc, size_t ustride, unsigned int row, unsigned int n) const {
+    px.fill(uc, ustride, row, n, 0, px.ncol);
+  }
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Parallel encoding of uncompressed PNGs
+//
+// Each stored IDAT holds exactly one complete DEFLATE block, and the IDAT
+// boundaries are fixed in advance (every IDAT_BUDGET bytes of the stream),
+// so each stripe of IDATs can be generated, filtered and CRC32'd on its own.
+// A stripe generates every row which overlaps its part of the stream (and
+// the row above, for the filters).  Rows which straddle two stripes are
+// generated by both, so stripes are made at least STRIPE_MIN_ROWS rows
+// tall to keep this repeated work small.
+//
+// The only thing linking the stripes is the ADLER32 of the whole zlib
+// stream.  Each stripe's ADLER32 is calculated from scratch, and the results
+// are merged in order with adler32_combine() as the stripes are written.
+//
+// Worker threads take the next stripe number from a shared counter.  At
+// most 'nslot' stripes are in flight at once, so memory use stays at a
+// couple of stripes per thread regardless of image size.  The calling
+// thread writes the stripes to file strictly in order.
+//
+// The worker threads never touch the R API - 'fill_row' only reads from the
+// raw data array and writes into the stripe buffer.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+#define STRIPE_MIN_ROWS 8
+
+struct PngStripe {
+  unsigned char        *buf;
+  unsigned char        *data;     // start of this stripe's bytes within 'buf'
+  size_t                nbytes;
+  std::vector<uint32_t> crc32;    // one per IDAT: IDAT headers + data
+  uint32_t              adler32;  // this stripe's data only
+  bool                  ready;
+};
+
+
+template <class RowFunc>
+void write_png_rows_parallel(std::ostream &outfile, const RowFunc &fill_row,
+                             unsigned int nrow, size_t rowbytes,
+                             unsigned int bpp, int filter, unsigned int threads,
+                             int sequence) {
+
+  const size_t stride = rowbytes + 1;
+  const size_t total  = (size_t)nrow * stride;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Each stripe is a whole number of IDATs
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const size_t idat_per_stripe = (STRIPE_MIN_ROWS * stride + IDAT_BUDGET - 1) / IDAT_BUDGET;
+  const size_t stripe_bytes    = idat_per_stripe * IDAT_BUDGET;
+  const size_t nstripe         = (total + stripe_bytes - 1) / stripe_bytes;
+
+  if (threads > nstripe) {
+    threads = nstripe;
+  }
+  unsigned int nslot = 2 * threads;
+  if (nslot > nstripe) {
+    nslot = nstripe;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // One allocation for all the stripe buffers.  A stripe overlaps at most
+  // 'stripe_bytes/stride + 2' rows, and each slot has room for an extra row:
+  // the unfiltered row above the stripe, for the filters
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const size_t slot_rows  = stripe_bytes / stride + 2;
+  const size_t slot_bytes = slot_rows * stride + rowbytes;
+  unsigned char *uc0 = (unsigned char *) calloc(nslot * slot_bytes, sizeof(unsigned char));
+  if (!uc0) stop("write_png(): out of memory");
+
+  std::vector<PngStripe> slots(nslot);
+  for (unsigned int i = 0; i < nslot; i++) {
+    slots[i].buf   = uc0 + i * slot_bytes;
+    slots[i].ready = false;
+    slots[i].crc32.reserve(idat_per_stripe);
+  }
+
+  std::mutex              mtx;
+  std::condition_variable cv;
+  size_t next_stripe = 0;  // next stripe for a worker to start
+  size_t written     = 0;  // number of stripes written to file
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Worker: generate, filter and checksum whole stripes
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  auto worker = [&]() {
+    PngFilter png_filter(filter, rowbytes, bpp);
+    BandedRows<RowFunc> rows(fill_row, rowbytes, nrow);
+
+    for (;;) {
+      size_t k;
+      {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]{ return next_stripe >= nstripe || next_stripe < written + nslot; });
+        if (next_stripe >= nstripe) {
+          return;
+        }
+        k = next_stripe++;
+      }
+
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+      // This stripe is bytes [pos0, pos1) of the stream, which overlaps
+      // rows [row0, row1)
+      //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+      PngStripe &stripe = slots[k % nslot];
+      size_t pos0 = k * stripe_bytes;
+      size_t pos1 = pos0 + stripe_bytes < total ? pos0 + stripe_bytes : total;
+      unsigned int row0 = pos0 / stride;
+      unsigned int row1 = (pos1 - 1) / stride + 1;
+
+      stripe.nbytes = pos1 - pos0;
+      stripe.data   = stripe.buf + (pos0 - row0 * stride);
+      rows.set_end(row1);
+
+      // Up, Average and Paeth need the row above the first row in the stripe
+      if (filter >= PNG_FILTER_UP) {
+        unsigned char *above = stripe.buf + slot_rows * stride;
+        if (row0 == 0) {
+          memset(above, 0, rowbytes);
+        } else {
+          rows(above, row0 - 1);
+        }
+        png_filter.set_previous_row(above);
+      }
+
+      stripe.crc32.clear();
+      stripe.adler32 = 1;
+
+      unsigned char *uc = stripe.buf;
+      for (unsigned int row = row0; row < row1; row++) {
+        *uc = 0;
+        rows(uc + 1, row);
+        png_filter.apply(uc);
+
+        // Only checksum the part of the row which falls within this stripe
+        size_t start = (size_t)row * stride;
+        size_t end   = start + stride;
+        if (start < pos0) start = pos0;
+        if (end   > pos1) end   = pos1;
+        update_stored_checksums(stripe.data + (start - pos0), end - start, start, total,
+                                stripe.crc32, stripe.adler32, sequence);
+        uc += stride;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        stripe.ready = true;
+      }
+      cv.notify_all();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  try {
+    for (unsigned int i = 0; i < threads; i++) {
+      workers.push_back(std::thread(worker));
+    }
+  } catch (const std::system_error &) {
+    if (workers.empty()) {
+      free(uc0);
+      stop("write_png(): could not start threads");
+    }
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Writer: output the stripes in order, merging their ADLER32s.  All the
+  // IDATs in a stripe are written together.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  StoredIDATs idats;
+  uint32_t adler32 = 1;
+  for (size_t k = 0; k < nstripe; k++) {
+    PngStripe &stripe = slots[k % nslot];
+    {
+      std::unique_lock<std::mutex> lock(mtx);
+      cv.wait(lock, [&]{ return stripe.ready; });
+    }
+
+    adler32 = adler32_combine(adler32, stripe.adler32, stripe.nbytes);
+
+    size_t pos = k * stripe_bytes;
+    for (size_t i = 0; i < stripe.crc32.size(); i++) {
+      size_t len = IDAT_length(pos, total);
+      idats.add(stripe.data + i * IDAT_BUDGET, len,
+                adler32, stripe.crc32[i], pos == 0, pos + len == total,
+                IDAT_sequence(sequence, pos));
+      pos += len;
+    }
+    idats.write(outfile);
+
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stripe.ready = false;
+      written++;
+    }
+    cv.notify_all();
+  }
+
+  for (unsigned int i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  free(uc0);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Write all the image rows as IDAT chunks.
+//
+// 'fill_row(uc, row)' writes the 'rowbytes' bytes of pixel data for the
+// given output row to 'uc'.  Rows may be generated a band at a time (see
+// BandedRows).
+//
+// Compressed output is always written by a single thread, as the DEFLATE
+// stream carries state from one stripe to the next.
+//
+// A non-negative 'sequence' writes fdAT chunks for an APNG frame, numbered
+// from 'sequence' (see IDATStream)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template <class RowFunc>
+void write_png_rows(std::ostream &outfile, const RowFunc &fill_row,
+                    unsigned int nrow, size_t rowbytes, unsigned int bpp,
+                    int compression, int filter, int threads, int sequence = -1) {
+
+  if (threads > 1 && compression == DEFLATE_STORED) {
+    write_png_rows_parallel(outfile, fill_row, nrow, rowbytes, bpp, filter, threads, sequence);
+    return;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Rows are filtered and checksummed as they are generated, and written
+  // out in IDAT_BUDGET sized chunks
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  IDATStream idat(outfile, nrow, rowbytes, bpp, compression, filter, sequence);
+  BandedRows<RowFunc> rows(fill_row, rowbytes, nrow);
+
+  for (unsigned int row = 0; row < nrow; row++) {
+    unsigned char *uc = idat.begin_row();
+    rows(uc, row);
+    idat.end_row();
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Functor for with_pixels(): write the rows of a pixel source as IDATs
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct PngPixelWriter {
+  std::ostream &outfile;
+  int           compression;
+  int           filter;
+  int           threads;
+
+  template <class Pix>
+  void operator()(const Pix &px) const {
+    PixelRows<Pix> rows = { px };
+    write_png_rows(outfile, rows, px.nrow, (size_t)px.ncol * Pix::CHANNELS, Pix::CHANNELS,
+                   compression, filter, threads);
+  }
+};
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// ooooo oooooooooooo ooooo      ooo oooooooooo.
+// `888' `888'     `8 `888b.     `8' `888'   `Y8b
+//  888   888          8 `88b.    8   888      888
+//  888   888oooo8     8   `88b.  8   888      888
+//  888   888    "     8     `88b.8   888      888
+//  888   888       o  8       `888   888     d88'
+// o888o o888ooooood8 o8o        `8  o888bood8P'
+//
+//
+// - Write IEND chunk
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_IEND(std::ostream &outfile) {
+  unsigned char IEND[12] = {
+    0x00, 0x00, 0x00, 0x00,  // Data length for IEND is always 0
+    0x49, 0x45, 0x4E, 0x44,  // "IEND"
+    0xAe, 0x42, 0x60, 0x82   // CRC32 for "IEND"
+  };
+
+  outfile.write((const char *)&IEND[0], 12);
+}
+
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+//   .oooooo.
+//  d8P'  `Y8b
+// 888           oooo d8b  .ooooo.  oooo    ooo
+// 888           `888""8P d88' `88b  `88.  .8'
+// 888     ooooo  888     888ooo888   `88..8'
+// `88.    .88'   888     888    .o    `888'
+//  `Y8bood8P'   d888b    `Y8bod8P'     .8'
+//                                  .o..P'
+//                                  `Y8P'
+//
+//
+// - Generate a row of GREY data
+// - 16 bit samples are written big-endian by quantise16_be()
+// - 1, 2 and 4 bit samples (palette indices) are packed into bytes with the
+//   leftmost pixel in the high-order bits, as required by PNG
+// - Indices are clamped to the palette by 'scale', and NA values are written
+//   as 'scale.na' (the extra palette entry with 'na_transparent')
+// - Any other 8 bit rows come straight from a pixel source (see pixels.h
+//   and PixelRows)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct GreyRows {
+  const double *v0;
+  unsigned int  ncol;
+  unsigned int  nrow;
+  SampleScale   scale;
+  bool          convert_to_row_major;
+  bool          flipy;
+  unsigned int  bits;
+
+  void operator()(unsigned char *uc, unsigned int row) const {
+    const size_t offset  = flipy ? nrow - 1 - row : row;
+    const size_t vstride = convert_to_row_major ? nrow : 1;
+    const double *v = convert_to_row_major ? v0 + offset : v0 + ncol * offset;
+
+    if (bits == 16) {
+      quantise16_be(uc, 2, v, vstride, ncol, scale);
+      return;
+    }
+
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Quantise a chunk of the row at a time, then pack the indices
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    unsigned char q[256];
+
+    unsigned int acc = 0, nbits = 0;
+    for (unsigned int col0 = 0; col0 < ncol; col0 += sizeof(q)) {
+      const unsigned int m = ncol - col0 < sizeof(q) ? ncol - col0 : sizeof(q);
+      quantise8(q, 1, v, vstride, m, scale);
+      v += (size_t)m * vstride;
+      for (unsigned int k = 0; k < m; k++) {
+        acc = (acc << bits) | q[k];
+        nbits += bits;
+        if (nbits == 8) {
+          *uc++ = acc;
+          acc   = 0;
+          nbits = 0;
+        }
+      }
+    }
+    if (nbits) {
+      *uc = acc << (8 - nbits);
+    }
+  }
+};
+
+
+void write_png_grey_data(std::ostream &outfile,
+                         SEXP vec,
+                         const unsigned int ncol,
+                         const unsigned int nrow,
+                         const SampleScale &scale,
+                         const bool convert_to_row_major,
+                         const bool flipy,
+                         const int compression,
+                         const int filter,
+                         const int threads,
+                         const unsigned int bits) {
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Packed rows are rounded up to a whole byte. The filters always work
+  // on whole bytes, so 'bpp' is at least 1
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const size_t       rowbytes = ((size_t)ncol * bits + 7) / 8;
+  const unsigned int bpp      = bits < 8 ? 1 : bits / 8;
+
+  if (bits == 8) {
+    PixelData data = pixel_data(vec, nrow, ncol, scale);
+    PngPixelWriter writer = { outfile, compression, filter, threads };
+    with_pixels(writer, data, 1, convert_to_row_major, flipy);
+    return;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Get a pointer to the actual data in the supplied matrix.  Packed and
+  // 16 bit rows are made from doubles
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  NumericVector dvec = numeric_samples(vec);
+  GreyRows rows = {
+    (const double *)dvec.begin(), ncol, nrow,
+    scale, convert_to_row_major, flipy, bits
+  };
+
+  write_png_rows(outfile, rows, nrow, rowbytes, bpp, compression, filter, threads);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// ooo        ooooo                    oooo
+// `88.       .888'                    `888
+//  888b     d'888   .oooo.    .oooo.o  888  oooo
+//  8 Y88. .P  888  `P  )88b  d88(  "8  888 .8P'
+//  8  `888'   888   .oP"888  `"Y88b.   888888.
+//  8    Y     888  d8(  888  o.  )88b  888 `88b.
+// o8o        o888o `Y888""8o 8""888P' o888o o888o
+//
+//
+// - Generate a row of 1 bit data from a logical matrix
+// - 8 pixels per byte, leftmost pixel in the high-order bit
+// - NA is always 0 (black), with or without 'invert', as NA in numeric data
+//   is written as 'na_value' rather than inverted
+// - With 'na_transparent', each pixel is a 2 bit palette index instead:
+//   0 = FALSE, 1 = TRUE, 2 = NA
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct LogicalRows {
+  const int    *v0;
+  unsigned int  ncol;
+  unsigned int  nrow;
+  bool          invert;
+  bool          convert_to_row_major;
+  bool          flipy;
+  bool          na_transparent;
+
+  void operator()(unsigned char *uc, unsigned int row) const {
+    const size_t offset  = flipy ? nrow - 1 - row : row;
+    const size_t vstride = convert_to_row_major ? nrow : 1;
+    const int *v = convert_to_row_major ? v0 + offset : v0 + ncol * offset;
+
+    if (na_transparent) {
+      unsigned int acc = 0, nbits = 0;
+      for (unsigned int col = 0; col < ncol; col++) {
+        unsigned int idx = *v == NA_LOGICAL ? 2 : ((*v != 0) ^ invert);
+        acc = (acc << 2) | idx;
+        v += vstride;
+        nbits += 2;
+        if (nbits == 8) {
+          *uc++ = acc;
+          acc   = 0;
+          nbits = 0;
+        }
+      }
+      if (nbits) {
+        *uc = acc << (8 - nbits);
+      }
+      return;
+    }
+
+    const unsigned int flip = invert;
+
+    unsigned int col = 0;
+    for (; col + 8 <= ncol; col += 8) {
+      unsigned int acc = 0;
+      for (unsigned int k = 0; k < 8; k++) {
+        acc = (acc << 1) | ((*v != NA_LOGICAL) & ((*v != 0) ^ flip));
+        v += vstride;
+      }
+      *uc++ = acc;
+    }
+
+    if (col < ncol) {
+      unsigned int acc = 0;
+      for (unsigned int k = col; k < ncol; k++) {
+        acc = (acc << 1) | ((*v != NA_LOGICAL) & ((*v != 0) ^ flip));
+        v += vstride;
+      }
+      *uc = acc << (8 - (ncol - col));
+    }
+  }
+};
+
+
+void write_png_logical_data(std::ostream &outfile,
+                            const LogicalVector vec,
+                            const unsigned int ncol,
+                            const unsigned int nrow,
+                            const bool invert,
+                            const bool convert_to_row_major,
+                            const bool flipy,
+                            const int compression,
+                            const int filter,
+                            const int threads,
+                            const bool na_transparent) {
+
+  LogicalRows rows = {
+    (const int *)vec.begin(), ncol, nrow,
+    invert, convert_to_row_major, flipy, na_transparent
+  };
+
+  const unsigned int bits = na_transparent ? 2 : 1;
+  write_png_rows(outfile, rows, nrow, ((size_t)ncol * bits + 7) / 8, 1, compression, filter, threads);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// ooooooooo.     .oooooo.    oooooooooo.
+// `888   `Y88.  d8P'  `Y8b   `888'   `Y8b
+//  888   .d88' 888            888     888
+//  888ooo88P'  888            888oooo888'
+//  888`88b.    888     ooooo  888    `88b
+//  888  `88b.  `88.    .88'   888    .88P
+// o888o  o888o  `Y8bood8P'   o888bood8P'
+//
+//
+// - Generate a row of 16 bit RGB data
+// - Samples are written big-endian by quantise16_be(), one plane at a time,
+//   interleaved into the row with a 6 byte step
+// - 8 bit rows come straight from a pixel source (see pixels.h and
+//   PixelRows)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct RGBRows {
+  const double *v0;
+  unsigned int  ncol;
+  unsigned int  nrow;
+  SampleScale   scale;
+  bool          convert_to_row_major;
+  bool          flipy;
+
+  void operator()(unsigned char *uc, unsigned int row) const {
+    const size_t offset  = flipy ? nrow - 1 - row : row;
+    const size_t plane   = (size_t)nrow * ncol;
+    const double *v      = convert_to_row_major ? v0 + offset : v0 + ncol * offset;
+    const size_t vstride = convert_to_row_major ? nrow : 1;
+
+    // Red, Green and Blue values are in different array planes, but
+    // interleaved to be written consecutively
+    for (unsigned int p = 0; p < 3; p++) {
+      quantise16_be(uc + 2 * p, 6, v + plane * p, vstride, ncol, scale);
+    }
+  }
+};
+
+
+void write_png_RGB_data(std::ostream &outfile,
+                        SEXP vec,
+                        const unsigned int ncol,
+                        const unsigned int nrow,
+                        const SampleScale &scale,
+                        const bool convert_to_row_major,
+                        const bool flipy,
+                        const int compression,
+                        const int filter,
+                        const int threads,
+                        const unsigned int bits) {
+
+  const unsigned int depth = 3;
+  const unsigned int bpp   = depth * bits / 8;
+
+  if (bits == 8) {
+    PixelData data = pixel_data(vec, nrow, ncol, scale);
+    PngPixelWriter writer = { outfile, compression, filter, threads };
+    with_pixels(writer, data, depth, convert_to_row_major, flipy);
+    return;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Get a pointer to the actual data in the supplied matrix.  16 bit rows
+  // are made from doubles
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  NumericVector dvec = numeric_samples(vec);
+  RGBRows rows = {
+    (const double *)dvec.begin(), ncol, nrow,
+    scale, convert_to_row_major, flipy
+  };
+
+  write_png_rows(outfile, rows, nrow, (size_t)ncol * bpp, bpp, compression, filter, threads);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+//       .o.       ooooo        ooooooooo.   ooooo   ooooo       .o.
+//      .888.      `888'        `888   `Y88. `888'   `888'      .888.
+//     .8"888.      888          888   .d88'  888     888      .8"888.
+//    .8' `888.     888          888ooo88P'   888ooooo888     .8' `888.
+//   .88ooo8888.    888          888          888     888    .88ooo8888.
+//  .8'     `888.   888       o  888          888     888   .8'     `888.
+// o88o     o8888o o888ooooood8 o888o        o888o   o888o o88o     o8888o
+//
+//
+// - Generate a row of grey+alpha or RGBA data
+// - 'depth' is the number of planes in the data:
+//      1 = grey, 2 = grey+alpha, 3 = RGB, 4 = RGBA
+//   Grey and RGB data get an opaque alpha channel added.
+// - The alpha plane (if any) is not inverted or intensity scaled
+// - With 'na_transparent', a pixel with NA in any plane gets an alpha of 0
+// - 8 bit rows converted to row-major order are generated a band at a time
+//   by fill_band() (see BandedRows), unless NAs need checking
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct AlphaRows {
+  const double *v0;
+  unsigned int  ncol;
+  unsigned int  nrow;
+  SampleScale   scale;
+  SampleScale   alpha_scale;
+  bool          convert_to_row_major;
+  bool          flipy;
+  unsigned int  bits;
+  unsigned int  depth;
+  bool          na_transparent;
+
+  void operator()(unsigned char *uc, unsigned int row) const {
+    const size_t offset  = flipy ? nrow - 1 - row : row;
+    const size_t vstride = convert_to_row_major ? nrow : 1;
+    const size_t plane   = (size_t)nrow * ncol;
+    const double *v = convert_to_row_major ? v0 + offset : v0 + ncol * offset;
+
+    const bool         has_alpha = depth == 2 || depth == 4;
+    const unsigned int ncolour   = has_alpha ? depth - 1 : depth;
+    const unsigned int nchannel  = ncolour + 1;
+
+    if (bits == 16) {
+      const size_t step = 2 * nchannel;
+      for (unsigned int p = 0; p < ncolour; p++) {
+        quantise16_be(uc + 2 * p, step, v + plane * p, vstride, ncol, scale);
+      }
+
+      unsigned char *alpha = uc + 2 * ncolour;
+      if (has_alpha) {
+        quantise16_be(alpha, step, v + plane * ncolour, vstride, ncol, alpha_scale);
+      } else {
+        for (unsigned int col = 0; col < ncol; col++) {
+          alpha[col * step    ] = 0xFF;
+          alpha[col * step + 1] = 0xFF;
+        }
+      }
+
+      if (na_transparent) {
+        for (unsigned int col = 0; col < ncol; col++) {
+          for (unsigned int p = 0; p < depth; p++) {
+            if (ISNAN(v[col * vstride + plane * p])) {
+              alpha[col * step    ] = 0;
+              alpha[col * step + 1] = 0;
+              break;
+            }
+          }
+        }
+      }
+      return;
+    }
+
+    for (unsigned int p = 0; p < ncolour; p++) {
+      quantise8(uc + p, nchannel, v + plane * p, vstride, ncol, scale);
+    }
+
+    unsigned char *alpha = uc + ncolour;
+    if (has_alpha) {
+      quantise8(alpha, nchannel, v + plane * ncolour, vstride, ncol, alpha_scale);
+    } else {
+      for (unsigned int col = 0; col < ncol; col++) {
+        alpha[col * nchannel] = 255;
+      }
+    }
+
+    if (na_transparent) {
+      for (unsigned int col = 0; col < ncol; col++) {
+        for (unsigned int p = 0; p < depth; p++) {
+          if (ISNAN(v[col * vstride + plane * p])) {
+            alpha[col * nchannel] = 0;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  unsigned int band_rows() const {
+    return (convert_to_row_major && bits == 8 && !na_transparent) ? QUANTISE_BAND_ROWS : 1;
+  }
+
+  void fill_band(unsigned char *uc, size_t ustride, unsigned int row, unsigned int n) const {
+    const size_t    src     = flipy ? nrow - row - n : row;
+    const size_t    plane   = (size_t)nrow * ncol;
+    const ptrdiff_t ostride = flipy ? -(ptrdiff_t)ustride : (ptrdiff_t)ustride;
+    unsigned char  *out     = flipy ? uc + (size_t)(n - 1) * ustride : uc;
+
+    const bool         has_alpha = depth == 2 || depth == 4;
+    const unsigned int ncolour   = has_alpha ? depth - 1 : depth;
+    const unsigned int nchannel  = ncolour + 1;
+
+    for (unsigned int p = 0; p < ncolour; p++) {
+      quantise8_rows(out + p, ostride, nchannel, v0 + src + plane * p, nrow, n, ncol, scale);
+    }
+
+    if (has_alpha) {
+      quantise8_rows(out + ncolour, ostride, nchannel, v0 + src + plane * ncolour, nrow, n, ncol,
+                     alpha_scale);
+    } else {
+      for (unsigned int k = 0; k < n; k++) {
+        unsigned char *alpha = uc + k * ustride + ncolour;
+        for (unsigned int col = 0; col < ncol; col++) {
+          alpha[col * nchannel] = 255;
+        }
+      }
+    }
+  }
+};
+
+
+void write_png_alpha_data(std::ostream &outfile,
+                          const NumericVector vec,
+                          const unsigned int ncol,
+                          const unsigned int nrow,
+                          const unsigned int depth,
+                          const SampleScale &scale,
+                          const SampleScale &alpha_scale,
+                          const bool convert_to_row_major,
+                          const bool flipy,
+                          const int compression,
+                          const int filter,
+                          const int threads,
+                          const unsigned int bits,
+                          const bool na_transparent) {
+
+  const unsigned int nchannel = (depth == 2 || depth == 4) ? depth : depth + 1;
+  const unsigned int bpp      = nchannel * bits / 8;
+
+  AlphaRows rows = {
+    (const double *)vec.begin(), ncol, nrow,
+    scale, alpha_scale, convert_to_row_major, flipy,
+    bits, depth, na_transparent
+  };
+
+  write_png_rows(outfile, rows, nrow, (size_t)ncol * bpp, bpp, compression, filter, threads);
+}
+
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Exact size in bytes of a PNG written with uncompressed IDATs:
+//   signature + IHDR + [PLTE] + [tRNS] + IDATs + IEND
+//
+// 'rowbytes' does not include the filter-type byte. 'ncolour' is the number
+// of palette entries (0 = no palette).  Compressed output is (nearly always)
+// smaller, so this is also the first guess for the size of an output buffer.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+size_t png_stored_size(unsigned int nrow, size_t rowbytes, unsigned int ncolour, bool has_tRNS) {
+  const size_t total = (size_t)nrow * (rowbytes + 1);
+  const size_t nidat = (total + IDAT_BUDGET - 1) / IDAT_BUDGET;
+
+  size_t size = 8 + 25 + 12;
+  if (ncolour > 0) {
+    size += 12 + 3 * ncolour;
+  }
+  if (has_tRNS) {
+    size += 12 + ncolour;
+  }
+
+  // Each IDAT: length + "IDAT" + CRC32 + DEFLATE header.  Plus the zlib
+  // header and ADLER32 for the whole stream
+  return size + total + nidat * (12 + 5) + 2 + 4;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Smallest PNG bit depth which can index all the colours in a palette
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+unsigned int palette_bit_depth(unsigned int ncolours) {
+  if (ncolours <=  2) return 1;
+  if (ncolours <=  4) return 2;
+  if (ncolours <= 16) return 4;
+  return 8;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' Write a numeric matrix or array to a PNG file
+//'
+//' Write a numeric matrix or array to a PNG file
+//'
+//'
+//' Write a numeric matrix or array to a PNG file as fast as possible - meaning
+//' that corners are cut to make it happen quickly:
+//'
+//' \itemize{
+//' \item{Data is not compressed by default.}
+//' \item{Matrix or array must be of type \code{numeric}}
+//' }
+//'
+//' Design decisions
+//'
+//' \itemize{
+//' \item{no PNG pixel filtering by default. See \code{filter} argument}
+//' \item{no compression by default. See \code{compression} argument}
+//' \item{each IDAT contains one-and-only-one deflate block (when uncompressed).  This is purely for
+//'    my convenience. Most other PNG writers have the IDAT and DEFLATE blocks
+//'    update independently i.e. usually 1 DEFLATE block would span multiple IDATs.
+//'    By having a one-to-one correspondence between DEFLATE blocks and IDAT
+//'    chunks, the complexity of the code is greatly reduced.  Every block holds
+//'    65535 bytes of row data (except the last), so rows may be split across
+//'    blocks and there is no limit on image width}
+//' \item{All DEFLATE windows are hard-coded to the maximum size of 32kb. Varying
+//'    the specified window size might be useful on embedded systems with little
+//'    memory, but not for this use case.}
+//' }
+//'
+//' @param vec numeric 2d matrix, or 3d array with 2 (grey+alpha), 3 (RGB)
+//'        or 4 (RGBA) planes, or a logical matrix. Logical matrices are written
+//'        as 1 bit per pixel (TRUE = white, FALSE or NA = black, or the 2
+//'        colours in \code{pal}; \code{invert} swaps TRUE and FALSE but leaves
+//'        NA black). Integer, raw and float32 grey and RGB data
+//'        is read in place
+//' @param dims integer vector of length 2 i.e. \code{c(nrow, ncol)} for a matrix/grey image and of
+//'        length 3 i.e \code{c(nrow, ncol, 3)} for array/RGB output.
+//' @param filename output filename e.g. "example.png", an R connection or a
+//'        file descriptor (e.g. 1 for stdout). If NULL, the PNG is returned
+//'        as a raw vector instead.
+//' @param convert_to_row_major Convert to row-major order before output. R stores matrix
+//'        and array data in column-major order. In order to output row-major order (as
+//'        expected by PGM/PPM image format) data ordering must be converted. If this argument
+//'        is set to FALSE, then image output will be faster (due to fewer data-ordering operations, and
+//'        better cache coherency) but the image will be transposed. Default: TRUE
+//' @param flipy By default, the position [0, 0] is considered the top-left corner of the output image.
+//'        Set flipy = TRUE for [0, 0] to represent the bottom-left corner.  This operation
+//'        is very fast and has negligible impact on overall write speed.
+//'        Default: flipy = FALSE.
+//' @param invert invert all the pixel brightness values - as if the image were
+//'        converted into a negative. Dark areas become bright and bright areas become dark.
+//'        Default: FALSE
+//' @param intensity_factor Multiplication factor applied to all values in image
+//'        (values which end up outside [0, 1] are clamped to the ends of the scale).
+//'        If intensity_factor <= 0, then automatically determine (and apply) a multiplication factor
+//'        to set the maximum value to 1.0. Default: intensity_factor = 1.0
+//' @param pal integer matrix of size 256x3 with values in the range [0, 255]. Each
+//'        row represents the r, g, b colour for a given grey index value. Only used
+//'        if \code{data} is a matrix.  Palettes with at most 2, 4 or 16 colours
+//'        are written with 1, 2 or 4 bits per pixel.  An N x 4 matrix
+//'        includes an alpha value for each colour (written as a tRNS chunk).
+//' @param compression DEFLATE compression level. 0 = no compression (fastest, largest file),
+//'        1 = run-length encoding only, 2 = fast LZ77, 3 = balanced LZ77.
+//'        Default: 0
+//' @param filter PNG scanline filter applied to every row. 0 = none, 1 = sub,
+//'        2 = up, 3 = average, 4 = paeth, 5 = adaptive (choose the best filter
+//'        for each row). Filtering usually only helps when \code{compression > 0}.
+//'        Default: 0
+//' @param threads number of threads used to generate, filter and checksum
+//'        the image.  Only used for uncompressed output (\code{compression = 0}).
+//'        Default: 1
+//' @param bits bits per channel. 8 or 16.  16 bit images are written with
+//'        big-endian samples (as required by PNG) and can not use a palette
+//'        or logical matrix.  Default: 8
+//' @param na_transparent write NA values as fully transparent pixels.  Grey
+//'        and RGB images gain an alpha channel, and indexed images (including
+//'        logical matrices) gain a transparent palette entry.  Default: FALSE
+//' @param na_value the grey/RGB level in [0, 255] (or palette index) written
+//'        for NA and NaN values.  Values outside [0, 1] are always clamped
+//'        to the ends of the scale.  Not used for values which
+//'        \code{na_transparent} makes transparent palette entries.  Default: 0
+//'
+//' @return If \code{filename} is NULL, a raw vector containing the PNG.
+//'         Otherwise NULL.
+//'
+//'
+// [[Rcpp::export]]
+SEXP write_png_core(SEXP vec,
+                    const IntegerVector dims,
+                    SEXP filename,
+                    const bool convert_to_row_major = true,
+                    const bool flipy                = false,
+                    const bool invert               = false,
+                    const double intensity_factor   = 1,
+                    Rcpp::Nullable<Rcpp::IntegerMatrix> pal = R_NilValue,
+                    const int compression           = 0,
+                    const int filter                = 0,
+                    const int threads               = 1,
+                    const int bits                  = 8,
+                    const bool na_transparent       = false,
+                    const int na_value              = 0) {
+
+
+  unsigned int nrow = dims[0];
+  unsigned int ncol = dims[1];
+  unsigned int depth = 1;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Arrays may have 2 (grey+alpha), 3 (RGB) or 4 (RGBA) planes
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (dims.length() > 3 || (dims.length() == 3 && (dims[2] < 2 || dims[2] > 4))) {
+      stop("write_png(): If passing in an array, must have 2, 3 or 4 planes");
+  }
+  if (dims.length() == 3) {
+    depth = dims[2];
+  }
+
+  if (compression < DEFLATE_STORED || compression > DEFLATE_BALANCED) {
+    stop("write_png(): 'compression' must be in the range [0, 3]");
+  }
+
+  if (filter < PNG_FILTER_NONE || filter > PNG_FILTER_ADAPTIVE) {
+    stop("write_png(): 'filter' must be in the range [0, 5]");
+  }
+
+  if (threads < 1) {
+    stop("write_png(): 'threads' must be at least 1");
+  }
+
+  if (bits != 8 && bits != 16) {
+    stop("write_png(): 'bits' must be 8 or 16");
+  }
+
+  if (na_value < 0 || na_value > 255) {
+    stop("write_png(): 'na_value' must be in the range [0, 255]");
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Logical matrices are written as 1 bit per pixel.  Everything else is
+  // treated as numeric
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const bool is_logical = TYPEOF(vec) == LGLSXP;
+  if (is_logical) {
+    if (depth != 1) {
+      stop("write_png(): Logical data must be a matrix");
+    }
+    if (bits != 8) {
+      stop("write_png(): 'bits' can't be set for logical data");
+    }
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // If writing in column-major, swap 'nrow' and 'ncol'
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (!convert_to_row_major) {
+    unsigned int tmp = nrow;
+    nrow = ncol;
+    ncol = tmp;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Work out the palette (if any).
+  // A logical matrix with 'na_transparent' is always written as an indexed
+  // image: FALSE, TRUE and a transparent entry for NA.  Black and white
+  // are used if no palette was given.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  bool has_palette = pal.isNotNull();
+  Rcpp::IntegerMatrix pal_;
+  if (has_palette) {
+    if (depth != 1) {
+      stop("Can't have a palette unless depth = 1");
+    }
+    if (bits != 8) {
+      stop("write_png(): Can't have a palette unless bits = 8");
+    }
+    pal_ = Rcpp::IntegerMatrix(pal);
+    if (is_logical && pal_.nrow() != 2) {
+      stop("write_png(): Palette for logical data must have 2 colours");
+    }
+    if (na_transparent && pal_.nrow() >= 256) {
+      stop("write_png(): 'na_transparent' needs a spare palette entry. Palette must have fewer than 256 colours");
+    }
+    if (!is_logical && na_value >= pal_.nrow()) {
+      stop("write_png(): 'na_value' must be an index into the palette");
+    }
+  } else if (is_logical && na_transparent) {
+    has_palette = true;
+    pal_ = Rcpp::IntegerMatrix(2, 3);
+    pal_(1, 0) = pal_(1, 1) = pal_(1, 2) = 255;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Indexed images get an extra transparent palette entry for NA values.
+  // Grey and RGB images get an alpha channel.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const bool na_entry  = has_palette && na_transparent;
+  const bool has_alpha = depth == 2 || depth == 4 || (na_transparent && !has_palette);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // PNG colour type
+  //   0 = grey, 2 = RGB, 3 = indexed, 4 = grey+alpha, 6 = RGBA
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  unsigned int colour_type = (depth >= 3) ? 2 : 0;
+  unsigned int bit_depth   = bits;
+  if (has_alpha) {
+    colour_type += 4;
+  }
+  if (has_palette) {
+    colour_type = 3; // Indexed Palette PNG
+    bit_depth   = palette_bit_depth(pal_.nrow() + (na_entry ? 1 : 0));
+  }
+  if (is_logical && !has_palette) {
+    bit_depth = 1;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Open the output: a file, or a raw vector sized for uncompressed output.
+  // Uncompressed output is exactly this size
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const unsigned int channels[7] = {1, 0, 3, 1, 2, 0, 4};
+  const size_t rowbytes = ((size_t)ncol * channels[colour_type] * bit_depth + 7) / 8;
+  const unsigned int ncolour = has_palette ? pal_.nrow() + (na_entry ? 1 : 0) : 0;
+  const bool has_tRNS = has_palette && (na_entry || pal_.ncol() == 4);
+
+  ImageOutput output(filename, png_stored_size(nrow, rowbytes, ncolour, has_tRNS),
+                     compression == 0);
+  std::ostream &outfile = output.stream();
+
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Write PNG signature
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  write_PNG_signature(outfile);
+
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Write the IHDR chunk
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  write_IHDR(outfile, ncol, nrow, colour_type, bit_depth);
+
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Default scaling is to [0, 255], or [0, 65535] for 16 bits
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  double scale_factor = bits == 16 ? 65535.0 : 255.0;
+  unsigned int maxval = bits == 16 ? 65535 : 255;
+  const SampleScale alpha_scale(scale_factor, 0.5, false, maxval, 0);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // If a palette given, then write out a PLTE chunk, and a tRNS chunk if
+  // any of the colours are transparent.
+  // Also set the scale factor dependent upon the number of palette colours
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (has_palette) {
+    write_PLTE(outfile, pal_, na_entry);
+    if (has_tRNS) {
+      write_tRNS(outfile, pal_, na_entry);
+    }
+    scale_factor = pal_.nrow() - 1;
+    maxval       = pal_.nrow() - 1;
+  }
+
+  if (is_logical) {
+    write_png_logical_data(outfile, vec, ncol, nrow, invert, convert_to_row_major, flipy, compression, filter, threads, na_transparent);
+    write_IEND(outfile);
+    return output.close();
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Integer, logical and raw data is read in place by the 8-bit pixel
+  // pipeline (see samples.h)
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  RObject samples = pixel_samples(vec);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Scale the intensity
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (intensity_factor <= 0) {
+    double max_value = max_sample(samples);
+    if (max_value == 0) {
+      max_value = 1;
+    }
+    scale_factor /= max_value;
+  } else {
+    scale_factor *= intensity_factor;
+  }
+
+  double round_offset = 0.5;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Invert the colours?
+  // Rounding offset is -1.5 so that values truncate to [-(maxval + 1), -1],
+  // which SampleScale's bias brings back to [maxval, 0]
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  if (invert) {
+    round_offset = -1.5;
+    scale_factor = -scale_factor;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Values outside the scale saturate, and NA becomes 'na_value' (scaled up
+  // to 16 bits), or the extra palette entry with 'na_transparent'
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const int na = na_entry ? pal_.nrow() : (bits == 16 ? na_value * 257 : na_value);
+  const SampleScale scale(scale_factor, round_offset, invert, maxval, na);
+
+
+  if (has_alpha) {
+    write_png_alpha_data(outfile, numeric_samples(samples), ncol, nrow, depth, scale, alpha_scale, convert_to_row_major, flipy, compression, filter, threads, bits, na_transparent);
+  } else if (depth == 1) {
+    write_png_grey_data(outfile, samples, ncol, nrow, scale, convert_to_row_major, flipy, compression, filter, threads, bit_depth);
+  } else {
+    write_png_RGB_data (outfile, samples, ncol, nrow, scale, convert_to_row_major, flipy, compression, filter, threads, bits);
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // IEND
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  write_IEND(outfile);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Close the file, or return the raw vector
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  return output.close();
+
+}
+
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+//       .o.       ooooooooo.   ooooo      ooo   .oooooo.
+//      .888.      `888   `Y88. `888b.     `8'  d8P'  `Y8b
+//     .8"888.      888   .d88'  8 `88b.    8  888
+//    .8' `888.     888ooo88P'   8   `88b.  8  888
+//   .88ooo8888.    888          8     `88b.8  888     ooooo
+//  .8'     `888.   888          8       `888  `88.    .88'
+// o88o     o8888o o888o        o8o        `8   `Y8bood8P'
+//
+//
+// Animated PNG - Reference: https://wiki.mozilla.org/APNG_Specification
+//
+// - acTL (animation control) comes before the first IDAT
+// - Each frame is an fcTL (frame control) chunk followed by the frame data
+// - The first frame is the ordinary IDAT image, so viewers which don't
+//   understand APNG still show something
+// - Later frames are fdAT chunks: exactly like IDATs, but with a sequence
+//   number at the start (see make_IDAT_header())
+// - fcTL and fdAT chunks share one sequence, starting at 0
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+static inline void put_uint32(unsigned char *p, uint32_t x) {
+  p[0] = (x >> 24) & 0xFF;
+  p[1] = (x >> 16) & 0xFF;
+  p[2] = (x >>  8) & 0xFF;
+  p[3] = (x      ) & 0xFF;
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// - Write acTL chunk
+// - 'num_plays' = 0 means loop forever
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_acTL(std::ostream &outfile, unsigned int num_frames, unsigned int num_plays) {
+  unsigned char acTL[12] = {
+    0x61, 0x63, 0x54, 0x4c  // "acTL"
+  };
+  put_uint32(&acTL[4], num_frames);
+  put_uint32(&acTL[8], num_plays);
+
+  uint32_t data_length = bswap32(8);
+  outfile.write(reinterpret_cast<const char *>(&data_length), sizeof(data_length));
+
+  outfile.write((const char *)&acTL[0], 12);
+  uint32_t crc32 = crc32_fast(&acTL[0], 12, 0);
+
+  crc32 = bswap32(crc32);
+  outfile.write(reinterpret_cast<const char *>(&crc32), sizeof(crc32));
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// The region of the canvas covered by a frame
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct FrameBox {
+  unsigned int x0, y0;
+  unsigned int width, height;
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// - Write fcTL chunk
+// - The frame delay is 'delay_ms' milliseconds
+// - dispose_op = 0 (NONE): the canvas is left as it is after the frame
+// - blend_op   = 0 (SOURCE): the frame replaces the canvas within its box
+//   So a frame only needs to cover the pixels which have changed.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void write_fcTL(std::ostream &outfile, unsigned int sequence, const FrameBox &box,
+                unsigned int delay_ms) {
+  unsigned char fcTL[30] = {
+    0x66, 0x63, 0x54, 0x4c  // "fcTL"
+  };
+  put_uint32(&fcTL[ 4], sequence);
+  put_uint32(&fcTL[ 8], box.width);
+  put_uint32(&fcTL[12], box.height);
+  put_uint32(&fcTL[16], box.x0);
+  put_uint32(&fcTL[20], box.y0);
+  fcTL[24] = (delay_ms >> 8) & 0xFF;  // delay numerator
+  fcTL[25] = (delay_ms     ) & 0xFF;
+  fcTL[26] = (1000 >> 8) & 0xFF;      // delay denominator
+  fcTL[27] = (1000     ) & 0xFF;
+  fcTL[28] = 0;                       // dispose_op
+  fcTL[29] = 0;                       // blend_op
+
+  uint32_t data_length = bswap32(26);
+  outfile.write(reinterpret_cast<const char *>(&data_length), sizeof(data_length));
+
+  outfile.write((const char *)&fcTL[0], 30);
+  uint32_t crc32 = crc32_fast(&fcTL[0], 30, 0);
+
+  crc32 = bswap32(crc32);
+  outfile.write(reinterpret_cast<const char *>(&crc32), sizeof(crc32));
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Bounding box of the pixels which differ between two frames, in output
+// image coordinates.
+//
+// The frames are compared in R's memory order (column by column), which is
+// the same whatever the output orientation.  Columns are compared with
+// memcmp(), so the unchanged parts of a frame are skipped over quickly.
+// Values are compared bit-for-bit, so e.g. 0 and -0 count as a change,
+// which only makes the box a little larger than it needs to be.
+//
+// 'size' is the size in bytes of each value, so that integer, raw and
+// float frames are compared in place too.
+//
+// If nothing has changed, the box is a single pixel (a frame can't be empty)
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+FrameBox changed_box(const void *cur, const void *prev, size_t size,
+                     unsigned int nrow, unsigned int ncol, unsigned int depth,
+                     bool convert_to_row_major, bool flipy) {
+
+  const size_t plane = (size_t)nrow * ncol;
+  unsigned int imin = nrow, imax = 0;
+  unsigned int jmin = ncol, jmax = 0;
+
+  for (unsigned int p = 0; p < depth; p++) {
+    for (unsigned int j = 0; j < ncol; j++) {
+      const size_t offset    = (plane * p + (size_t)nrow * j) * size;
+      const unsigned char *a = (const unsigned char *)cur  + offset;
+      const unsigned char *b = (const unsigned char *)prev + offset;
+      if (memcmp(a, b, nrow * size) == 0) {
+        continue;
+      }
+      unsigned int i0 = 0, i1 = nrow - 1;
+      while (memcmp(a + i0 * size, b + i0 * size, size) == 0) i0++;
+      while (memcmp(a + i1 * size, b + i1 * size, size) == 0) i1--;
+      if (i0 < imin) imin = i0;
+      if (i1 > imax) imax = i1;
+      if (j  < jmin) jmin = j;
+      if (j  > jmax) jmax = j;
+    }
+  }
+
+  if (imin > imax) {
+    FrameBox box = {0, 0, 1, 1};
+    return box;
+  }
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // R rows become image rows when converting to row-major. Otherwise
+  // R columns become image rows.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  unsigned int ymin = imin, ymax = imax, height = nrow;
+  unsigned int xmin = jmin, xmax = jmax;
+  if (!convert_to_row_major) {
+    ymin = jmin; ymax = jmax; height = ncol;
+    xmin = imin; xmax = imax;
+  }
+  if (flipy) {
+    unsigned int tmp = ymin;
+    ymin = height - 1 - ymax;
+    ymax = height - 1 - tmp;
+  }
+
+  FrameBox box = {xmin, ymin, xmax - xmin + 1, ymax - ymin + 1};
+  return box;
 }
 
 
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Generate the rows of a frame which fall within 'box'.
+//
+// The row functors only generate whole rows, so if the box is narrower than
+// the image, a whole row is generated into 'scratch' and the box part copied
+// out.  'scratch' and the band of rows are shared between calls, so this is
+// single threaded only.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template <class RowFunc>
+struct CroppedRows {
+  BandedRows<RowFunc> &rows;
+  unsigned int   y0;
+  size_t         x0_bytes;
+  size_t         rowbytes;   // bytes in a cropped row
+  unsigned char *scratch;    // room for a whole row. NULL if the box is full width
+
+  void operator()(unsigned char *uc, unsigned int row) const {
+    if (!scratch) {
+      rows(uc, y0 + row);
+      return;
+    }
+    rows(scratch, y0 + row);
+    memcpy(uc, scratch + x0_bytes, rowbytes);
+  }
+};
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-//' Write a numeric matrix or array to a PNG file
-//'
-//' Write a numeric matrix or array to a PNG file
-//'
-//'
-//' Write a numeric matrix or array to a PNG file as fast as possible - meaning
-//' that corners are cut to make it happen quickly:
-//'
-//' \itemize{
-//' \item{Data is not compressed.}
-//' \item{Matrix or array must be of type \code{numeric}}
-//' }
-//'
-//' Design decisions
-//'
-//' \itemize{
-//' \item{no PNG pixel filtering}
-//' \item{no compression}
-//' \item{each IDAT contains one-and-only-one deflate block.  This is purely for
-//'    my convenience. Most other PNG writers have the IDAT and DEFLATE blocks
-//'    update independently i.e. usually 1 DEFLATE block would span multiple IDATs.
-//'    By having a one-to-one correspondence between DEFLATE blocks and IDAT
-//'    chunks, the complexity of the code is greatly reduced}
-//' \item{All DEFLATE windows are hard-coded to the maximum size of 32kb. Varying
-//'    the specified window size might be useful on embedded systems with little
-//'    memory, but not for this use case.}
-//' }
+// Write a single APNG frame: the fcTL chunk and then the data for the part
+// of the frame within 'box'.  The first frame is written as IDATs, and must
+// cover the whole image.  Later frames are fdATs.
+//
+// 'sequence' is the next APNG sequence number, and is updated.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template <class RowFunc>
+void write_apng_frame(std::ostream &outfile, const RowFunc &rows, unsigned int ncol,
+                      unsigned int bpp, const FrameBox &box, unsigned int delay_ms,
+                      bool first_frame, int &sequence, int compression, int filter) {
+
+  write_fcTL(outfile, sequence++, box, delay_ms);
+
+  const size_t rowbytes = (size_t)box.width * bpp;
+  std::vector<unsigned char> scratch;
+  if (box.width < ncol) {
+    scratch.resize((size_t)ncol * bpp);
+  }
+
+  BandedRows<RowFunc> banded(rows, (size_t)ncol * bpp, box.y0 + box.height);
+  CroppedRows<RowFunc> cropped = {
+    banded, box.y0, (size_t)box.x0 * bpp, rowbytes,
+    scratch.empty() ? NULL : &scratch[0]
+  };
+
+  if (first_frame) {
+    write_png_rows(outfile, cropped, box.height, rowbytes, bpp, compression, filter, 1);
+  } else {
+    write_png_rows(outfile, cropped, box.height, rowbytes, bpp, compression, filter, 1, sequence);
+
+    // One fdAT for every IDAT_BUDGET bytes of the frame
+    size_t total = (size_t)box.height * (rowbytes + 1);
+    sequence += (total + IDAT_BUDGET - 1) / IDAT_BUDGET;
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Functor for with_pixels(): write_apng_frame() for a pixel source
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct ApngFrameWriter {
+  std::ostream   &outfile;
+  const FrameBox &box;
+  unsigned int    delay_ms;
+  bool            first_frame;
+  int            &sequence;
+  int             compression;
+  int             filter;
+
+  template <class Pix>
+  void operator()(const Pix &px) const {
+    PixelRows<Pix> rows = { px };
+    write_apng_frame(outfile, rows, px.ncol, Pix::CHANNELS, box, delay_ms, first_frame,
+                     sequence, compression, filter);
+  }
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' Write a sequence of frames to an animated PNG (APNG) file
 //'
-//' @param vec numeric 2d matrix or 3d array (with 3 planes)
-//' @param dims integer vector of length 2 i.e. \code{c(nrow, ncol)} for a matrix/grey image and of
-//'        length 3 i.e \code{c(nrow, ncol, 3)} for array/RGB output.
-//' @param filename output filename e.g. "example.ppm"
-//' @param convert_to_row_major Convert to row-major order before output. R stores matrix
-//'        and array data in column-major order. In order to output row-major order (as
-//'        expected by PGM/PPM image format) data ordering must be converted. If this argument
-//'        is set to FALSE, then image output will be faster (due to fewer data-ordering operations, and
-//'        better cache coherency) but the image will be transposed. Default: TRUE
-//' @param flipy By default, the position [0, 0] is considered the top-left corner of the output image.
-//'        Set flipy = TRUE for [0, 0] to represent the bottom-left corner.  This operation
-//'        is very fast and has negligible impact on overall write speed.
-//'        Default: flipy = FALSE.
-//' @param invert invert all the pixel brightness values - as if the image were
-//'        converted into a negative. Dark areas become bright and bright areas become dark.
-//'        Default: FALSE
-//' @param intensity_factor Multiplication factor applied to all values in image
-//'        (note: no checking is performed to ensure values remain in range [0, 1]).
-//'        If intensity_factor <= 0, then automatically determine (and apply) a multiplication factor
-//'        to set the maximum value to 1.0. Default: intensity_factor = 1.0
-//' @param pal integer matrix of size 256x3 with values in the range [0, 255]. Each
-//'        row represents the r, g, b colour for a given grey index value. Only used
-//'        if \code{data} is a matrix
+//' @param frames either a numeric array holding all the frames, with the
+//'        frame number as the last dimension, or an R function which takes
+//'        the frame number (starting at 1) and returns that frame as a
+//'        numeric matrix (or array with 3 planes for RGB)
+//' @param dims dimensions of a single frame i.e. \code{c(nrow, ncol)} for
+//'        grey frames and \code{c(nrow, ncol, 3)} for RGB frames.
+//'        Ignored if \code{frames} is a function, as the dimensions are
+//'        taken from the first frame it returns.
+//' @param nframes number of frames
+//' @param filename output filename e.g. "example.png", an R connection or a
+//'        file descriptor (e.g. 1 for stdout). If NULL, the APNG is returned
+//'        as a raw vector instead.
+//' @param delay frame delay in seconds. Either a single value for all frames,
+//'        or one value per frame. At most 65.535 seconds.
+//' @param loops number of times to play the animation. 0 = loop forever
+//' @param crop only write the part of each frame which has changed since the
+//'        previous frame.  Frames are compared value-for-value before scaling.
+//' @param convert_to_row_major,flipy,invert,intensity_factor,compression,filter
+//'        See \code{write_png_core}. \code{intensity_factor <= 0} scales by
+//'        the maximum value over all frames, and so can't be used when
+//'        \code{frames} is a function.
+//' @param pal integer matrix with 3 (RGB) or 4 (RGBA) columns and at most 256
+//'        rows. Only used for grey frames.  Always written with 8 bits per pixel.
+//' @param na_value the grey/RGB level in [0, 255] (or palette index) written
+//'        for NA and NaN values.  Default: 0
 //'
+//' @return If \code{filename} is NULL, a raw vector containing the APNG.
+//'         Otherwise NULL.
 //'
 //'
 // [[Rcpp::export]]
-void write_png_core(const NumericVector vec,
-                    const IntegerVector dims,
-                    const std::string filename,
-                    const bool convert_to_row_major = true,
-                    const bool flipy                = false,
-                    const bool invert               = false,
-                    const double intensity_factor   = 1,
-                    Rcpp::Nullable<Rcpp::IntegerMatrix> pal = R_NilValue) {
-
-
-  unsigned int nrow = dims[0];
-  unsigned int ncol = dims[1];
-  unsigned int depth = 1;
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Check that the third dimensions is 3
-  // ToDo: Tidy this.
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (dims.length() > 3 || (dims.length() == 3 && dims[2] != 3)) {
-      stop("write_png(): If passing in an array, must have 3 planes");
+SEXP write_apng_core(SEXP frames,
+                     Rcpp::Nullable<Rcpp::IntegerVector> dims,
+                     const int nframes,
+                     SEXP filename,
+                     const NumericVector delay,
+                     const int loops                 = 0,
+                     const bool crop                 = true,
+                     const bool convert_to_row_major = true,
+                     const bool flipy                = false,
+                     const bool invert               = false,
+                     const double intensity_factor   = 1,
+                     Rcpp::Nullable<Rcpp::IntegerMatrix> pal = R_NilValue,
+                     const int compression           = 0,
+                     const int filter                = 0,
+                     const int na_value              = 0) {
+
+  const bool is_callback = Rf_isFunction(frames);
+
+  if (nframes < 1) {
+    stop("write_apng(): Must have at least 1 frame");
   }
-  if (dims.length() == 3) {
-    depth = 3;
+  if (delay.length() != 1 && delay.length() != nframes) {
+    stop("write_apng(): 'delay' must be a single value or have one value per frame");
+  }
+  for (int i = 0; i < delay.length(); i++) {
+    if (!(delay[i] >= 0 && delay[i] <= 65.535)) {
+      stop("write_apng(): 'delay' must be in the range [0, 65.535] seconds");
+    }
+  }
+  if (loops < 0) {
+    stop("write_apng(): 'loops' must not be negative");
+  }
+  if (compression < DEFLATE_STORED || compression > DEFLATE_BALANCED) {
+    stop("write_apng(): 'compression' must be in the range [0, 3]");
+  }
+  if (filter < PNG_FILTER_NONE || filter > PNG_FILTER_ADAPTIVE) {
+    stop("write_apng(): 'filter' must be in the range [0, 5]");
+  }
+  if (is_callback && intensity_factor <= 0) {
+    stop("write_apng(): 'intensity_factor' must be positive when 'frames' is a function");
+  }
+  if (na_value < 0 || na_value > 255) {
+    stop("write_apng(): 'na_value' must be in the range [0, 255]");
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // If writing in column-major, swap 'nrow' and 'ncol'
+  // Frames from a function are fetched one at a time.  Only the current
+  // and previous frames are kept, for working out what has changed.
+  // Integer, logical, raw and float32 frames are read in place by the 8-bit
+  // pixel pipeline (see samples.h)
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (!convert_to_row_major) {
-    unsigned int tmp = nrow;
-    nrow = ncol;
-    ncol = tmp;
+  RObject all, cur, prev;
+  IntegerVector frame_dims;
+
+  if (is_callback) {
+    cur             = pixel_samples(Rcpp::Function(frames)(1));
+    SEXP first_dims = Rf_getAttrib(sample_vector(cur), R_DimSymbol);
+    if (Rf_isNull(first_dims)) {
+      stop("write_apng(): Each frame must be a matrix or array");
+    }
+    frame_dims      = IntegerVector(first_dims);
+  } else {
+    if (dims.isNull()) {
+      stop("write_apng(): 'dims' must be given for an array of frames");
+    }
+    frame_dims = IntegerVector(dims);
+    all = pixel_samples(frames);
   }
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Open stream
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  std::ofstream outfile;
-  outfile.open(filename, std::ios::out | std::ios::binary);
+  if (frame_dims.length() < 2 || frame_dims.length() > 3 ||
+      (frame_dims.length() == 3 && frame_dims[2] != 3)) {
+    stop("write_apng(): Each frame must be a matrix, or an array with 3 planes");
+  }
+
+  const unsigned int data_nrow = frame_dims[0];
+  const unsigned int data_ncol = frame_dims[1];
+  const unsigned int depth     = frame_dims.length() == 3 ? 3 : 1;
+  const size_t frame_size      = (size_t)data_nrow * data_ncol * depth;
 
+  if (frame_size == 0) {
+    stop("write_apng(): Frames must not be empty");
+  }
+  if (!is_callback && (size_t)XLENGTH(sample_vector(all)) != frame_size * nframes) {
+    stop("write_apng(): Array size does not match 'dims' and 'nframes'");
+  }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Write PNG signature
+  // If writing in column-major, swap 'nrow' and 'ncol'
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  write_PNG_signature(outfile);
-
+  unsigned int nrow = data_nrow;
+  unsigned int ncol = data_ncol;
+  if (!convert_to_row_major) {
+    nrow = data_ncol;
+    ncol = data_nrow;
+  }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Write the IHDR chunk
+  // Palette. Always 8 bits per pixel, so that frames can be cropped at any
+  // pixel and not just at byte boundaries
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  unsigned int colour_type = 0; // Grey by default
-  bool has_palette = pal.isNotNull();
-  if (depth == 3) {
-    colour_type = 2; // RGB
-  }
+  const bool has_palette = pal.isNotNull();
+  Rcpp::IntegerMatrix pal_;
   if (has_palette) {
     if (depth != 1) {
       stop("Can't have a palette unless depth = 1");
     }
-    colour_type = 3; // Indexed Palette PNG
+    pal_ = Rcpp::IntegerMatrix(pal);
+    if (na_value >= pal_.nrow()) {
+      stop("write_apng(): 'na_value' must be an index into the palette");
+    }
   }
-  write_IHDR(outfile, ncol, nrow, colour_type);
-
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Default scaling is to [0, 255]
+  // A raw vector starts out big enough for one uncompressed frame
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  double scale_factor = 255.0;
+  ImageOutput output(filename, png_stored_size(nrow, (size_t)ncol * depth, 0, false));
+  std::ostream &outfile = output.stream();
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // If a palette given, then write out a PLTE chunk.
-  // Also set the scale factor dependent upon the number of palette colours
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  write_PNG_signature(outfile);
+  write_IHDR(outfile, ncol, nrow, has_palette ? 3 : (depth == 3 ? 2 : 0), 8);
+  write_acTL(outfile, nframes, loops);
+
+  double scale_factor = 255.0;
+  unsigned int maxval = 255;
   if (has_palette) {
-    Rcpp::IntegerMatrix pal_(pal);
-    write_PLTE(outfile, pal_);
+    write_PLTE(outfile, pal_, false);
+    if (pal_.ncol() == 4) {
+      write_tRNS(outfile, pal_, false);
+    }
     scale_factor = pal_.nrow() - 1;
+    maxval       = pal_.nrow() - 1;
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Scale the intensity
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (intensity_factor <= 0) {
-    double *max_value = (double *)std::max_element(vec.begin(), vec.end());
-    if (*max_value == 0) {
-      *max_value = 1;
+    double max_value = max_sample(all);
+    if (max_value == 0) {
+      max_value = 1;
     }
-    scale_factor /= *max_value;
+    scale_factor /= max_value;
   } else {
     scale_factor *= intensity_factor;
   }
 
   double round_offset = 0.5;
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Invert the colours?
-  // Rounding offset is -1.5 in order to take advantage of the way a
-  // 'double' is truncated to an 'unsigned char'
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (invert) {
     round_offset = -1.5;
     scale_factor = -scale_factor;
   }
+  const SampleScale scale(scale_factor, round_offset, invert, maxval, na_value);
+
+  const FrameBox full = {0, 0, ncol, nrow};
+  int sequence = 0;
+
+  for (int k = 0; k < nframes; k++) {
+
+    if (is_callback && k > 0) {
+      prev = cur;
+      cur  = pixel_samples(Rcpp::Function(frames)(k + 1));
+      if ((size_t)XLENGTH(sample_vector(cur)) != frame_size) {
+        stop("write_apng(): Every frame must be the same size");
+      }
+    }
+
+    PixelData data = pixel_data(is_callback ? cur : all, nrow, ncol, scale);
+
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Frames can only be compared if they hold the same type of samples.
+    // A function could return e.g. a double frame after an integer one.
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    const void *v_prev = NULL;
+    if (is_callback) {
+      if (k > 0) {
+        PixelData data_prev = pixel_data(prev, nrow, ncol, scale);
+        if (data_prev.type == data.type) {
+          v_prev = data_prev.v0;
+        }
+      }
+    } else {
+      const size_t bytes = frame_size * sample_bytes(data.type);
+      data.v0 = (const unsigned char *)data.v0 + bytes * k;
+      if (k > 0) {
+        v_prev = (const unsigned char *)data.v0 - bytes;
+      }
+    }
+
+    FrameBox box = full;
+    if (crop && v_prev) {
+      box = changed_box(data.v0, v_prev, sample_bytes(data.type), data_nrow, data_ncol,
+                        depth, convert_to_row_major, flipy);
+    }
+
+    const double seconds  = delay[delay.length() == 1 ? 0 : k];
+    const unsigned int ms = (unsigned int)(seconds * 1000 + 0.5);
+
+    ApngFrameWriter writer = { outfile, box, ms, k == 0, sequence, compression, filter };
+    with_pixels(writer, data, depth, convert_to_row_major, flipy);
+  }
+
+  write_IEND(outfile);
+  return output.close();
+}
+
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// ooooo   ooooo                             .o8  oooo
+// `888'   `888'                            "888  `888
+//  888     888   .oooo.   ooo. .oo.    .oooo888   888   .ooooo.
+//  888ooooo888  `P  )88b  `888P"Y88b  d88' `888   888  d88' `88b
+//  888     888   .oP"888   888   888  888   888   888  888ooo888
+//  888     888  d8(  888   888   888  888   888   888  888    .o
+// o888o   o888o `Y888""8o o888o o888o `Y8bod88P" o888o `Y8bod8P'
+//
+//
+// - A PNG written a block of rows at a time (see image-writer.h)
+// - The IDATStream lives for the whole image, so the ADLER32, the CRC32 of
+//   the current IDAT, the DEFLATE state and the filter's previous row all
+//   carry over from one block to the next.  The output is identical to
+//   writing the whole image at once.
+// - Grey (optionally with a palette) and RGB, 8 or 16 bits.  Single threaded.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class PngWriter : public ImageWriter {
+public:
+  PngWriter(SEXP filename, unsigned int nrow, unsigned int ncol,
+            unsigned int depth, bool convert_to_row_major, const SampleScale &scale,
+            Rcpp::Nullable<Rcpp::IntegerMatrix> pal, int compression, int filter,
+            unsigned int bits);
+  ~PngWriter() { delete idat; }
+
+private:
+  IDATStream  *idat;
+  SampleScale  scale;
+  unsigned int bits;          // bits per sample in the file
+
+  void write_rows(SEXP block, unsigned int block_rows);
+  void write_trailer() { write_IEND(outfile); }
+};
+
+
+PngWriter::PngWriter(SEXP filename, unsigned int nrow, unsigned int ncol,
+                     unsigned int depth, bool convert_to_row_major, const SampleScale &scale,
+                     Rcpp::Nullable<Rcpp::IntegerMatrix> pal, int compression, int filter,
+                     unsigned int bits) :
+  ImageWriter(filename, nrow, ncol, depth, convert_to_row_major),
+  idat(NULL), scale(scale), bits(bits) {
+
+  write_PNG_signature(outfile);
+
+  if (pal.isNotNull()) {
+    Rcpp::IntegerMatrix pal_(pal);
+    this->bits = palette_bit_depth(pal_.nrow());
+    write_IHDR(outfile, ncol, nrow, 3, this->bits);
+    write_PLTE(outfile, pal_, false);
+    if (pal_.ncol() == 4) {
+      write_tRNS(outfile, pal_, false);
+    }
+  } else {
+    write_IHDR(outfile, ncol, nrow, depth == 3 ? 2 : 0, bits);
+  }
+
+  const size_t       rowbytes = ((size_t)ncol * depth * this->bits + 7) / 8;
+  const unsigned int bpp      = this->bits < 8 ? 1 : depth * this->bits / 8;
+
+  idat = new IDATStream(outfile, nrow, rowbytes, bpp, compression, filter);
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Append the rows of a block to the IDATStream
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template <class RowFunc>
+void append_png_rows(IDATStream &idat, const RowFunc &rows, unsigned int nrow, size_t rowbytes) {
+  BandedRows<RowFunc> banded(rows, rowbytes, nrow);
+  for (unsigned int row = 0; row < nrow; row++) {
+    banded(idat.begin_row(), row);
+    idat.end_row();
+  }
+}
+
+
+struct PngPixelAppender {
+  IDATStream &idat;
+
+  template <class Pix>
+  void operator()(const Pix &px) const {
+    PixelRows<Pix> rows = { px };
+    append_png_rows(idat, rows, px.nrow, (size_t)px.ncol * Pix::CHANNELS);
+  }
+};
+
+
+void PngWriter::write_rows(SEXP block, unsigned int block_rows) {
+  if (bits == 8) {
+    PixelData data = pixel_data(block, block_rows, ncol, scale);
+    PngPixelAppender appender = { *idat };
+    with_pixels(appender, data, depth, convert_to_row_major, false);
+    return;
+  }
 
+  NumericVector dvec = numeric_samples(block);
+  const double *v0       = dvec.begin();
+  const size_t  rowbytes = ((size_t)ncol * depth * bits + 7) / 8;
 
   if (depth == 1) {
-    write_png_grey_data(outfile, vec, ncol, nrow, scale_factor, round_offset, convert_to_row_major, flipy);
+    GreyRows rows = {
+      v0, ncol, block_rows, scale, convert_to_row_major, false, bits
+    };
+    append_png_rows(*idat, rows, block_rows, rowbytes);
   } else {
-    write_png_RGB_data (outfile, vec, ncol, nrow, scale_factor, round_offset, convert_to_row_major, flipy);
+    RGBRows rows = {
+      v0, ncol, block_rows, scale, convert_to_row_major, false
+    };
+    append_png_rows(*idat, rows, block_rows, rowbytes);
   }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' Open a PNG file to be written a block of rows at a time
+//'
+//' @param filename output filename, connection, file descriptor or NULL.
+//'        See \code{write_png_core}
+//' @param dims dimensions of the whole image as R data i.e. \code{c(nrow, ncol)}
+//'        for grey and \code{c(nrow, ncol, 3)} for RGB
+//' @param convert_to_row_major,invert,pal,compression,filter,bits,na_value
+//'        See \code{write_png_core}
+//' @param intensity_factor multiplication factor applied to all values.
+//'        Must be positive, as the maximum of the whole image is never known.
+//'
+//' @return external pointer to the writer
+//'
+//' @noRd
+// [[Rcpp::export(.png_writer_open)]]
+SEXP png_writer_open(SEXP filename,
+                     const IntegerVector dims,
+                     const bool convert_to_row_major = true,
+                     const bool invert               = false,
+                     const double intensity_factor   = 1,
+                     Rcpp::Nullable<Rcpp::IntegerMatrix> pal = R_NilValue,
+                     const int compression           = 0,
+                     const int filter                = 0,
+                     const int bits                  = 8,
+                     const int na_value              = 0) {
+
+  if (dims.length() < 2 || dims.length() > 3 || (dims.length() == 3 && dims[2] != 3)) {
+    stop("image_writer(): 'dims' must be c(nrow, ncol) or c(nrow, ncol, 3)");
+  }
+  if (dims[0] < 1 || dims[1] < 1) {
+    stop("image_writer(): Image must not be empty");
+  }
+  if (compression < DEFLATE_STORED || compression > DEFLATE_BALANCED) {
+    stop("image_writer(): 'compression' must be in the range [0, 3]");
+  }
+  if (filter < PNG_FILTER_NONE || filter > PNG_FILTER_ADAPTIVE) {
+    stop("image_writer(): 'filter' must be in the range [0, 5]");
+  }
+  if (bits != 8 && bits != 16) {
+    stop("image_writer(): 'bits' must be 8 or 16");
+  }
+  if (intensity_factor <= 0) {
+    stop("image_writer(): 'intensity_factor' must be positive");
+  }
+  if (na_value < 0 || na_value > 255) {
+    stop("image_writer(): 'na_value' must be in the range [0, 255]");
+  }
+
+  const unsigned int depth = dims.length() == 3 ? 3 : 1;
+  const unsigned int nrow  = convert_to_row_major ? dims[0] : dims[1];
+  const unsigned int ncol  = convert_to_row_major ? dims[1] : dims[0];
+
+  double scale_factor = bits == 16 ? 65535.0 : 255.0;
+  unsigned int maxval = bits == 16 ? 65535 : 255;
+  if (pal.isNotNull()) {
+    if (depth != 1) {
+      stop("Can't have a palette unless depth = 1");
+    }
+    if (bits != 8) {
+      stop("image_writer(): Can't have a palette unless bits = 8");
+    }
+    maxval = Rcpp::IntegerMatrix(pal).nrow() - 1;
+    if ((unsigned int)na_value > maxval) {
+      stop("image_writer(): 'na_value' must be an index into the palette");
+    }
+    scale_factor = maxval;
+  }
+
+  scale_factor *= intensity_factor;
+
+  double round_offset = 0.5;
+  if (invert) {
+    round_offset = -1.5;
+    scale_factor = -scale_factor;
+  }
+
+  const SampleScale scale(scale_factor, round_offset, invert, maxval,
+                          bits == 16 ? na_value * 257 : na_value);
+
+  PngWriter *writer = new PngWriter(filename, nrow, ncol, depth, convert_to_row_major,
+                                    scale, pal, compression, filter, bits);
+
+  return XPtr<ImageWriter>(writer, true);
+}
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Generate a row of a test pattern.  Each row is calculated from the row
+// and column numbers as it is needed, so there is no image data in memory.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct PatternRows {
+  unsigned int ncol;
+  unsigned int depth;
+
+  void operator()(unsigned char *uc, unsigned int row) const {
+    for (unsigned int col = 0; col < ncol; col++) {
+      for (unsigned int p = 0; p < depth; p++) {
+        *uc++ = (unsigned char)(row + col + 85 * p);
+      }
+    }
+  }
+};
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' Write a generated test pattern to an uncompressed PNG
+//'
+//' Internal.  Exists so the tests can write multi-gigabyte images without
+//' needing a multi-gigabyte array in R.  The value of plane \code{p} at
+//' \code{[row, col]} (all 0-based) is \code{(row + col + 85 * p) \%\% 256}
+//'
+//' @param filename output filename
+//' @param nrow,ncol image size
+//' @param depth 1 for grey, 3 for RGB. Default: 1
+//' @param threads number of threads. Default: 1
+//'
+//' @return size of the PNG file in bytes
+//'
+//' @noRd
+// [[Rcpp::export(.write_png_pattern)]]
+double write_png_pattern(const std::string filename,
+                         const int nrow,
+                         const int ncol,
+                         const int depth   = 1,
+                         const int threads = 1) {
+
+  if (nrow < 1 || ncol < 1) {
+    stop("write_png_pattern(): 'nrow' and 'ncol' must be positive");
+  }
+  if (depth != 1 && depth != 3) {
+    stop("write_png_pattern(): 'depth' must be 1 or 3");
+  }
+
+  std::ofstream outfile;
+  outfile.open(filename, std::ios::out | std::ios::binary);
+
+  write_PNG_signature(outfile);
+  write_IHDR(outfile, ncol, nrow, depth == 3 ? 2 : 0, 8);
+
+  PatternRows rows = { (unsigned int)ncol, (unsigned int)depth };
+  write_png_rows(outfile, rows, nrow, (size_t)ncol * depth, depth, DEFLATE_STORED,
+                 PNG_FILTER_NONE, threads);
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // IEND
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   write_IEND(outfile);
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Close stream
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  double file_size = (double)(std::streamoff)outfile.tellp();
   outfile.close();
 
+  return file_size;
 }
 
 
 
-
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 // Comparing the CRC32 implementations
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -1,298 +1,209 @@
 #include <fstream>
+#include <sstream>
+#include <vector>
 #include "Rcpp.h"
 
 using namespace Rcpp;
 
-#define BUFFER_ROWS 20
+#include "quantise.h"
+#include "pixels.h"
+#include "samples.h"
+#include "image-writer.h"
+#include "output.h"
+
+#define BUFFER_ROWS QUANTISE_BAND_ROWS
 
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //
-// ooooooooo.             oooo                .       .
-// `888   `Y88.           `888              .o8     .o8
-//  888   .d88'  .oooo.    888   .ooooo.  .o888oo .o888oo  .ooooo.
-//  888ooo88P'  `P  )88b   888  d88' `88b   888     888   d88' `88b
-//  888          .oP"888   888  888ooo888   888     888   888ooo888
-//  888         d8(  888   888  888    .o   888 .   888 . 888    .o
-// o888o        `Y888""8o o888o `Y8bod8P'   "888"   "888" `Y8bod8P'
+//  .ooooo.        oooooooooo.   ooooo ooooooooooooo
+// d88'   `8.      `888'   `Y8b  `888' 8'   888   `8
+// Y88..  .8'       888     888   888       888
+//  `88888b.        888oooo888'   888       888
+// .8'  ``88b       888    `88b   888       888
+// `8.   .88P       888    .88P   888       888
+//  `boood8'       o888bood8P'   o888o     o888o
 //
 //
-// - Write PALETTE image data
+// - Write 8 bit GREY, RGB or PALETTE data from any pixel source (see
+//   pixels.h).  PNM has no framing, so the rows are written as they are.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_pnm_grey_data_with_palette(std::ofstream &outfile, NumericVector vec,
-                                      const unsigned int ncol,
-                                      const unsigned int nrow,
-                                      const double scale_factor,
-                                      const double round_offset,
-                                      const bool convert_to_row_major,
-                                      const bool flipy,
-                                      const IntegerMatrix pal) {
-
-  unsigned int depth = 3;
-
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Sanity check
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (pal.nrow() < 2 | pal.nrow() > 256 | pal.ncol() != 3) {
-    stop("\'pal\' must be a N x 3 IntegerMatrix with values in the range [0,255]");
-  }
+template <class Pix>
+void write_pnm_pixels(std::ostream &outfile, const Pix &px) {
 
+  const size_t rowbytes = (size_t)px.ncol * Pix::CHANNELS;
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Set up buffer to write only BUFFER_ROWS rows a time
-  // Reduces memory usage (by not allocating full size copy of the image)
+  // If the output is in memory (raw vector or mapped file) with room for
+  // the whole image, the pixels are written straight into it.
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  unsigned int buffer_size = BUFFER_ROWS * ncol * depth;
-  unsigned int remainder_size = (nrow % BUFFER_ROWS) * ncol * depth;
-  unsigned char *uc0 = (unsigned char *) calloc(buffer_size, sizeof(unsigned char));
-  if (!uc0) stop("write_pnm_grey_data_with_palette(): out of memory");
-  unsigned char *uc = uc0;
+  unsigned char *direct = claim_output(outfile, (size_t)px.nrow * rowbytes);
+  if (direct) {
+    px.fill_image(direct);
+    return;
+  }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Get a pointer to the actual data in the supplied matrix
+  // Otherwise set up buffer to write only BUFFER_ROWS rows a time
+  // Reduces memory usage (by not allocating full size copy of the image)
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  double *v0 = (double *)vec.begin();
-
-
-  if (convert_to_row_major) {
-    // Convert from R's column-major ordering to row-major output order
-    for (unsigned int row = 0; row < nrow; row++) {
-      unsigned int j = flipy ? nrow - 1 - row : row;
-      for (unsigned int col = 0; col < ncol; col ++) {
-        unsigned char val = (unsigned char)(v0[j] * scale_factor + round_offset);
-        *uc++ = pal(val, 0);
-        *uc++ = pal(val, 1);
-        *uc++ = pal(val, 2);
-        j += nrow;
-      }
+  unsigned char *uc0 = (unsigned char *) calloc((size_t)BUFFER_ROWS * rowbytes, sizeof(unsigned char));
+  if (!uc0) stop("write_pnm_pixels(): out of memory");
 
-      // Flush the buffer to file
-      if ((row + 1) % BUFFER_ROWS == 0) {
-        outfile.write((char *)uc0, sizeof(unsigned char) * buffer_size);
-        uc = uc0;
-      }
-    }
-  } else {
-    // Write pixels in R's column-major ordering
-    for (unsigned int row = 0; row < nrow; row++) {
-      const unsigned int offset = flipy ? nrow - 1 - row : row;
-      double *v = v0 + ncol * offset;
-      for (unsigned int col = 0; col < ncol; col ++) {
-        unsigned char val = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = pal(val, 0);
-        *uc++ = pal(val, 1);
-        *uc++ = pal(val, 2);
-      }
-
-      // Flush the buffer to file
-      if ((row + 1) % BUFFER_ROWS == 0) {
-        outfile.write((char *)uc0, sizeof(unsigned char) * buffer_size);
-        uc = uc0;
-      }
-    }
+  for (unsigned int row = 0; row < px.nrow; row += BUFFER_ROWS) {
+    const unsigned int n = px.nrow - row < BUFFER_ROWS ? px.nrow - row : BUFFER_ROWS;
+    px.fill(uc0, rowbytes, row, n, 0, px.ncol);
+    outfile.write((char *)uc0, sizeof(unsigned char) * n * rowbytes);
   }
 
-
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Flush any remaining values to file
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  outfile.write((char *)uc0, sizeof(unsigned char) * remainder_size);
-
   free(uc0);
 }
 
 
-
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-//
-// ooooooooo.     .oooooo.    oooooooooo.
-// `888   `Y88.  d8P'  `Y8b   `888'   `Y8b
-//  888   .d88' 888            888     888
-//  888ooo88P'  888            888oooo888'
-//  888`88b.    888     ooooo  888    `88b
-//  888  `88b.  `88.    .88'   888    .88P
-// o888o  o888o  `Y8bood8P'   o888bood8P'
-//
-//
-// - Write RGB data
+// Functors for with_pixels(): write the pixels as they are, or look them up
+// in a palette first
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_pnm_RGB_data(std::ofstream &outfile,
-                        const NumericVector vec,
-                        const unsigned int ncol,
-                        const unsigned int nrow,
-                        const double scale_factor,
-                        const double round_offset,
-                        const bool convert_to_row_major,
-                        const bool flipy) {
+struct PnmPixelWriter {
+  std::ostream &outfile;
 
-  unsigned int depth = 3;
+  template <class Pix>
+  void operator()(const Pix &px) const {
+    write_pnm_pixels(outfile, px);
+  }
+};
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Set up buffer to write only BUFFER_ROWS rows a time
-  // Reduces memory usage (by not allocating full size copy of the image)
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  unsigned int buffer_size = BUFFER_ROWS * ncol * depth;
-  unsigned int remainder_size = (nrow % BUFFER_ROWS) * ncol * depth;
-  unsigned char *uc0 = (unsigned char *) calloc(buffer_size, sizeof(unsigned char));
-  if (!uc0) stop("write_pnm_RGB_data(): out of memory");
-  unsigned char *uc = uc0;
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Get a pointer to the actual data in the supplied matrix
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  double *v0 = (double *)vec.begin();
-
-
-  if (convert_to_row_major) {
-    // Convert from R's column-major ordering to row-major output order
-    // Red, Green and Blue values are in different array planes, but
-    // reordered to be written consecutively
-    for (unsigned int row = 0; row < nrow; row++) {
-      const unsigned int offset = flipy ? nrow - 1 - row : row;
-      unsigned int r = offset;
-      unsigned int g = offset + nrow * ncol;
-      unsigned int b = offset + nrow * ncol * 2;
-      for (unsigned int col = 0; col < ncol; col ++) {
-        *uc++ = (unsigned char)(v0[r] * scale_factor + round_offset);
-        *uc++ = (unsigned char)(v0[g] * scale_factor + round_offset);
-        *uc++ = (unsigned char)(v0[b] * scale_factor + round_offset);
-        r += nrow;
-        g += nrow;
-        b += nrow;
-      }
-
-      // Flush the buffer to file
-      if ((row + 1) % BUFFER_ROWS == 0) {
-        outfile.write((char *)uc0, sizeof(unsigned char) * buffer_size);
-        uc = uc0;
-      }
-    }
-  } else {
-    // Write pixels in R's column-major ordering
-    for (unsigned int row = 0; row < nrow; row++) {
-      const unsigned int offset = flipy ? nrow - 1 - row : row;
-      double *r = v0 + ncol * offset;
-      double *g = v0 + ncol * offset + nrow * ncol;
-      double *b = v0 + ncol * offset + nrow * ncol * 2;
-      for (unsigned int col = 0; col < ncol; col ++) {
-        *uc++ = (unsigned char)(*r++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*g++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*b++ * scale_factor + round_offset);
-      }
-
-      // Flush the buffer to file
-      if ((row + 1) % BUFFER_ROWS == 0) {
-        outfile.write((char *)uc0, sizeof(unsigned char) * buffer_size);
-        uc = uc0;
-      }
-    }
+struct PnmPaletteWriter {
+  std::ostream &outfile;
+  const int    *pal;
+  unsigned int  npal;
+
+  template <class Pix>
+  void operator()(const Pix &px) const {
+    write_pnm_pixels(outfile, PalettePixels<Pix>(px, pal, npal));
   }
+};
 
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Flush any remaining values to file
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  outfile.write((char *)uc0, sizeof(unsigned char) * remainder_size);
 
-  free(uc0);
+void write_pnm_8bit_data(std::ostream &outfile,
+                         SEXP vec,
+                         const unsigned int ncol,
+                         const unsigned int nrow,
+                         const unsigned int depth,
+                         const SampleScale &scale,
+                         const bool convert_to_row_major,
+                         const bool flipy,
+                         const bool has_palette,
+                         const IntegerMatrix pal) {
+
+  PixelData data = pixel_data(vec, nrow, ncol, scale);
+
+  if (has_palette) {
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    // Sanity check
+    //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    if (pal.nrow() < 2 | pal.nrow() > 256 | pal.ncol() != 3) {
+      stop("\'pal\' must be a N x 3 IntegerMatrix with values in the range [0,255]");
+    }
+    PnmPaletteWriter writer = { outfile, pal.begin(), (unsigned int)pal.nrow() };
+    with_pixels_planes<1>(writer, data, convert_to_row_major, flipy);
+  } else {
+    PnmPixelWriter writer = { outfile };
+    with_pixels(writer, data, depth, convert_to_row_major, flipy);
+  }
 }
 
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //
-//   .oooooo.
-//  d8P'  `Y8b
-// 888           oooo d8b  .ooooo.  oooo    ooo
-// 888           `888""8P d88' `88b  `88.  .8'
-// 888     ooooo  888     888ooo888   `88..8'
-// `88.    .88'   888     888    .o    `888'
-//  `Y8bood8P'   d888b    `Y8bod8P'     .8'
-//                                  .o..P'
-//                                  `Y8P'
+//  .o    .ooo
+// o888   .88'
+//  888  d88'        oooooooooo.   ooooo ooooooooooooo
+//  888 d888P"Ybo.   `888'   `Y8b  `888' 8'   888   `8
+//  888 Y88[   ]88    888     888   888       888
+//  888 `Y88   88P    888oooo888'   888       888
+// o888o `88bod8'     888    `88b   888       888
+//                    888    .88P   888       888
+//                   o888bood8P'   o888o     o888o
 //
 //
-// - Write GREY data
+// - Write 16 bit GREY or RGB data
+// - PGM/PPM with maxval > 255 store each sample as 2 bytes, most significant
+//   byte first.  quantise16_be() writes these directly into the buffer.
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-void write_pnm_grey_data(std::ofstream &outfile,
-                         const NumericVector vec,
-                         const unsigned int ncol,
-                         const unsigned int nrow,
-                         const double scale_factor,
-                         const double round_offset,
-                         const bool convert_to_row_major,
-                         const bool flipy) {
-
-  unsigned int depth = 1;
+void write_pnm_16bit_data(std::ostream &outfile,
+                          const NumericVector vec,
+                          const unsigned int ncol,
+                          const unsigned int nrow,
+                          const unsigned int depth,
+                          const SampleScale &scale,
+                          const bool convert_to_row_major,
+                          const bool flipy) {
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Set up buffer to write only BUFFER_ROWS rows a time
   // Reduces memory usage (by not allocating full size copy of the image)
-  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  unsigned int buffer_size = BUFFER_ROWS * ncol * depth;
-  unsigned int remainder_size = (nrow % BUFFER_ROWS) * ncol * depth;
-  unsigned char *uc0 = (unsigned char *) calloc(buffer_size, sizeof(unsigned char));
-  if (!uc0) stop("write_pnm_grey_data(): out of memory");
+  //
+  // If the output is in memory (raw vector or mapped file) with room for
+  // the whole image, the pixels are written straight into it instead.
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const size_t row_size = (size_t)ncol * depth * 2;
+  size_t buffer_size = BUFFER_ROWS * row_size;
+  size_t remainder_size = (nrow % BUFFER_ROWS) * row_size;
+  unsigned char *direct = claim_output(outfile, nrow * row_size);
+  unsigned char *uc0 = direct ? direct : (unsigned char *) calloc(buffer_size, sizeof(unsigned char));
+  if (!uc0) stop("write_pnm_16bit_data(): out of memory");
   unsigned char *uc = uc0;
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Get a pointer to the actual data in the supplied vector
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  double *v0 = (double *)vec.begin();
+  const double *v0 = (const double *)vec.begin();
+  const size_t plane = (size_t)nrow * ncol;
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Convert from R's column-major ordering to row-major output order
+  // Row-major output walks along an R row (stride 'nrow').
+  // Column-major output walks along an R column (stride 1).
+  // Each colour plane is written separately, interleaved into the row.
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (convert_to_row_major) {
-    for (unsigned int row = 0; row < nrow; row++) {
-      unsigned int j = flipy ? nrow - 1 - row : row;
-      for (unsigned int col = 0; col < ncol; col++) {
-        *uc++ = (unsigned char)(v0[j] * scale_factor + round_offset);
-        j += nrow;
-      }
+  for (unsigned int row = 0; row < nrow; row++) {
+    const size_t offset = flipy ? nrow - 1 - row : row;
+    const double *v      = convert_to_row_major ? v0 + offset : v0 + ncol * offset;
+    const size_t vstride = convert_to_row_major ? nrow : 1;
 
-      // Flush the buffer to file
-      if ((row + 1) % BUFFER_ROWS == 0) {
-        outfile.write((char *)uc0, sizeof(unsigned char) * buffer_size);
-        uc = uc0;
-      }
+    for (unsigned int p = 0; p < depth; p++) {
+      quantise16_be(uc + 2 * p, 2 * depth, v + plane * p, vstride, ncol, scale);
     }
-  } else {
-    // Write pixels in R's column-major ordering
-    for (unsigned int row = 0; row < nrow; row++) {
-      unsigned int col = 0;
-      const unsigned int offset = flipy ? nrow - 1 - row : row;
-      double *v = v0 + ncol * offset;
-      for (; col <= ncol - 8; col+=8) {
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-      }
-      for (; col < ncol; col++) {
-        *uc++ = (unsigned char)(*v++ * scale_factor + round_offset);
-      }
-
-
-      // Flush the buffer to file
-      if ((row + 1) % BUFFER_ROWS == 0) {
-        outfile.write((char *)uc0, sizeof(unsigned char) * buffer_size);
-        uc = uc0;
-      }
+    uc += row_size;
+
+    // Flush the buffer to file
+    if (!direct && (row + 1) % BUFFER_ROWS == 0) {
+      outfile.write((char *)uc0, sizeof(unsigned char) * buffer_size);
+      uc = uc0;
     }
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Flush any remaining values to file
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  outfile.write((char *)uc0, sizeof(unsigned char) * remainder_size);
+  if (!direct) {
+    outfile.write((char *)uc0, sizeof(unsigned char) * remainder_size);
+    free(uc0);
+  }
+}
 
-  free(uc0);
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// PNM header: P5 (grey) or P6 (RGB), then the width, height and maxval
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+std::string pnm_header(const unsigned int channels, const unsigned int ncol,
+                       const unsigned int nrow, const unsigned int maxval) {
+  std::ostringstream header;
+  header << (channels == 1 ? "P5" : "P6") << "\n" << ncol << " " << nrow << "\n" << maxval << "\n";
+  return header.str();
 }
 
 
@@ -300,10 +211,12 @@ void write_pnm_grey_data(std::ofstream &outfile,
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 //' Write a vector of numeric data to a PNM file
 //'
-//' @param vec numeric vector of data
+//' @param vec numeric, integer, logical, raw or float32 vector of data
 //' @param dims integer vector of length 2 i.e. \code{c(nrow, ncol)} for a matrix/grey image and of
 //'        length 3 i.e \code{c(nrow, ncol, 3)} for array/RGB output.
-//' @param filename output filename e.g "example.pgm"
+//' @param filename output filename e.g "example.pgm", an R connection or a
+//'        file descriptor (e.g. 1 for stdout). If NULL, the image is returned
+//'        as a raw vector instead.
 //' @param convert_to_row_major Convert to row-major order before output. R stores matrix
 //'        and array data in column-major order. In order to output row-major order (as
 //'        expected by most image formats) data ordering must be converted. If this argument
@@ -317,23 +230,34 @@ void write_pnm_grey_data(std::ofstream &outfile,
 //'        converted into a negative. Dark areas become bright and bright areas become dark.
 //'        Default: FALSE
 //' @param intensity_factor Multiplication factor applied to all values in image
-//'        (note: no checking is performed to ensure values remain in range [0, 1]).
+//'        (values which end up outside [0, 1] are clamped to the ends of the scale).
 //'        If intensity_factor <= 0, then automatically determine (and apply) a multiplication factor
 //'        to set the maximum value to 1.0. Default: intensity_factor = 1.0
 //' @param pal integer matrix of size 256x3 with values in the range [0, 255]. Each
 //'        row represents the r, g, b colour for a given grey index value. Only used
 //'        if \code{vec} is a matrix
+//' @param bits bits per channel. 8 or 16.  16 bit images are written with
+//'        maxval 65535 and big-endian samples, and can not use a palette.
+//'        Default: 8
+//' @param na_value the grey/RGB level in [0, 255] (or palette index) written
+//'        for NA and NaN values.  Values outside [0, 1] are always clamped
+//'        to the ends of the scale.  Default: 0
+//'
+//' @return If \code{filename} is NULL, a raw vector containing the image.
+//'         Otherwise NULL.
 //'
 //'
 // [[Rcpp::export]]
-void write_pnm_core(const NumericVector vec,
+SEXP write_pnm_core(SEXP vec,
                     const IntegerVector dims,
-                    const std::string filename,
+                    SEXP filename,
                     const bool convert_to_row_major = true,
                     const bool flipy                = false,
                     const bool invert               = false,
                     const double intensity_factor   = 1,
-                    Rcpp::Nullable<Rcpp::IntegerMatrix> pal = R_NilValue) {
+                    Rcpp::Nullable<Rcpp::IntegerMatrix> pal = R_NilValue,
+                    const int bits                  = 8,
+                    const int na_value              = 0) {
 
   unsigned int nrow = dims[0];
   unsigned int ncol = dims[1];
@@ -350,6 +274,13 @@ void write_pnm_core(const NumericVector vec,
     depth = 3;
   }
 
+  if (bits != 8 && bits != 16) {
+    stop("write_pnm(): 'bits' must be 8 or 16");
+  }
+
+  if (na_value < 0 || na_value > 255) {
+    stop("write_pnm(): 'na_value' must be in the range [0, 255]");
+  }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // If writing in column-major, swap 'nrow' and 'ncol'
@@ -362,9 +293,11 @@ void write_pnm_core(const NumericVector vec,
 
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Default: Scale to range [0, 255]
+  // Default: Scale to range [0, 255], or [0, 65535] for 16 bits
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  double scale_factor = 255.0;
+  const unsigned int maxval = bits == 16 ? 65535 : 255;
+  double scale_factor = maxval;
+  unsigned int last_sample  = maxval;
 
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -376,22 +309,34 @@ void write_pnm_core(const NumericVector vec,
     stop("Can't have a palette unless depth = 1");
   }
 
+  if (has_palette && bits != 8) {
+    stop("write_pnm(): Can't have a palette unless bits = 8");
+  }
+
   if (has_palette) {
     Rcpp::IntegerMatrix pal_(pal);
+    if (na_value >= pal_.nrow()) {
+      stop("write_pnm(): 'na_value' must be an index into the palette");
+    }
     scale_factor = pal_.nrow() - 1;
+    last_sample  = pal_.nrow() - 1;
   }
 
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Integer, logical and raw data is read in place (see samples.h)
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  RObject samples = pixel_samples(vec);
 
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Scale the intensity
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (intensity_factor <= 0) {
-    double *max_value = (double *)std::max_element(vec.begin(), vec.end());
-    if (*max_value == 0) {
-      *max_value = 1;
+    double max_value = max_sample(samples);
+    if (max_value == 0) {
+      max_value = 1;
     }
-    scale_factor /= *max_value;
+    scale_factor /= max_value;
   } else {
     scale_factor *= intensity_factor;
   }
@@ -400,42 +345,185 @@ void write_pnm_core(const NumericVector vec,
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Invert the colours?
-  // Rounding offset is -1.5 in order to take advantage of the way a
-  // 'double' is truncated to an 'unsigned char'
+  // Rounding offset is -1.5 so that values truncate to [-(maxval + 1), -1],
+  // which SampleScale's bias brings back to [maxval, 0].  This is the same
+  // scale as write_png()
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   if (invert) {
     round_offset = -1.5;
-    scale_factor = -scale_factor + 1;
+    scale_factor = -scale_factor;
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Open the output and write a PNM header
+  // Values outside the scale saturate, and NA becomes 'na_value' (scaled up
+  // to 16 bits)
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  std::ofstream outfile;
-  outfile.open(filename, std::ios::out | std::ios::binary);
-  if (depth == 1 && !has_palette) {
-    outfile << "P5" << std::endl << ncol << " " << nrow << std::endl << 255 << std::endl;
-  } else {
-    outfile << "P6" << std::endl << ncol << " " << nrow << std::endl << 255 << std::endl;
-  }
+  const SampleScale scale(scale_factor, round_offset, invert, last_sample,
+                          bits == 16 ? na_value * 257 : na_value);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // PNM header.  Built first, so that the exact size of the output is known
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  const unsigned int channels  = (depth == 1 && !has_palette) ? 1 : 3;
+  const std::string  header    = pnm_header(channels, ncol, nrow, maxval);
+  const size_t       data_size = (size_t)nrow * ncol * channels * (bits / 8);
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Open the output and write the header
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  ImageOutput output(filename, header.size() + data_size, true);
+  std::ostream &outfile = output.stream();
+  outfile << header;
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
   // Write the data appropriately
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  if (depth == 1 && !has_palette) {
-    write_pnm_grey_data(outfile, vec, ncol, nrow, scale_factor, round_offset, convert_to_row_major, flipy);
-  } else if (depth == 1 && has_palette) {
-    Rcpp::IntegerMatrix pal_(pal);
-    write_pnm_grey_data_with_palette(outfile, vec, ncol, nrow, scale_factor, round_offset, convert_to_row_major, flipy, pal_);
+  if (bits == 16) {
+    write_pnm_16bit_data(outfile, numeric_samples(samples), ncol, nrow, depth, scale, convert_to_row_major, flipy);
   } else {
-    write_pnm_RGB_data (outfile, vec, ncol, nrow, scale_factor, round_offset, convert_to_row_major, flipy);
+    Rcpp::IntegerMatrix pal_ = has_palette ? Rcpp::IntegerMatrix(pal) : Rcpp::IntegerMatrix();
+    write_pnm_8bit_data(outfile, samples, ncol, nrow, depth, scale, convert_to_row_major, flipy, has_palette, pal_);
   }
 
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  // Close the output stream
+  // Close the file, or return the raw vector
   //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-  outfile.close();
+  return output.close();
 }
 
 
 
+
+
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A PNM file written a block of rows at a time (see image-writer.h)
+//
+// PNM has no state between rows, so each block is written exactly as if it
+// were a whole image on its own.
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class PnmWriter : public ImageWriter {
+public:
+  PnmWriter(SEXP filename, unsigned int nrow, unsigned int ncol,
+            unsigned int depth, bool convert_to_row_major, const SampleScale &scale,
+            Rcpp::Nullable<Rcpp::IntegerMatrix> pal, unsigned int bits);
+
+private:
+  SampleScale   scale;
+  bool          has_palette;
+  IntegerMatrix pal;
+  unsigned int  bits;
+
+  void write_rows(SEXP block, unsigned int block_rows);
+  void write_trailer() {}
+};
+
+
+PnmWriter::PnmWriter(SEXP filename, unsigned int nrow, unsigned int ncol,
+                     unsigned int depth, bool convert_to_row_major, const SampleScale &scale,
+                     Rcpp::Nullable<Rcpp::IntegerMatrix> pal, unsigned int bits) :
+  ImageWriter(filename, nrow, ncol, depth, convert_to_row_major),
+  scale(scale), has_palette(pal.isNotNull()), bits(bits) {
+
+  if (has_palette) {
+    this->pal = IntegerMatrix(pal);
+  }
+
+  const unsigned int channels = (depth == 1 && !has_palette) ? 1 : 3;
+  outfile << pnm_header(channels, ncol, nrow, bits == 16 ? 65535 : 255);
+}
+
+
+void PnmWriter::write_rows(SEXP block, unsigned int block_rows) {
+  if (bits == 16) {
+    write_pnm_16bit_data(outfile, numeric_samples(block), ncol, block_rows, depth, scale, convert_to_row_major, false);
+  } else {
+    write_pnm_8bit_data(outfile, block, ncol, block_rows, depth, scale, convert_to_row_major, false, has_palette, pal);
+  }
+}
+
+
+//~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//' Open a PNM file to be written a block of rows at a time
+//'
+//' @param filename output filename, connection, file descriptor or NULL.
+//'        See \code{write_pnm_core}
+//' @param dims dimensions of the whole image as R data i.e. \code{c(nrow, ncol)}
+//'        for grey and \code{c(nrow, ncol, 3)} for RGB
+//' @param convert_to_row_major,invert,pal,bits,na_value
+//'        See \code{write_pnm_core}
+//' @param intensity_factor multiplication factor applied to all values.
+//'        Must be positive, as the maximum of the whole image is never known.
+//'
+//' @return external pointer to the writer
+//'
+//' @noRd
+// [[Rcpp::export(.pnm_writer_open)]]
+SEXP pnm_writer_open(SEXP filename,
+                     const IntegerVector dims,
+                     const bool convert_to_row_major = true,
+                     const bool invert               = false,
+                     const double intensity_factor   = 1,
+                     Rcpp::Nullable<Rcpp::IntegerMatrix> pal = R_NilValue,
+                     const int bits                  = 8,
+                     const int na_value              = 0) {
+
+  if (dims.length() < 2 || dims.length() > 3 || (dims.length() == 3 && dims[2] != 3)) {
+    stop("image_writer(): 'dims' must be c(nrow, ncol) or c(nrow, ncol, 3)");
+  }
+  if (dims[0] < 1 || dims[1] < 1) {
+    stop("image_writer(): Image must not be empty");
+  }
+  if (bits != 8 && bits != 16) {
+    stop("image_writer(): 'bits' must be 8 or 16");
+  }
+  if (intensity_factor <= 0) {
+    stop("image_writer(): 'intensity_factor' must be positive");
+  }
+  if (na_value < 0 || na_value > 255) {
+    stop("image_writer(): 'na_value' must be in the range [0, 255]");
+  }
+
+  const unsigned int depth = dims.length() == 3 ? 3 : 1;
+  const unsigned int nrow  = convert_to_row_major ? dims[0] : dims[1];
+  const unsigned int ncol  = convert_to_row_major ? dims[1] : dims[0];
+
+  double scale_factor = bits == 16 ? 65535 : 255;
+  unsigned int maxval = bits == 16 ? 65535 : 255;
+  if (pal.isNotNull()) {
+    if (depth != 1) {
+      stop("Can't have a palette unless depth = 1");
+    }
+    if (bits != 8) {
+      stop("image_writer(): Can't have a palette unless bits = 8");
+    }
+    Rcpp::IntegerMatrix pal_(pal);
+    if (pal_.nrow() < 2 || pal_.nrow() > 256 || pal_.ncol() != 3) {
+      stop("\'pal\' must be a N x 3 IntegerMatrix with values in the range [0,255]");
+    }
+    if (na_value >= pal_.nrow()) {
+      stop("image_writer(): 'na_value' must be an index into the palette");
+    }
+    scale_factor = pal_.nrow() - 1;
+    maxval       = pal_.nrow() - 1;
+  }
+
+  scale_factor *= intensity_factor;
+
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  // Same inversion and clamping as write_pnm_core()
+  //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  double round_offset = 0.5;
+  if (invert) {
+    round_offset = -1.5;
+    scale_factor = -scale_factor;
+  }
+  const SampleScale scale(scale_factor, round_offset, invert, maxval,
+                          bits == 16 ? na_value * 257 : na_value);
+
+  PnmWriter *writer = new PnmWriter(filename, nrow, ncol, depth, convert_to_row_major,
+                                    scale, pal, bits);
+
+  return XPtr<ImageWriter>(writer, true);
+}